@@ -1,6 +1,8 @@
 #ifndef RDBCOMPARE_HPP
 #define RDBCOMPARE_HPP
 
+#include <stddef.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -8,11 +10,333 @@ extern "C" {
 void rdbcompare_init();
 void rdbcompare_cleanup();
 
+// Изменяет настройку библиотеки по имени (branch_cache_ttl, validate_branches,
+// persist_cache, arch_query, cache_dir, evr_ranks, evr_rank_bytes, api_base, endpoints,
+// endpoints_file, probe_interval, probe_timeout_ms, connect_timeout_ms, timeout, low_speed_limit,
+// low_speed_time, retries, retry_backoff_ms, hedge, hedge_delay_ms, compression, sharded,
+// shard_arches, shard_connections, http2, reuse_connections, memo_size, memo_bytes, persist_memo,
+// fragment_cache_bytes, coalesce_fetches, snapshot_cache_bytes, snapshot_ttl).
+// Возвращает 0 при успехе и -1 при ошибке.
+int rdbcompare_set_option(const char* name, const char* value);
+
 char* fetch_package_list(const char* branch);
 
 
+// Побайтно одинаковые данные веток разбираются один раз и не сравниваются. Ответы
+// compare_packages и compare_packages_ex запоминаются по хэшам входных данных и
+// параметрам (memo_size, memo_bytes; с persist_memo - и на диске), так что повторное
+// сравнение тех же данных не разбирает их заново. Если данные изменились, архитектуры,
+// отпечатки которых в обеих ветках те же, что в одном из прежних сравнений, не
+// сравниваются: их JSON берётся готовым (fragment_cache_bytes).
 char* compare_packages(const char* branch1_data, const char* branch2_data);
 
+// --- Параметры сравнения ---
+// Фильтры применяются при разборе JSON: пакеты других архитектур и имён
+// отбрасываются сразу. Шаблон имени - glob ("python3-*", "lib*ssl?").
+typedef struct rdbcompare_options rdbcompare_options_t;
+
+rdbcompare_options_t* rdbcompare_options_new(void);
+void rdbcompare_options_free(rdbcompare_options_t* options);
+int rdbcompare_options_add_arch(rdbcompare_options_t* options, const char* arch);
+int rdbcompare_options_add_name_pattern(rdbcompare_options_t* options, const char* pattern);
+
+// Варианты с параметрами; options == NULL равносилен вызову без них.
+// При фильтре из одной архитектуры она передаётся серверу в запросе (настройка arch_query).
+// С настройкой sharded ветка загружается параллельными запросами по архитектурам (из
+// фильтра, shard_arches или /site/all_pkgset_archs) и склеивается в один ответ.
+// Одновременные вызовы, запросившие тот же список пакетов (ветка, фильтр, сервер), делят
+// одну передачу и получают копии одного ответа или одну ошибку (coalesce_fetches). Отмена
+// одного из них не прерывает загрузку для остальных.
+char* fetch_package_list_ex(const char* branch, const rdbcompare_options_t* options);
+char* compare_packages_ex(const char* branch1_data, const char* branch2_data, const rdbcompare_options_t* options);
+
+// --- Отмена загрузки ---
+// fetch_package_list_ex с параметрами, к которым привязан флаг отмены, прерывает
+// передачу (и паузу перед повтором) после rdbcompare_cancel_request и возвращает NULL.
+// rdbcompare_cancel_request можно вызывать из любого потока; флаг должен жить, пока
+// им пользуются параметры.
+typedef struct rdbcompare_cancel rdbcompare_cancel_t;
+
+rdbcompare_cancel_t* rdbcompare_cancel_new(void);
+void rdbcompare_cancel_free(rdbcompare_cancel_t* cancel);
+void rdbcompare_cancel_request(rdbcompare_cancel_t* cancel);
+void rdbcompare_cancel_reset(rdbcompare_cancel_t* cancel);
+int rdbcompare_options_set_cancel(rdbcompare_options_t* options, const rdbcompare_cancel_t* cancel);
+
+// --- Отпечатки архитектур ---
+// Отпечаток архитектуры - 64-битная сумма хэшей пар (имя, EVR) её пакетов после фильтра:
+// не зависит от порядка записей и меняется при любом изменении состава или версий.
+// По нему можно дёшево узнать, какие архитектуры ветки изменились между опросами.
+// Возвращает JSON {"архитектура": "16 шестнадцатеричных цифр", ...} (освобождается free())
+// или NULL при ошибке разбора
+char* rdbcompare_fingerprints_json(const char* branch_data, const rdbcompare_options_t* options);
+
+// --- Покомпонентный доступ к результату сравнения ---
+// rdbcompare_compare возвращает результат, по которому можно пройти курсором без
+// сериализации в JSON. Строки записей указывают внутрь результата и действительны до
+// rdbcompare_result_free; evr1/evr2 - до следующего вызова rdbcompare_result_next.
+
+#define RDBCOMPARE_BRANCH1_ONLY  0
+#define RDBCOMPARE_BRANCH2_ONLY  1
+#define RDBCOMPARE_BRANCH1_NEWER 2
+#define RDBCOMPARE_BRANCH2_NEWER 3
+#define RDBCOMPARE_IDENTICAL     4  // Равные EVR
+#define RDBCOMPARE_EPOCH_ONLY    5  // Различается только эпоха
+#define RDBCOMPARE_CATEGORY_COUNT 6
+
+// Набор категорий - битовая маска: rdbcompare_options_set_categories ограничивает
+// сравнение выбранными категориями (остальные не вычисляются и не выводятся), а
+// rdbcompare_options_set_counts_only оставляет в результате только счётчики, без записей
+// (rdbcompare_result_count работает, курсор пуст, в JSON нет массивов packages).
+// Каждый пакет, найденный в обеих ветках, попадает ровно в одну из категорий
+// branch1_newer, branch2_newer, identical, epoch_only; если epoch_only не выбрана,
+// различие только в эпохе считается обычным "новее". По умолчанию выбраны только
+// branch1_only, branch2_only и branch1_newer - вывод такой же, как у compare_packages.
+#define RDBCOMPARE_CATEGORY_BIT(category) (1u << (category))
+#define RDBCOMPARE_ALL_CATEGORIES ((1u << RDBCOMPARE_CATEGORY_COUNT) - 1)
+#define RDBCOMPARE_DEFAULT_CATEGORIES (RDBCOMPARE_CATEGORY_BIT(RDBCOMPARE_BRANCH1_ONLY) | \
+                                       RDBCOMPARE_CATEGORY_BIT(RDBCOMPARE_BRANCH2_ONLY) | \
+                                       RDBCOMPARE_CATEGORY_BIT(RDBCOMPARE_BRANCH1_NEWER))
+
+int rdbcompare_options_set_categories(rdbcompare_options_t* options, unsigned categories);
+int rdbcompare_options_set_counts_only(rdbcompare_options_t* options, int counts_only);
+
+typedef struct {
+    const char* data;   // Не обязательно завершается нулём
+    size_t size;
+} rdbcompare_str_t;
+
+typedef struct {
+    rdbcompare_str_t arch;
+    rdbcompare_str_t name;
+    int category;                   // RDBCOMPARE_BRANCH1_ONLY и т.д.
+    rdbcompare_str_t category_name; // "branch1_only" и т.д.
+    rdbcompare_str_t epoch1, version1, release1, evr1; // Пустые, если пакета нет в ветке 1
+    rdbcompare_str_t epoch2, version2, release2, evr2; // Пустые, если пакета нет в ветке 2
+} rdbcompare_entry_t;
+
+typedef struct rdbcompare_result rdbcompare_result_t;
+
+rdbcompare_result_t* rdbcompare_compare(const char* branch1_data, const char* branch2_data, const rdbcompare_options_t* options);
+void rdbcompare_result_free(rdbcompare_result_t* result);
+
+size_t rdbcompare_result_arch_count(const rdbcompare_result_t* result);
+const char* rdbcompare_result_arch_name(const rdbcompare_result_t* result, size_t index);
+// Отпечатки архитектуры index в ветках 1 и 2 (0 - архитектуры нет в ветке)
+int rdbcompare_result_arch_fingerprints(const rdbcompare_result_t* result, size_t index,
+                                        unsigned long long* fingerprint1, unsigned long long* fingerprint2);
+// arch == NULL - по всем архитектурам, category < 0 - по всем категориям
+size_t rdbcompare_result_count(const rdbcompare_result_t* result, const char* arch, int category);
+
+// Ограничивает курсор архитектурой и/или категорией и ставит его в начало диапазона
+int rdbcompare_result_seek(rdbcompare_result_t* result, const char* arch, int category);
+// Заполняет entry и возвращает 1, либо 0 в конце диапазона
+int rdbcompare_result_next(rdbcompare_result_t* result, rdbcompare_entry_t* entry);
+// Тот же JSON, что возвращает compare_packages. Пакеты branch2_newer выводятся, как
+// branch1_newer, identical - {"name","evr"}, epoch_only - {"name","branch1_evr","branch2_evr"}
+// (EVR с эпохой, если она ненулевая)
+char* rdbcompare_result_to_json(const rdbcompare_result_t* result);
+
+// --- Потоковый вывод NDJSON ---
+// Каждая различающаяся запись передаётся обработчику отдельной строкой (с '\n' в конце)
+// сразу по мере сравнения: {"arch","category","name","epoch","version","release"}, у
+// пакетов из обеих веток ещё branch2_epoch/branch2_version/branch2_release. Строка действительна
+// только во время вызова; ненулевой возврат обработчика прекращает вывод.
+typedef int (*rdbcompare_line_cb)(int category, const char* line, size_t size, void* userdata);
+
+// Возвращает 0 при успехе и -1 при ошибке входных данных
+int compare_packages_ndjson(const char* branch1_data, const char* branch2_data, const rdbcompare_options_t* options,
+                            rdbcompare_line_cb cb, void* userdata);
+
+// --- Неблокирующий API для внешнего цикла событий ---
+// Библиотека сообщает через socket_cb, какие события ждать на дескрипторе, и через
+// timer_cb - через сколько миллисекунд вызвать rdbcompare_loop_timeout (-1 - отменить таймер).
+// Результаты передаются обработчикам; строки действительны только во время вызова.
+// Все функции цикла вызываются из одного потока; rdbcompare_loop_free нельзя вызывать из обработчиков.
+
+#define RDBCOMPARE_POLL_NONE   0
+#define RDBCOMPARE_POLL_IN     1
+#define RDBCOMPARE_POLL_OUT    2
+#define RDBCOMPARE_POLL_ERROR  4
+#define RDBCOMPARE_POLL_REMOVE 8
+
+typedef struct rdbcompare_loop rdbcompare_loop_t;
+
+typedef void (*rdbcompare_socket_cb)(int fd, int events, void* userdata);
+typedef void (*rdbcompare_timer_cb)(long timeout_ms, void* userdata);
+// data == NULL и error != NULL при ошибке
+typedef void (*rdbcompare_fetch_cb)(int request_id, const char* branch, const char* data, size_t size, const char* error, void* userdata);
+typedef void (*rdbcompare_compare_cb)(int request_id, const char* result_json, const char* error, void* userdata);
+
+rdbcompare_loop_t* rdbcompare_loop_new(rdbcompare_socket_cb socket_cb, rdbcompare_timer_cb timer_cb, void* userdata);
+void rdbcompare_loop_free(rdbcompare_loop_t* loop);
+
+// Ставят запрос в очередь и возвращают его идентификатор или -1
+int rdbcompare_loop_fetch(rdbcompare_loop_t* loop, const char* branch, rdbcompare_fetch_cb cb, void* userdata);
+int rdbcompare_loop_compare(rdbcompare_loop_t* loop, const char* branch1, const char* branch2, rdbcompare_compare_cb cb, void* userdata);
+
+// Уведомления о готовности дескриптора (флаги RDBCOMPARE_POLL_*) и об истечении таймера
+void rdbcompare_loop_socket_ready(rdbcompare_loop_t* loop, int fd, int events);
+void rdbcompare_loop_timeout(rdbcompare_loop_t* loop);
+
+// Отменяет запрос без вызова его обработчика
+void rdbcompare_loop_cancel(rdbcompare_loop_t* loop, int request_id);
+int rdbcompare_loop_pending(const rdbcompare_loop_t* loop);
+
+// --- Статистика ---
+// Счётчики библиотеки одной строкой JSON (освобождается free()): арены снимков
+// и результатов (arenas, arena_allocations/arena_bytes - выделения, обслуженные
+// аренами, arena_blocks/arena_block_bytes - блоки, взятые у кучи) и пулы строк
+// (interned_strings/interned_evrs - различные значения, intern_hits - повторы)
+// и словарь рангов EVR (evr_rank_hits/evr_rank_added/evr_rank_rebuilds, evr_rank_resets -
+// сбросы словаря, переросшего evr_rank_bytes), замеры и переключения зеркал
+// (endpoint_probes/endpoint_failovers), повторы, таймауты и
+// отмены запросов (request_retries/request_timeouts/requests_cancelled) и
+// дублирующие запросы (hedged_requests/hedge_wins), байты ответов по сети и после
+// распаковки (bytes_received/bytes_decoded), загрузки веток частями (sharded_fetches/shards),
+// соединения (connections_opened/connections_reused/http2_transfers), повторные сборки
+// одного имени в архитектуре (duplicate_builds; в сравнение идёт старшая EVR), сравнения
+// одинаковых данных (identical_inputs), кэш результатов (hashed_bytes, memo_hits,
+// memo_disk_hits, memo_misses) и архитектуры, взятые из прежних сравнений или
+// сравненные заново (fragment_hits/fragment_misses), объединённые загрузки списков пакетов
+// (fetch_flights - начатые передачи, fetch_coalesced - вызовы, дождавшиеся чужой передачи)
+// и кэш снимков веток (snapshot_hits, snapshot_misses, snapshot_evictions,
+// snapshot_revalidations - снимки, подтверждённые сервером после snapshot_ttl)
+char* rdbcompare_stats_json(void);
+void rdbcompare_stats_reset(void);
+
+// --- Трассировка ---
+// Запись событий загрузки (запрос целиком и фазы dns/connect/tls/wait/receive, блоки
+// ответа), разбора (tokenize/index/fingerprints), сравнения по архитектурам и вывода с
+// номерами потоков. Результат - JSON в формате Chrome trace-event: открывается в Perfetto
+// (ui.perfetto.dev) или chrome://tracing. Запись общая для процесса (всех контекстов); пока
+// она выключена, событие стоит одной проверки флага. С переменной окружения
+// RDBCOMPARE_TRACE=ФАЙЛ запись идёт с загрузки библиотеки и сохраняется в файл при выходе.
+// rdbcompare_trace_start очищает прежнюю запись; rdbcompare_trace_stop сохраняет её.
+void rdbcompare_trace_start(void);
+void rdbcompare_trace_stop(void);
+// Записанные события (освобождается free()) или сохранение в файл (0 или -1)
+char* rdbcompare_trace_json(void);
+int rdbcompare_trace_write(const char* path);
+
+// Точки USDT провайдера rdbcompare (если библиотека собрана с <sys/sdt.h>) подключаются к
+// работающему процессу без перезапуска: perf probe, bpftrace, SystemTap. Пока инструмент не
+// подключён, аргументы точек не вычисляются. Аргументы:
+//   request_start(curl, url) - начало запроса; curl - id передачи
+//   request_done(curl, url, http_code, bytes, decoded) - передача завершена (bytes - по сети)
+//   chunk(bytes, received) - принят блок ответа
+//   parse_start(data), parse_done(records, packages) - разбор списка пакетов
+//   compare_arch_start(arch, arch_len, packages1, packages2), compare_arch_done(arch, arch_len)
+//   result(entries, arches) - построен результат rdbcompare_compare*
+//   result_json(bytes) - построен JSON compare_packages*
+// Например, задержки запросов:
+//   bpftrace -e 'usdt:librdbcompare.so:rdbcompare:request_start { @t[arg0] = nsecs; }
+//     usdt:librdbcompare.so:rdbcompare:request_done /@t[arg0]/ {
+//       @ms = hist((nsecs - @t[arg0]) / 1000000); delete(@t[arg0]); }' -p PID
+
+// --- Журнал ---
+// Сообщения библиотеки (ошибки загрузки и разбора, повторы запросов, пропущенные записи)
+// по умолчанию пишутся в stderr строками "Error: ..." и "Warning: ...". Журнал общий для
+// процесса. Выводятся сообщения не ниже уровня rdbcompare_set_log_level (по умолчанию
+// RDBCOMPARE_LOG_WARNING; переменная окружения RDBCOMPARE_LOG_LEVEL - число или
+// error/warning/info/debug).
+#define RDBCOMPARE_LOG_ERROR   0
+#define RDBCOMPARE_LOG_WARNING 1
+#define RDBCOMPARE_LOG_INFO    2
+#define RDBCOMPARE_LOG_DEBUG   3
+
+// Обработчик получает уровень, вид сообщения ("http.retry", "parse.missing_fields" и т.д.)
+// и текст без перевода строки; строки действительны только во время вызова. Вызывается в
+// потоке, где возникло сообщение, в том числе одновременно из разных потоков.
+typedef void (*rdbcompare_log_cb)(int level, const char* kind, const char* message, void* userdata);
+
+// callback == NULL - снова stderr. Уровень -1 выключает вывод вовсе
+void rdbcompare_set_log_callback(rdbcompare_log_cb callback, void* userdata);
+void rdbcompare_set_log_level(int level);
+// Частота ограничивается по виду сообщения: не больше burst за interval_ms (по умолчанию 10
+// за 1000 мс; burst == 0 - без ограничения). Подавленные сводятся в одно сообщение того же
+// вида "N similar messages suppressed" - при следующем сообщении после интервала или в
+// rdbcompare_log_flush (её вызывает и rdbcompare_cleanup)
+void rdbcompare_set_log_rate(unsigned burst, long interval_ms);
+void rdbcompare_log_flush(void);
+// Текст последней ошибки (уровня RDBCOMPARE_LOG_ERROR) в вызывающем потоке или "", если
+// ошибок не было; действителен до следующей ошибки в этом потоке. Успешные вызовы его не
+// сбрасывают, rdbcompare_clear_last_error - сбрасывает
+const char* rdbcompare_last_error(void);
+void rdbcompare_clear_last_error(void);
+
+// --- Зеркала API ---
+// Список зеркал задаётся опцией endpoints (RDBCOMPARE_ENDPOINTS) или файлом
+// endpoints_file (по умолчанию $XDG_CONFIG_HOME/rdbcompare/endpoints, по адресу
+// в строке). Запросы идут на исправное зеркало с наименьшей задержкой, при ошибке
+// соединения или ответе 5xx - на следующее.
+// Состояние зеркал массивом JSON (освобождается free()): url, healthy, latency_ms,
+// requests, failures, probes, bytes.
+char* rdbcompare_endpoints_json(void);
+// Замеряет задержку всех зеркал сейчас (блокирует не дольше probe_timeout_ms)
+void rdbcompare_probe_endpoints(void);
+
+// --- Кэш разобранных веток ---
+// rdbcompare_compare_branches загружает ветки сама и сравнивает их, как rdbcompare_compare.
+// Разобранные списки пакетов (ключ - сервер, ветка и фильтр из параметров) остаются в
+// памяти: в пределах snapshot_ttl секунд ветка не запрашивается вовсе, позже - условным
+// запросом (If-None-Match по ETag ответа или сравнение хэша тела), и неизменившаяся ветка
+// не разбирается заново. Объём считается по памяти снимков в куче; сверх
+// snapshot_cache_bytes вытесняются давно не использованные. Результат держит свои снимки
+// и после их вытеснения. Возвращает NULL при ошибке загрузки или разбора
+rdbcompare_result_t* rdbcompare_compare_branches(const char* branch1, const char* branch2, const rdbcompare_options_t* options);
+// Загружает ветку (если её нет в кэше) и закрепляет снимок: он не вытесняется, пока
+// число rdbcompare_snapshot_unpin не сравняется с числом закреплений. 0 или -1
+int rdbcompare_snapshot_pin(const char* branch, const rdbcompare_options_t* options);
+int rdbcompare_snapshot_unpin(const char* branch, const rdbcompare_options_t* options);
+// Удаляет снимок ветки вместе с закреплениями; branch == NULL - все незакреплённые.
+// Возвращает число удалённых снимков
+int rdbcompare_snapshot_evict(const char* branch, const rdbcompare_options_t* options);
+// Состояние кэша JSON (освобождается free()): {"bytes", "entries": [{"branch", "tag",
+// "bytes", "packages", "pinned", "age_s"}]}, недавно использованные впереди
+char* rdbcompare_snapshot_cache_json(void);
+
+// --- Контексты ---
+// Контекст владеет настройками, соединениями (кэш соединений, TLS-сессии и DNS), кэшами
+// (список веток, зеркала, словарь рангов EVR, результаты сравнений, снимки веток) и
+// счётчиками. Функции выше работают с контекстом по умолчанию, варианты rdbcompare_ctx_* -
+// с переданным (ctx == NULL - тоже по умолчанию), так что в одном процессе можно держать
+// независимые настройки и кэши, например по контексту на пользователя службы.
+//
+// Потокобезопасность: все функции библиотеки можно вызывать одновременно из разных
+// потоков, как с разными контекстами, так и с одним общим. Не делятся между потоками без
+// внешней синхронизации параметры (rdbcompare_options_t) во время их изменения, результат
+// (rdbcompare_result_t: курсор) и цикл событий (rdbcompare_loop_t). Новый контекст берёт
+// начальные настройки из переменных окружения RDBCOMPARE_<ИМЯ>; rdbcompare_init для него
+// не нужен. rdbcompare_ctx_free вызывается, когда вызовы с контекстом завершились, а его
+// результаты (rdbcompare_result_t) и циклы событий освобождены.
+typedef struct rdbcompare_ctx rdbcompare_ctx_t;
+
+rdbcompare_ctx_t* rdbcompare_ctx_new(void);
+void rdbcompare_ctx_free(rdbcompare_ctx_t* ctx);
+int rdbcompare_ctx_set_option(rdbcompare_ctx_t* ctx, const char* name, const char* value);
+
+char* rdbcompare_ctx_fetch_package_list(rdbcompare_ctx_t* ctx, const char* branch, const rdbcompare_options_t* options);
+char* rdbcompare_ctx_compare_packages(rdbcompare_ctx_t* ctx, const char* branch1_data, const char* branch2_data,
+                                      const rdbcompare_options_t* options);
+int rdbcompare_ctx_compare_packages_ndjson(rdbcompare_ctx_t* ctx, const char* branch1_data, const char* branch2_data,
+                                           const rdbcompare_options_t* options, rdbcompare_line_cb cb, void* userdata);
+rdbcompare_result_t* rdbcompare_ctx_compare(rdbcompare_ctx_t* ctx, const char* branch1_data, const char* branch2_data,
+                                            const rdbcompare_options_t* options);
+char* rdbcompare_ctx_fingerprints_json(rdbcompare_ctx_t* ctx, const char* branch_data, const rdbcompare_options_t* options);
+rdbcompare_loop_t* rdbcompare_ctx_loop_new(rdbcompare_ctx_t* ctx, rdbcompare_socket_cb socket_cb,
+                                           rdbcompare_timer_cb timer_cb, void* userdata);
+char* rdbcompare_ctx_stats_json(rdbcompare_ctx_t* ctx);
+void rdbcompare_ctx_stats_reset(rdbcompare_ctx_t* ctx);
+char* rdbcompare_ctx_endpoints_json(rdbcompare_ctx_t* ctx);
+void rdbcompare_ctx_probe_endpoints(rdbcompare_ctx_t* ctx);
+rdbcompare_result_t* rdbcompare_ctx_compare_branches(rdbcompare_ctx_t* ctx, const char* branch1, const char* branch2,
+                                                     const rdbcompare_options_t* options);
+int rdbcompare_ctx_snapshot_pin(rdbcompare_ctx_t* ctx, const char* branch, const rdbcompare_options_t* options);
+int rdbcompare_ctx_snapshot_unpin(rdbcompare_ctx_t* ctx, const char* branch, const rdbcompare_options_t* options);
+int rdbcompare_ctx_snapshot_evict(rdbcompare_ctx_t* ctx, const char* branch, const rdbcompare_options_t* options);
+char* rdbcompare_ctx_snapshot_cache_json(rdbcompare_ctx_t* ctx);
+
 #ifdef __cplusplus
 }
 #endif
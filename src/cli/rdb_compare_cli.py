@@ -1,4 +1,5 @@
 #!/usr/bin/env python3
+import atexit
 import ctypes
 import json
 import sys
@@ -10,6 +11,11 @@ __version__ = "1.0.0"
 
 def find_library_path(lib_name):
 
+    # Явно заданная библиотека (например, собранная для замеров) имеет приоритет
+    override_path = os.environ.get("RDBCOMPARE_LIBRARY")
+    if override_path:
+        return override_path
+
     system_lib_path = os.path.join("/usr", "lib", f"{lib_name}.so")
     if os.path.exists(system_lib_path):
         return system_lib_path
@@ -52,6 +58,74 @@ librdb.fetch_package_list.argtypes = [ctypes.c_char_p]
 librdb.compare_packages.restype = ctypes.POINTER(ctypes.c_char)
 librdb.compare_packages.argtypes = [ctypes.c_char_p, ctypes.c_char_p]
 
+librdb.fetch_package_list_ex.restype = ctypes.POINTER(ctypes.c_char)
+librdb.fetch_package_list_ex.argtypes = [ctypes.c_char_p, ctypes.c_void_p]
+
+librdb.compare_packages_ex.restype = ctypes.POINTER(ctypes.c_char)
+librdb.compare_packages_ex.argtypes = [ctypes.c_char_p, ctypes.c_char_p, ctypes.c_void_p]
+
+librdb.rdbcompare_options_new.restype = ctypes.c_void_p
+librdb.rdbcompare_options_new.argtypes = []
+librdb.rdbcompare_options_free.restype = None
+librdb.rdbcompare_options_free.argtypes = [ctypes.c_void_p]
+librdb.rdbcompare_options_add_arch.restype = ctypes.c_int
+librdb.rdbcompare_options_add_arch.argtypes = [ctypes.c_void_p, ctypes.c_char_p]
+librdb.rdbcompare_options_add_name_pattern.restype = ctypes.c_int
+librdb.rdbcompare_options_add_name_pattern.argtypes = [ctypes.c_void_p, ctypes.c_char_p]
+librdb.rdbcompare_options_set_categories.restype = ctypes.c_int
+librdb.rdbcompare_options_set_categories.argtypes = [ctypes.c_void_p, ctypes.c_uint]
+librdb.rdbcompare_options_set_counts_only.restype = ctypes.c_int
+librdb.rdbcompare_options_set_counts_only.argtypes = [ctypes.c_void_p, ctypes.c_int]
+
+class RdbStr(ctypes.Structure):
+    _fields_ = [("data", ctypes.POINTER(ctypes.c_char)), ("size", ctypes.c_size_t)]
+
+    def text(self) -> str:
+        return ctypes.string_at(self.data, self.size).decode('utf-8') if self.size else ""
+
+class RdbEntry(ctypes.Structure):
+    _fields_ = [
+        ("arch", RdbStr), ("name", RdbStr), ("category", ctypes.c_int), ("category_name", RdbStr),
+        ("epoch1", RdbStr), ("version1", RdbStr), ("release1", RdbStr), ("evr1", RdbStr),
+        ("epoch2", RdbStr), ("version2", RdbStr), ("release2", RdbStr), ("evr2", RdbStr),
+    ]
+
+# Идентификаторы категорий (RDBCOMPARE_* в rdbcompare.hpp)
+CATEGORY_IDS = {"branch1_only": 0, "branch2_only": 1, "branch1_newer": 2,
+                "branch2_newer": 3, "identical": 4, "epoch_only": 5}
+DEFAULT_CATEGORIES = ["branch1_only", "branch2_only", "branch1_newer"]
+
+librdb.rdbcompare_compare.restype = ctypes.c_void_p
+librdb.rdbcompare_compare.argtypes = [ctypes.c_char_p, ctypes.c_char_p, ctypes.c_void_p]
+librdb.rdbcompare_result_free.restype = None
+librdb.rdbcompare_result_free.argtypes = [ctypes.c_void_p]
+librdb.rdbcompare_result_arch_count.restype = ctypes.c_size_t
+librdb.rdbcompare_result_arch_count.argtypes = [ctypes.c_void_p]
+librdb.rdbcompare_result_arch_name.restype = ctypes.c_char_p
+librdb.rdbcompare_result_arch_name.argtypes = [ctypes.c_void_p, ctypes.c_size_t]
+librdb.rdbcompare_result_count.restype = ctypes.c_size_t
+librdb.rdbcompare_result_count.argtypes = [ctypes.c_void_p, ctypes.c_char_p, ctypes.c_int]
+librdb.rdbcompare_result_seek.restype = ctypes.c_int
+librdb.rdbcompare_result_seek.argtypes = [ctypes.c_void_p, ctypes.c_char_p, ctypes.c_int]
+librdb.rdbcompare_result_next.restype = ctypes.c_int
+librdb.rdbcompare_result_next.argtypes = [ctypes.c_void_p, ctypes.POINTER(RdbEntry)]
+
+LINE_CALLBACK = ctypes.CFUNCTYPE(ctypes.c_int, ctypes.c_int, ctypes.POINTER(ctypes.c_char), ctypes.c_size_t, ctypes.c_void_p)
+librdb.compare_packages_ndjson.restype = ctypes.c_int
+librdb.compare_packages_ndjson.argtypes = [ctypes.c_char_p, ctypes.c_char_p, ctypes.c_void_p, LINE_CALLBACK, ctypes.c_void_p]
+
+librdb.rdbcompare_set_option.restype = ctypes.c_int
+librdb.rdbcompare_set_option.argtypes = [ctypes.c_char_p, ctypes.c_char_p]
+
+librdb.rdbcompare_stats_json.restype = ctypes.POINTER(ctypes.c_char)
+librdb.rdbcompare_stats_json.argtypes = []
+librdb.rdbcompare_endpoints_json.restype = ctypes.POINTER(ctypes.c_char)
+librdb.rdbcompare_endpoints_json.argtypes = []
+librdb.rdbcompare_trace_start.restype = None
+librdb.rdbcompare_trace_start.argtypes = []
+librdb.rdbcompare_trace_write.restype = ctypes.c_int
+librdb.rdbcompare_trace_write.argtypes = [ctypes.c_char_p]
+
 libc = None
 try:
     libc = ctypes.CDLL(None)
@@ -67,7 +141,7 @@ def _free_c_ptr(c_ptr):
 
 def fetch_data_from_c(branch_name: str) -> str | None:
     sys.stderr.write(f"Запрос пакетов для ветки '{branch_name}'...\n")
-    c_result_ptr = librdb.fetch_package_list(branch_name.encode('utf-8'))
+    c_result_ptr = librdb.fetch_package_list_ex(branch_name.encode('utf-8'), compare_options)
     
     if not c_result_ptr:
         sys.stderr.write(f"Ошибка: fetch_package_list вернула пустой указатель для '{branch_name}'.\n")
@@ -87,7 +161,7 @@ def fetch_data_from_c(branch_name: str) -> str | None:
 
 def compare_data_from_c(branch1_json: str, branch2_json: str) -> str | None:
     sys.stderr.write(f"Выполнение сравнения пакетов '{args.branch1}' и '{args.branch2}'...\n")
-    c_result_ptr = librdb.compare_packages(branch1_json.encode('utf-8'), branch2_json.encode('utf-8'))
+    c_result_ptr = librdb.compare_packages_ex(branch1_json.encode('utf-8'), branch2_json.encode('utf-8'), compare_options)
 
     if not c_result_ptr:
         sys.stderr.write("Ошибка: compare_packages вернула пустой указатель. Возможно, входные данные некорректны.\n")
@@ -105,44 +179,132 @@ def compare_data_from_c(branch1_json: str, branch2_json: str) -> str | None:
     finally:
         _free_c_ptr(c_result_ptr) 
 
-def print_comparison_results(results_json: dict, categories: list[str]):
-    if not results_json or "architectures" not in results_json:
-        sys.stderr.write("Ошибка: Некорректный формат JSON-результата сравнения.\n")
+def print_library_stats():
+    # Счётчики библиотеки (выделения арен и т.п.) одной строкой JSON в stderr
+    c_result_ptr = librdb.rdbcompare_stats_json()
+    if not c_result_ptr:
         return
+    try:
+        sys.stderr.write(f"Статистика: {ctypes.string_at(c_result_ptr).decode('utf-8')}\n")
+    finally:
+        _free_c_ptr(c_result_ptr)
+    c_result_ptr = librdb.rdbcompare_endpoints_json()
+    if not c_result_ptr:
+        return
+    try:
+        sys.stderr.write(f"Зеркала: {ctypes.string_at(c_result_ptr).decode('utf-8')}\n")
+    finally:
+        _free_c_ptr(c_result_ptr)
+
+def write_trace(path: str):
+    # Фазы загрузки, разбора, сравнения и вывода в формате Chrome trace-event
+    if librdb.rdbcompare_trace_write(path.encode('utf-8')) != 0:
+        sys.stderr.write(f"Ошибка: Не удалось сохранить трассировку в '{path}'.\n")
+    else:
+        sys.stderr.write(f"Трассировка сохранена в '{path}' (откройте в https://ui.perfetto.dev).\n")
 
-    architectures = results_json.get("architectures", {})
+def compare_result_from_c(branch1_json: str, branch2_json: str):
+    # Результат для покомпонентного обхода; освобождается rdbcompare_result_free
+    sys.stderr.write(f"Выполнение сравнения пакетов '{args.branch1}' и '{args.branch2}'...\n")
+    result = librdb.rdbcompare_compare(branch1_json.encode('utf-8'), branch2_json.encode('utf-8'), compare_options)
+    if not result:
+        sys.stderr.write("Ошибка: rdbcompare_compare вернула пустой указатель. Возможно, входные данные некорректны.\n")
+    return result
+
+def stream_ndjson_from_c(branch1_json: str, branch2_json: str, categories: list[str]) -> bool:
+    # Строки NDJSON пишутся в stdout по мере того, как библиотека их находит
+    sys.stderr.write(f"Выполнение сравнения пакетов '{args.branch1}' и '{args.branch2}'...\n")
+    selected_ids = {CATEGORY_IDS[category] for category in categories}
+    out = sys.stdout.buffer
 
-    if not architectures:
+    def on_line(category, line, size, userdata):
+        if category not in selected_ids:
+            return 0
+        try:
+            out.write(ctypes.string_at(line, size))
+            out.flush() # Строка сразу уходит потребителю канала (jq, grep), а не блоком в конце
+        except BrokenPipeError:
+            # Потребитель закрыл канал (например, head) - прекращаем вывод и подавляем
+            # повторную ошибку при закрытии stdout интерпретатором
+            os.dup2(os.open(os.devnull, os.O_WRONLY), sys.stdout.fileno())
+            return 1
+        return 0
+
+    callback = LINE_CALLBACK(on_line)
+    if librdb.compare_packages_ndjson(branch1_json.encode('utf-8'), branch2_json.encode('utf-8'), compare_options, callback, None) != 0:
+        sys.stderr.write("Ошибка: compare_packages_ndjson завершилась с ошибкой. Возможно, входные данные некорректны.\n")
+        return False
+    return True
+
+def print_comparison_results(result, categories: list[str]):
+    arch_count = librdb.rdbcompare_result_arch_count(result)
+    if arch_count == 0:
         print("Нет данных для сравнения по архитектурам.")
         return
 
-    for arch, data in architectures.items():
-        print(f"\n--- Архитектура: {arch} ---")
-        
+    entry = RdbEntry()
+    for index in range(arch_count):
+        arch = librdb.rdbcompare_result_arch_name(result, index)
+        print(f"\n--- Архитектура: {arch.decode('utf-8')} ---")
+
         has_printed_category_for_arch = False
         for category in categories:
-            items = data.get(category)
-            if items is not None:
-                if items:
-                    print(f"\n  Категория: {category.replace('_', ' ').capitalize()}")
+            category_id = CATEGORY_IDS[category]
+            title = category.replace('_', ' ').capitalize()
+            if librdb.rdbcompare_result_count(result, arch, category_id) == 0:
+                if len(categories) == 1:
+                    print(f"\n  Категория: {title} - Нет различий.")
                     has_printed_category_for_arch = True
-                    if category == "branch1_newer":
-                        for item in items:
-                            name = item.get("name", "N/A")
-                            b1_ver = item.get("branch1_version_release", "N/A")
-                            b2_ver = item.get("branch2_version_release", "N/A")
-                            print(f"    - {name}: B1({b1_ver}) > B2({b2_ver})")
-                    else:
-                        for item in items:
-                            print(f"    - {item}")
+                continue
+
+            print(f"\n  Категория: {title}")
+            has_printed_category_for_arch = True
+            librdb.rdbcompare_result_seek(result, arch, category_id)
+            while librdb.rdbcompare_result_next(result, ctypes.byref(entry)):
+                if category == "branch1_newer":
+                    print(f"    - {entry.name.text()}: B1({entry.evr1.text()}) > B2({entry.evr2.text()})")
+                elif category == "branch2_newer":
+                    print(f"    - {entry.name.text()}: B1({entry.evr1.text()}) < B2({entry.evr2.text()})")
+                elif category == "epoch_only":
+                    print(f"    - {entry.name.text()}: B1({entry.evr1.text()}) / B2({entry.evr2.text()})")
                 else:
-                    if len(categories) == 1 or "all" in categories:
-                        print(f"\n  Категория: {category.replace('_', ' ').capitalize()} - Нет различий.")
-                        has_printed_category_for_arch = True
-        
+                    evr = entry.evr1 if category != "branch2_only" else entry.evr2
+                    print(f"    - {entry.name.text()} ({evr.text()})")
+
         if not has_printed_category_for_arch and len(categories) > 0:
             print("  Для этой архитектуры нет различий в запрошенных категориях.")
 
+def print_comparison_summary(result, categories: list[str]):
+    # Только счётчики по архитектурам: результат получен в режиме counts_only
+    arch_count = librdb.rdbcompare_result_arch_count(result)
+    if arch_count == 0:
+        print("Нет данных для сравнения по архитектурам.")
+        return
+
+    width = max(len(category) for category in categories)
+    for index in range(arch_count):
+        arch = librdb.rdbcompare_result_arch_name(result, index)
+        print(f"--- Архитектура: {arch.decode('utf-8')} ---")
+        for category in categories:
+            count = librdb.rdbcompare_result_count(result, arch, CATEGORY_IDS[category])
+            print(f"  {category:<{width}}  {count}")
+    print("--- Итого ---")
+    for category in categories:
+        print(f"  {category:<{width}}  {librdb.rdbcompare_result_count(result, None, CATEGORY_IDS[category])}")
+
+def category_list(text: str) -> list[str]:
+    # "-c branch1_newer,branch2_newer"; all - категории по умолчанию
+    categories = []
+    for category in text.split(","):
+        category = category.strip()
+        if category == "all":
+            categories += DEFAULT_CATEGORIES
+        elif category in CATEGORY_IDS:
+            categories.append(category)
+        else:
+            raise argparse.ArgumentTypeError(f"неизвестная категория: {category}")
+    return sorted(set(categories), key=CATEGORY_IDS.get)
+
 
 # --- Разбор аргументов командной строки ---
 parser = argparse.ArgumentParser(
@@ -154,7 +316,11 @@ parser = argparse.ArgumentParser(
   rdb_compare p10 p9 -c branch1_only
   rdb_compare -s sisyphus
   rdb_compare -j p9 p10
+  rdb_compare --ndjson sisyphus p10 | jq -r 'select(.arch == "x86_64") | .name'
   rdb_compare -t sisyphus p10 -c branch1_newer
+  rdb_compare sisyphus p10 -c branch1_newer,branch2_newer,epoch_only
+  rdb_compare --summary sisyphus p10
+  rdb_compare sisyphus p10 -a x86_64 -a noarch -n 'python3-*'
 """
 )
 parser.add_argument(
@@ -171,21 +337,55 @@ parser.add_argument(
 )
 parser.add_argument(
     "-c", "--category",
-    choices=["branch1_only", "branch2_only", "branch1_newer", "all"],
-    default="all",
+    type=category_list,
+    default=DEFAULT_CATEGORIES,
+    metavar="CATEGORY[,CATEGORY...]",
     help=(
-        "Категория результатов для вывода:\n"
+        "Категории результатов для вывода (через запятую):\n"
         "  branch1_only   - пакеты только в первой ветке\n"
         "  branch2_only   - пакеты только во второй ветке\n"
         "  branch1_newer  - пакеты, новее в первой ветке\n"
-        "  all            - все категории (по умолчанию)."
+        "  branch2_newer  - пакеты, новее во второй ветке\n"
+        "  identical      - пакеты с одинаковой версией в обеих ветках\n"
+        "  epoch_only     - пакеты, различающиеся только эпохой\n"
+        "                   (без неё такие пакеты считаются новее в одной из веток)\n"
+        "  all            - branch1_only, branch2_only и branch1_newer (по умолчанию).\n"
+        "Остальные категории не вычисляются и не попадают в вывод (в том числе -j)."
     )
 )
+parser.add_argument(
+    "--summary",
+    action="store_true",
+    help=(
+        "Вывести только число различий по архитектурам и итог, без списков пакетов\n"
+        "(с -j - тот же JSON без массивов packages). Быстро и без лишней памяти."
+    )
+)
+parser.add_argument(
+    "-a", "--arch",
+    action="append",
+    metavar="ARCH",
+    help="Сравнивать только указанную архитектуру (можно повторять: -a x86_64 -a noarch)."
+)
+parser.add_argument(
+    "-n", "--name",
+    action="append",
+    metavar="PATTERN",
+    help="Сравнивать только пакеты, имя которых подходит под шаблон (например, 'python3-*'; можно повторять)."
+)
 parser.add_argument(
     "-j", "--json",
     action="store_true",
     help="Вывести необработанный JSON-ответ (как из C++ библиотеки)."
 )
+parser.add_argument(
+    "--ndjson",
+    action="store_true",
+    help=(
+        "Выводить различия построчно в формате NDJSON (одна запись на пакет)\n"
+        "по мере сравнения; удобно для jq, grep и конвейеров. Учитывает -c."
+    )
+)
 parser.add_argument(
     "-t", "--tree",
     action="store_true",
@@ -199,6 +399,71 @@ parser.add_argument(
     action="store_true",
     help="Вывести необработанный JSON-список пакетов для BANCH1 (игнорирует BANCH2 и сравнение).",
 )
+parser.add_argument(
+    "--no-branch-check",
+    action="store_true",
+    help=(
+        "Не проверять имена веток по списку branch_tree перед загрузкой.\n"
+        "Неизвестная ветка определяется по ответу 404 сервера."
+    )
+)
+parser.add_argument(
+    "--api-base",
+    metavar="URL",
+    help=(
+        "Адрес REST API (по умолчанию https://rdb.altlinux.org/api),\n"
+        "например, зеркала или локального tests/mock_rdb_server.py."
+    )
+)
+parser.add_argument(
+    "--endpoints",
+    metavar="URL[,URL...]",
+    help=(
+        "Зеркала REST API через запятую. Запросы идут на самое быстрое\n"
+        "исправное, при ошибке - на следующее."
+    )
+)
+parser.add_argument(
+    "--timeout",
+    type=int,
+    metavar="SECONDS",
+    help="Предельное время загрузки одного списка пакетов (по умолчанию 300, 0 - без ограничения)."
+)
+parser.add_argument(
+    "--retries",
+    type=int,
+    metavar="N",
+    help="Повторов с растущей паузой после ошибки сети или ответа 5xx (по умолчанию 2)."
+)
+parser.add_argument(
+    "--hedge",
+    action="store_true",
+    help=(
+        "Дублировать загрузку, не завершившуюся за 95-й перцентиль прежних,\n"
+        "и принять первый ответ."
+    )
+)
+parser.add_argument(
+    "--sharded",
+    action="store_true",
+    help=(
+        "Загружать каждую ветку параллельными запросами по архитектурам\n"
+        "(быстрее на каналах с большой задержкой)."
+    )
+)
+parser.add_argument(
+    "--stats",
+    action="store_true",
+    help="После работы вывести в stderr счётчики библиотеки (выделения памяти и т.п.) и состояние зеркал."
+)
+parser.add_argument(
+    "--trace",
+    metavar="FILE",
+    help=(
+        "Записать временную шкалу работы (DNS, соединение, TLS, приём, разбор, сравнение\n"
+        "по архитектурам, вывод) в FILE в формате Chrome trace-event для Perfetto."
+    )
+)
 parser.add_argument(
     "-v", "--version",
     action="version",
@@ -210,6 +475,45 @@ args = parser.parse_args()
 
 # --- Основная логика скрипта ---
 
+if args.trace:
+    librdb.rdbcompare_trace_start()
+    atexit.register(write_trace, args.trace)
+if args.api_base:
+    if librdb.rdbcompare_set_option(b"api_base", args.api_base.encode('utf-8')) != 0:
+        sys.stderr.write(f"Ошибка: Некорректный адрес API '{args.api_base}'.\n")
+        sys.exit(1)
+if args.endpoints:
+    if librdb.rdbcompare_set_option(b"endpoints", args.endpoints.encode('utf-8')) != 0:
+        sys.stderr.write(f"Ошибка: Некорректный список зеркал '{args.endpoints}'.\n")
+        sys.exit(1)
+for option, value in (("timeout", args.timeout), ("retries", args.retries)):
+    if value is not None and librdb.rdbcompare_set_option(option.encode(), str(value).encode()) != 0:
+        sys.stderr.write(f"Ошибка: Некорректное значение --{option}: {value}.\n")
+        sys.exit(1)
+if args.hedge:
+    librdb.rdbcompare_set_option(b"hedge", b"1")
+if args.sharded:
+    librdb.rdbcompare_set_option(b"sharded", b"1")
+
+if args.no_branch_check:
+    librdb.rdbcompare_set_option(b"validate_branches", b"0")
+
+# Фильтры передаются библиотеке и применяются при разборе, а не к готовому результату
+selected_categories = args.category
+
+compare_options = None
+if args.arch or args.name or selected_categories != DEFAULT_CATEGORIES or args.summary:
+    compare_options = librdb.rdbcompare_options_new()
+    atexit.register(librdb.rdbcompare_options_free, compare_options)
+    # -c и --summary передаются библиотеке: ненужное не вычисляется вовсе
+    librdb.rdbcompare_options_set_categories(
+        compare_options, sum(1 << CATEGORY_IDS[category] for category in selected_categories))
+    librdb.rdbcompare_options_set_counts_only(compare_options, 1 if args.summary else 0)
+    for arch in args.arch or []:
+        librdb.rdbcompare_options_add_arch(compare_options, arch.encode('utf-8'))
+    for pattern in args.name or []:
+        librdb.rdbcompare_options_add_name_pattern(compare_options, pattern.encode('utf-8'))
+
 if args.show_branch_json:
     sys.stderr.write(f"Вывод JSON-списка пакетов для ветки '{args.branch1}'...\n")
     branch_data = fetch_data_from_c(args.branch1)
@@ -233,26 +537,28 @@ else:
     if branch2_data_json_str is None:
         sys.exit(1)
 
-    comparison_json_str = compare_data_from_c(branch1_data_json_str, branch2_data_json_str)
-    if comparison_json_str is None:
-        sys.exit(1)
-
-    if args.json:
+    if args.ndjson:
+        if not stream_ndjson_from_c(branch1_data_json_str, branch2_data_json_str, selected_categories):
+            sys.exit(1)
+    elif args.json:
+        comparison_json_str = compare_data_from_c(branch1_data_json_str, branch2_data_json_str)
+        if comparison_json_str is None:
+            sys.exit(1)
         print(comparison_json_str)
-    elif args.tree or (not args.json and not args.tree):
+    else:
+        # Древовидный вывод читает записи курсором, без сериализации результата в JSON
+        comparison_result = compare_result_from_c(branch1_data_json_str, branch2_data_json_str)
+        if not comparison_result:
+            sys.exit(1)
         try:
-            comparison_results = json.loads(comparison_json_str)
-            if args.category == "all":
-                selected_categories = ["branch1_only", "branch2_only", "branch1_newer"]
+            if args.summary:
+                print_comparison_summary(comparison_result, selected_categories)
             else:
-                selected_categories = [args.category]
-                
-            print_comparison_results(comparison_results, selected_categories)
+                print_comparison_results(comparison_result, selected_categories)
+        finally:
+            librdb.rdbcompare_result_free(comparison_result)
 
-        except json.JSONDecodeError as e:
-            sys.stderr.write(f"Ошибка: Не удалось разобрать JSON-ответ сравнения.\n")
-            sys.stderr.write(f"Детали: {e}\n")
-            sys.stderr.write(f"Необработанный JSON (частично): {comparison_json_str[:500]}...\n")
-            sys.exit(1)
+if args.stats:
+    print_library_stats()
 
 sys.exit(0)
@@ -7,12 +7,22 @@
 // тем потоком, который использует libcurl.
 // Поскольку ComparisonWorker работает в отдельном потоке, он будет отвечать за это.
 
+// Причина последней ошибки библиотеки в этом (рабочем) потоке, если она известна
+static std::string libraryError() {
+    const char* error = rdbcompare_last_error();
+    return *error ? std::string(": ") + error : std::string();
+}
+
 ComparisonWorker::ComparisonWorker(const QString& branch1, const QString& branch2, QObject *parent)
-    : QObject(parent), m_branch1(branch1), m_branch2(branch2), m_cancelRequested(false) {
+    : QObject(parent), m_branch1(branch1), m_branch2(branch2), m_cancelRequested(false),
+      m_cancel(rdbcompare_cancel_new()), m_fetchOptions(rdbcompare_options_new()) {
+    qRegisterMetaType<rdbcompare_result_t*>();
+    rdbcompare_options_set_cancel(m_fetchOptions, m_cancel);
 }
 
 ComparisonWorker::~ComparisonWorker() {
-    // Деструктор
+    rdbcompare_options_free(m_fetchOptions);
+    rdbcompare_cancel_free(m_cancel);
 }
 
 void ComparisonWorker::doComparisonWork() {
@@ -22,7 +32,8 @@ void ComparisonWorker::doComparisonWork() {
     
     char* branch1_data_ptr = nullptr;
     char* branch2_data_ptr = nullptr;
-    char* comparison_result_ptr = nullptr;
+    rdbcompare_result_t* comparison_result = nullptr;
+    rdbcompare_clear_last_error();
 
     try {
         if (m_cancelRequested) { // Проверка отмены перед началом
@@ -32,9 +43,13 @@ void ComparisonWorker::doComparisonWork() {
 
         // 1. Получаем данные для первой ветки
         emit workProgress(QString("Запрос пакетов для ветки '%1'...").arg(m_branch1));
-        branch1_data_ptr = fetch_package_list(m_branch1.toStdString().c_str());
+        branch1_data_ptr = fetch_package_list_ex(m_branch1.toStdString().c_str(), m_fetchOptions);
+        if (!branch1_data_ptr && m_cancelRequested) {
+            emit comparisonCancelled();
+            return;
+        }
         if (!branch1_data_ptr) {
-            throw std::runtime_error("Не удалось получить данные для ветки " + m_branch1.toStdString());
+            throw std::runtime_error("Не удалось получить данные для ветки " + m_branch1.toStdString() + libraryError());
         }
 
         if (m_cancelRequested) {
@@ -46,9 +61,14 @@ void ComparisonWorker::doComparisonWork() {
 
         // 2. Получаем данные для второй ветки
         emit workProgress(QString("Запрос пакетов для ветки '%1'...").arg(m_branch2));
-        branch2_data_ptr = fetch_package_list(m_branch2.toStdString().c_str());
+        branch2_data_ptr = fetch_package_list_ex(m_branch2.toStdString().c_str(), m_fetchOptions);
+        if (!branch2_data_ptr && m_cancelRequested) {
+            emit comparisonCancelled();
+            free(branch1_data_ptr);
+            return;
+        }
         if (!branch2_data_ptr) {
-            throw std::runtime_error("Не удалось получить данные для ветки " + m_branch2.toStdString());
+            throw std::runtime_error("Не удалось получить данные для ветки " + m_branch2.toStdString() + libraryError());
         }
 
         if (m_cancelRequested) {
@@ -61,13 +81,13 @@ void ComparisonWorker::doComparisonWork() {
 
         // 3. Сравниваем данные
         emit workProgress("Выполнение сравнения пакетов...");
-        comparison_result_ptr = compare_packages(branch1_data_ptr, branch2_data_ptr);
-        if (!comparison_result_ptr) {
-            throw std::runtime_error("Не удалось выполнить сравнение пакетов.");
+        comparison_result = rdbcompare_compare(branch1_data_ptr, branch2_data_ptr, nullptr);
+        if (!comparison_result) {
+            throw std::runtime_error("Не удалось выполнить сравнение пакетов" + libraryError() + ".");
         }
 
         emit workProgress("Сравнение завершено. Подготовка результатов...");
-        emit comparisonFinished(QString::fromLocal8Bit(comparison_result_ptr)); // Передаем результат
+        emit comparisonFinished(comparison_result); // Передаем результат вместе с владением
         
     } catch (const std::exception& e) {
         emit comparisonError(QString("Ошибка во время сравнения: %1").arg(e.what()));
@@ -78,14 +98,12 @@ void ComparisonWorker::doComparisonWork() {
     // Освобождаем память, выделенную C-кодом, в любом случае (даже при ошибке)
     if (branch1_data_ptr) free(branch1_data_ptr);
     if (branch2_data_ptr) free(branch2_data_ptr);
-    if (comparison_result_ptr) free(comparison_result_ptr);
 
 }
 
 void ComparisonWorker::cancelRequested() {
     m_cancelRequested = true; // Устанавливаем флаг отмены
-    // В зависимости от реализации libcurl, это может не сразу прервать сетевой запрос.
-    // Для полной отмены сетевых запросов curl_easy_setopt с CURLOPT_PROGRESSFUNCTION
-    // и возвратом ненулевого значения был бы нужен, но это сильно усложнит задачу.
-    // Для этого ТЗ достаточно проверки флага между стадиями.
+    // Рабочий поток занят doComparisonWork, поэтому слот вызывается напрямую из потока
+    // GUI; флаг библиотеки прерывает текущую загрузку в пределах ~100 мс
+    rdbcompare_cancel_request(m_cancel);
 }
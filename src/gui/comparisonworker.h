@@ -4,8 +4,13 @@
 #include <QObject>
 #include <QString>
 #include <iostream> 
+#include <atomic>
 #include "rdbcompare.hpp" 
 
+// Результат передаётся между потоками по указателю; владельцем становится получатель сигнала
+Q_DECLARE_OPAQUE_POINTER(rdbcompare_result_t*)
+Q_DECLARE_METATYPE(rdbcompare_result_t*)
+
 class ComparisonWorker : public QObject {
     Q_OBJECT 
 
@@ -15,10 +20,10 @@ public:
 
 public slots:
     void doComparisonWork(); 
-    void cancelRequested();  
+    void cancelRequested();  // Вызывается из потока GUI (Qt::DirectConnection)
 
 signals:
-    void comparisonFinished(const QString& resultJson); 
+    void comparisonFinished(rdbcompare_result_t* result); 
     void comparisonError(const QString& errorMessage); 
     void comparisonCancelled(); 
     void workStarted(); 
@@ -27,7 +32,10 @@ signals:
 private:
     QString m_branch1;
     QString m_branch2;
-    bool m_cancelRequested; 
+    std::atomic<bool> m_cancelRequested;
+    // Флаг отмены библиотеки: прерывает идущую загрузку, а не только следующий этап
+    rdbcompare_cancel_t* m_cancel;
+    rdbcompare_options_t* m_fetchOptions;
 };
 
 #endif // COMPARISONWORKER_H
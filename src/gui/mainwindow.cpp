@@ -4,6 +4,8 @@
 #include <QHBoxLayout>
 #include <QFormLayout>
 #include <QGroupBox>
+#include <QMenuBar>
+#include <QMenu>
 #include <QHeaderView>
 #include <QFileDialog>
 #include <QMessageBox>
@@ -13,9 +15,15 @@
 #include <QFile>
 #include <QTextStream>
 #include <QStandardPaths>
+#include <QMap>
+
+static QString toQString(const rdbcompare_str_t& str) {
+    // Строки записей результата не завершаются нулём
+    return QString::fromUtf8(str.data, static_cast<int>(str.size));
+}
 
 MainWindow::MainWindow(QWidget *parent)
-    : QMainWindow(parent), workerThread(nullptr), comparisonWorker(nullptr) { // Инициализируем указатели
+    : QMainWindow(parent), workerThread(nullptr), comparisonWorker(nullptr), comparisonResult(nullptr) { // Инициализируем указатели
     setupUi();
     connectSignalsSlots();
     setWindowTitle("ALT Linux RDB Package Comparison");
@@ -40,10 +48,17 @@ MainWindow::~MainWindow() {
         workerThread->quit();
         workerThread->wait(3000);
     }
+    clearComparisonResult();
 }
 
 void MainWindow::setupUi() {
 
+    // Каждое сравнение записывается библиотекой в трассировку (фазы загрузки, разбора,
+    // сравнения); её можно сохранить и открыть в Perfetto или chrome://tracing
+    QMenu *debugMenu = menuBar()->addMenu("Отладка");
+    saveTraceAction = debugMenu->addAction("Сохранить трассировку последнего сравнения...");
+    saveTraceAction->setEnabled(false);
+
     QWidget *centralWidget = new QWidget(this);
     setCentralWidget(centralWidget);
     QVBoxLayout *mainLayout = new QVBoxLayout(centralWidget);
@@ -119,6 +134,7 @@ void MainWindow::connectSignalsSlots() {
     connect(compareButton, &QPushButton::clicked, this, &MainWindow::onCompareButtonClicked);
     connect(cancelButton, &QPushButton::clicked, this, &MainWindow::onCancelButtonClicked);
     connect(saveJsonButton, &QPushButton::clicked, this, &MainWindow::onSaveJsonButtonClicked);
+    connect(saveTraceAction, &QAction::triggered, this, &MainWindow::onSaveTraceTriggered);
     
     connect(filterInput, &QLineEdit::textChanged, this, &MainWindow::onFilterTextChanged);
     connect(archFilterComboBox, QOverload<const QString &>::of(&QComboBox::currentTextChanged), this, &MainWindow::onArchitectureSelected);
@@ -134,7 +150,7 @@ void MainWindow::onCompareButtonClicked() {
     branch2OnlyCountLabel->setText("Только в Ветке 2: 0");
     branch1NewerCountLabel->setText("Новее в Ветке 1: 0");
     errorLabel->setText(" ");
-    fullComparisonResultJson.clear();
+    clearComparisonResult();
 
     QString branch1 = branch1Input->text();
     QString branch2 = branch2Input->text();
@@ -149,9 +165,13 @@ void MainWindow::onCompareButtonClicked() {
     branch2Input->setEnabled(false);
     cancelButton->setEnabled(true);
     saveJsonButton->setEnabled(false);
+    saveTraceAction->setEnabled(false);
 
     displayError("Начало загрузки и сравнения данных...", false);
 
+    // Запись начинается заново: в трассировке остаётся только это сравнение
+    rdbcompare_trace_start();
+
     workerThread = new QThread(this);
     comparisonWorker = new ComparisonWorker(branch1, branch2);
     comparisonWorker->moveToThread(workerThread);
@@ -167,31 +187,24 @@ void MainWindow::onCompareButtonClicked() {
     connect(workerThread, &QThread::finished, comparisonWorker, &QObject::deleteLater);
     connect(workerThread, &QThread::finished, workerThread, &QObject::deleteLater);
 
-    connect(cancelButton, &QPushButton::clicked, comparisonWorker, &ComparisonWorker::cancelRequested);
+    // DirectConnection: очередь рабочего потока занята сравнением, и queued-слот сработал бы только после него
+    connect(cancelButton, &QPushButton::clicked, comparisonWorker, &ComparisonWorker::cancelRequested, Qt::DirectConnection);
 
     workerThread->start();
 }
 
-void MainWindow::onComparisonFinished(const QString& resultJson) {
+void MainWindow::onComparisonFinished(rdbcompare_result_t* result) {
     if (workerThread) {
         workerThread->quit();
     }
+    rdbcompare_trace_stop();
+    saveTraceAction->setEnabled(true);
 
-    fullComparisonResultJson = resultJson.toStdString();
-
-    QJsonDocument doc = QJsonDocument::fromJson(resultJson.toUtf8());
-    if (doc.isNull() || !doc.isObject()) {
-        displayError("Ошибка: Некорректный формат JSON-ответа от библиотеки.", true);
-        return;
-    }
-
-    QJsonObject rootObj = doc.object();
-    
-    QJsonObject summaryObj = rootObj.value("summary").toObject();
-    updateCountsDisplay(QJsonDocument(summaryObj).toJson(QJsonDocument::Compact).toStdString());
+    clearComparisonResult();
+    comparisonResult = result;
 
-    QJsonObject architecturesObj = rootObj.value("architectures").toObject();
-    populateTable(QJsonDocument(architecturesObj).toJson(QJsonDocument::Compact).toStdString());
+    updateCountsDisplay();
+    populateTable();
 
     displayError("Сравнение успешно завершено.", false); 
     compareButton->setEnabled(true);
@@ -205,6 +218,8 @@ void MainWindow::onComparisonError(const QString& errorMessage) {
     if (workerThread) {
         workerThread->quit();
     }
+    rdbcompare_trace_stop();
+    saveTraceAction->setEnabled(true);
 
     displayError(errorMessage.toStdString(), true); 
     compareButton->setEnabled(true);
@@ -218,6 +233,8 @@ void MainWindow::onComparisonCancelled() {
     if (workerThread) {
         workerThread->quit();
     }
+    rdbcompare_trace_stop();
+    saveTraceAction->setEnabled(true);
     
     resultsTable->clearContents();
     resultsTable->setRowCount(0);
@@ -225,7 +242,7 @@ void MainWindow::onComparisonCancelled() {
     branch2OnlyCountLabel->setText("Только в Ветке 2: 0");
     branch1NewerCountLabel->setText("Новее в Ветке 1: 0");
     errorLabel->setText("Операция отменена.");
-    fullComparisonResultJson.clear();
+    clearComparisonResult();
     
     compareButton->setEnabled(true);
     branch1Input->setEnabled(true);
@@ -247,6 +264,22 @@ void MainWindow::onCancelButtonClicked() {
     displayError("Запрашивается отмена...", false);
 }
 
+void MainWindow::onSaveTraceTriggered() {
+    QString defaultDir = QStandardPaths::writableLocation(QStandardPaths::HomeLocation);
+    QString fileName = QFileDialog::getSaveFileName(this, "Сохранить трассировку сравнения",
+                                                   defaultDir + "/rdbcompare_trace.json",
+                                                   "Trace Event JSON (*.json)");
+    if (fileName.isEmpty()) {
+        return;
+    }
+
+    if (rdbcompare_trace_write(QFile::encodeName(fileName).constData()) == 0) {
+        displayError("Трассировка сохранена в " + fileName.toStdString() + " (откройте в ui.perfetto.dev).", false);
+    } else {
+        displayError("Не удалось сохранить трассировку в " + fileName.toStdString() + ".", true);
+    }
+}
+
 void MainWindow::onSaveJsonButtonClicked() {
     QString defaultDir = QStandardPaths::writableLocation(QStandardPaths::HomeLocation);
     QString fileName = QFileDialog::getSaveFileName(this, "Сохранить результаты сравнения",
@@ -256,78 +289,73 @@ void MainWindow::onSaveJsonButtonClicked() {
         return;
     }
 
-    // Создаем JSON-документ из полного результата
-    QJsonDocument fullDoc = QJsonDocument::fromJson(QString::fromStdString(fullComparisonResultJson).toUtf8());
-    if (fullDoc.isNull() || !fullDoc.isObject()) {
+    if (!comparisonResult) {
         displayError("Ошибка: Некорректные данные для сохранения.", true);
         return;
     }
 
     QJsonObject filteredRootObj;
     QJsonObject filteredArchitecturesObj;
-    QJsonObject originalArchitecturesObj = fullDoc.object().value("architectures").toObject();
 
     QString filterText = filterInput->text().toLower();
     QString selectedArch = archFilterComboBox->currentText();
     bool filterByArch = (selectedArch != "Все архитектуры");
+    QByteArray selectedArchUtf8 = selectedArch.toUtf8();
+
+    // Проходим курсором по результату (при фильтре - только по выбранной архитектуре)
+    // и применяем тот же текстовый фильтр, что и к таблице
+    QMap<QString, QMap<QString, QJsonArray>> filteredPackages;
+    rdbcompare_result_seek(comparisonResult, filterByArch ? selectedArchUtf8.constData() : nullptr, -1);
+    rdbcompare_entry_t entry;
+    while (rdbcompare_result_next(comparisonResult, &entry)) {
+        QString name = toQString(entry.name);
+        if (!filterText.isEmpty() && !name.toLower().contains(filterText)) {
+            continue;
+        }
 
-    // Проходим по исходным данным и применяем те же фильтры
-    for (auto it = originalArchitecturesObj.begin(); it != originalArchitecturesObj.end(); ++it) {
-        QString archName = it.key();
-        QJsonObject archData = it.value().toObject();
-
-        if (filterByArch && archName != selectedArch) {
-            continue; // Пропускаем, если не соответствует фильтру по архитектуре
+        QString archName = toQString(entry.arch);
+        QString category = toQString(entry.category_name);
+        if (entry.category == RDBCOMPARE_BRANCH1_NEWER || entry.category == RDBCOMPARE_BRANCH2_NEWER) {
+            QJsonObject pkgObj;
+            pkgObj.insert("name", name);
+            pkgObj.insert("branch1_version_release", toQString(entry.version1) + "-" + toQString(entry.release1));
+            pkgObj.insert("branch2_version_release", toQString(entry.version2) + "-" + toQString(entry.release2));
+            filteredPackages[archName][category].append(pkgObj);
+        } else if (entry.category == RDBCOMPARE_IDENTICAL) {
+            QJsonObject pkgObj;
+            pkgObj.insert("name", name);
+            pkgObj.insert("evr", toQString(entry.evr1));
+            filteredPackages[archName][category].append(pkgObj);
+        } else if (entry.category == RDBCOMPARE_EPOCH_ONLY) {
+            QJsonObject pkgObj;
+            pkgObj.insert("name", name);
+            pkgObj.insert("branch1_evr", toQString(entry.evr1));
+            pkgObj.insert("branch2_evr", toQString(entry.evr2));
+            filteredPackages[archName][category].append(pkgObj);
+        } else {
+            filteredPackages[archName][category].append(name);
         }
+    }
 
+    for (auto archIt = filteredPackages.begin(); archIt != filteredPackages.end(); ++archIt) {
         QJsonObject filteredArchData;
-        QStringList categories = {"branch1_only", "branch2_only", "branch1_newer"};
-        
-        bool archHasMatchingPackages = false; // Флаг, чтобы знать, есть ли что-то в этой архитектуре после фильтров
-
-        for (const QString& category : categories) {
-            QJsonObject originalCategoryObj = archData.value(category).toObject();
-            QJsonArray originalPackagesArray = originalCategoryObj.value("packages").toArray();
-            
-            QJsonArray filteredPackagesArray;
-            int filteredCount = 0;
-
-            for (const QJsonValue &pkgValue : originalPackagesArray) {
-                // Извлекаем имя пакета для текстового фильтра
-                QString pkgNameForFilter;
-                if (category == "branch1_only" || category == "branch2_only") {
-                    pkgNameForFilter = pkgValue.toString();
-                } else if (category == "branch1_newer") {
-                    pkgNameForFilter = pkgValue.toObject().value("name").toString();
-                }
-
-
-                if (!filterText.isEmpty() && !pkgNameForFilter.toLower().contains(filterText)) {
-                    continue; 
-                }
-
-                filteredPackagesArray.append(pkgValue); // Добавляем пакет, если он прошел фильтры
-                filteredCount++;
-            }
-
-            if (filteredCount > 0) {
-                QJsonObject filteredCategoryObj;
-                filteredCategoryObj.insert("count", filteredCount);
-                filteredCategoryObj.insert("packages", filteredPackagesArray);
-                filteredArchData.insert(category, filteredCategoryObj);
-                archHasMatchingPackages = true;
-            }
-        }
-        
-        if (archHasMatchingPackages) {
-            filteredArchitecturesObj.insert(archName, filteredArchData);
+        for (auto categoryIt = archIt.value().begin(); categoryIt != archIt.value().end(); ++categoryIt) {
+            QJsonObject filteredCategoryObj;
+            filteredCategoryObj.insert("count", categoryIt.value().size());
+            filteredCategoryObj.insert("packages", categoryIt.value());
+            filteredArchData.insert(categoryIt.key(), filteredCategoryObj);
         }
+        filteredArchitecturesObj.insert(archIt.key(), filteredArchData);
     }
 
     filteredRootObj.insert("architectures", filteredArchitecturesObj);
 
 
-    filteredRootObj.insert("summary", fullDoc.object().value("summary"));
+    QJsonObject summaryObj;
+    summaryObj.insert("total_branch1_only_count", static_cast<int>(rdbcompare_result_count(comparisonResult, nullptr, RDBCOMPARE_BRANCH1_ONLY)));
+    summaryObj.insert("total_branch2_only_count", static_cast<int>(rdbcompare_result_count(comparisonResult, nullptr, RDBCOMPARE_BRANCH2_ONLY)));
+    summaryObj.insert("total_branch1_newer_count", static_cast<int>(rdbcompare_result_count(comparisonResult, nullptr, RDBCOMPARE_BRANCH1_NEWER)));
+    filteredRootObj.insert("summary", summaryObj);
 
     QJsonDocument finalDoc(filteredRootObj);
 
@@ -350,126 +378,83 @@ void MainWindow::onArchitectureSelected(const QString &arch) {
     applyTableFilters();
 }
 
-void MainWindow::updateCountsDisplay(const std::string& json_summary_str) {
-    if (json_summary_str.empty()) {
+void MainWindow::updateCountsDisplay() {
+    if (!comparisonResult) {
         branch1OnlyCountLabel->setText("Только в Ветке 1: 0");
         branch2OnlyCountLabel->setText("Только в Ветке 2: 0");
         branch1NewerCountLabel->setText("Новее в Ветке 1: 0");
         return;
     }
-    QJsonDocument doc = QJsonDocument::fromJson(QString::fromStdString(json_summary_str).toUtf8());
-    if (!doc.isNull() && doc.isObject()) {
-        QJsonObject summary = doc.object();
-        branch1OnlyCountLabel->setText(QString("Только в Ветке 1: %1").arg(summary.value("total_branch1_only_count").toInt()));
-        branch2OnlyCountLabel->setText(QString("Только в Ветке 2: %1").arg(summary.value("total_branch2_only_count").toInt()));
-        branch1NewerCountLabel->setText(QString("Новее в Ветке 1: %1").arg(summary.value("total_branch1_newer_count").toInt()));
-    } else {
-        branch1OnlyCountLabel->setText("Только в Ветке 1: N/A");
-        branch2OnlyCountLabel->setText("Только в Ветке 2: N/A");
-        branch1NewerCountLabel->setText("Новее в Ветке 1: N/A");
-    }
+    // Счётчики берутся напрямую из результата, без разбора JSON
+    branch1OnlyCountLabel->setText(QString("Только в Ветке 1: %1").arg(rdbcompare_result_count(comparisonResult, nullptr, RDBCOMPARE_BRANCH1_ONLY)));
+    branch2OnlyCountLabel->setText(QString("Только в Ветке 2: %1").arg(rdbcompare_result_count(comparisonResult, nullptr, RDBCOMPARE_BRANCH2_ONLY)));
+    branch1NewerCountLabel->setText(QString("Новее в Ветке 1: %1").arg(rdbcompare_result_count(comparisonResult, nullptr, RDBCOMPARE_BRANCH1_NEWER)));
 }
 
-void MainWindow::populateTable(const std::string& json_architectures_str) {
+void MainWindow::populateTable() {
     resultsTable->clearContents();
     resultsTable->setRowCount(0);
     archFilterComboBox->clear();
     archFilterComboBox->addItem("Все архитектуры"); // Добавляем по умолчанию
 
-    if (json_architectures_str.empty()) {
+    if (!comparisonResult) {
         return;
     }
 
-    QJsonDocument doc = QJsonDocument::fromJson(QString::fromStdString(json_architectures_str).toUtf8());
-    if (doc.isNull() || !doc.isObject()) {
-        displayError("Некорректный формат данных для заполнения таблицы.", true);
-        return;
+    // Заполняем ComboBox архитектурами
+    size_t archCount = rdbcompare_result_arch_count(comparisonResult);
+    for (size_t i = 0; i < archCount; ++i) {
+        archFilterComboBox->addItem(QString::fromUtf8(rdbcompare_result_arch_name(comparisonResult, i)));
     }
 
-    QJsonObject architectures = doc.object();
+    // Сортировка на время заполнения отключается, иначе строки переставляются после каждой вставки
+    resultsTable->setSortingEnabled(false);
+    resultsTable->setRowCount(static_cast<int>(rdbcompare_result_count(comparisonResult, nullptr, -1)));
+
     int currentRow = 0;
-    QSet<QString> addedArchitectures; // Для уникальных архитектур в комбобоксе
+    rdbcompare_result_seek(comparisonResult, nullptr, -1);
+    rdbcompare_entry_t entry;
+    while (rdbcompare_result_next(comparisonResult, &entry)) {
+        QString epoch, ver1, rel1, ver2, rel2;
+        QString categoryText = toQString(entry.category_name);
+        categoryText.replace("_", " ");
+        if (!categoryText.isEmpty()) {
+            categoryText[0] = categoryText[0].toUpper(); // Делаем первый символ заглавным
+        }
 
-    // Заполняем ComboBox архитектурами
-    for (auto it = architectures.begin(); it != architectures.end(); ++it) {
-        QString archName = it.key();
-        if (!addedArchitectures.contains(archName)) {
-            archFilterComboBox->addItem(archName);
-            addedArchitectures.insert(archName);
+        // Версии есть у всех записей; пакета, отсутствующего в ветке, соответствует прочерк
+        const bool inBranch1 = entry.evr1.size > 0;
+        const bool inBranch2 = entry.evr2.size > 0;
+        const QString absent = QStringLiteral("—");
+        ver1 = inBranch1 ? toQString(entry.version1) : absent;
+        rel1 = inBranch1 ? toQString(entry.release1) : absent;
+        ver2 = inBranch2 ? toQString(entry.version2) : absent;
+        rel2 = inBranch2 ? toQString(entry.release2) : absent;
+        epoch = toQString(inBranch1 ? entry.epoch1 : entry.epoch2);
+        if (inBranch1 && inBranch2 && epoch != toQString(entry.epoch2)) {
+            epoch += " / " + toQString(entry.epoch2);
         }
-    }
 
-    // Теперь заполняем таблицу, проходя по тем же данным
-    for (auto it = architectures.begin(); it != architectures.end(); ++it) {
-        QString archName = it.key();
-        QJsonObject archData = it.value().toObject();
-
-        QStringList categories = {"branch1_only", "branch2_only", "branch1_newer"};
-        for (const QString& category : categories) {
-            QJsonObject categoryObj = archData.value(category).toObject();
-            QJsonArray packagesArray = categoryObj.value("packages").toArray();
-
-            for (const QJsonValue &pkgValue : packagesArray) {
-                QString name, epoch, ver1, rel1, ver2, rel2, categoryText;
-                categoryText = category; 
-                categoryText.replace("_", " ");
-                if (!categoryText.isEmpty()) {
-                    categoryText[0] = categoryText[0].toUpper(); // Делаем первый символ заглавным
-                }
+        resultsTable->setItem(currentRow, 0, new QTableWidgetItem(toQString(entry.arch)));
+        resultsTable->setItem(currentRow, 1, new QTableWidgetItem(toQString(entry.name)));
+        resultsTable->setItem(currentRow, 2, new QTableWidgetItem(epoch));
+        resultsTable->setItem(currentRow, 3, new QTableWidgetItem(ver1));
+        resultsTable->setItem(currentRow, 4, new QTableWidgetItem(rel1));
+        resultsTable->setItem(currentRow, 5, new QTableWidgetItem(ver2));
+        resultsTable->setItem(currentRow, 6, new QTableWidgetItem(rel2));
+        resultsTable->setItem(currentRow, 7, new QTableWidgetItem(categoryText));
 
-                if (category == "branch1_only") {
-                    name = pkgValue.toString();
-                    ver1 = "Присутствует"; rel1 = "Присутствует";
-                    ver2 = "Н/Д"; rel2 = "Н/Д";
-                    epoch = "Н/Д"; // Эпоха для "only" не передаётся в API
-                } else if (category == "branch2_only") {
-                    name = pkgValue.toString();
-                    ver1 = "Н/Д"; rel1 = "Н/Д";
-                    ver2 = "Присутствует"; rel2 = "Присутствует";
-                    epoch = "Н/Д";
-                } else if (category == "branch1_newer") {
-                    QJsonObject pkgObj = pkgValue.toObject(); 
-                    name = pkgObj.value("name").toString();
-                    
-                    // Разделяем branch1_version_release на версию и релиз
-                    QString b1_ver_rel = pkgObj.value("branch1_version_release").toString();
-                    int lastDashB1 = b1_ver_rel.lastIndexOf('-');
-                    if (lastDashB1 != -1) {
-                        ver1 = b1_ver_rel.left(lastDashB1);
-                        rel1 = b1_ver_rel.mid(lastDashB1 + 1);
-                    } else {
-                        ver1 = b1_ver_rel; rel1 = "N/A";
-                    }
-
-                    // Разделяем branch2_version_release на версию и релиз
-                    QString b2_ver_rel = pkgObj.value("branch2_version_release").toString();
-                    int lastDashB2 = b2_ver_rel.lastIndexOf('-');
-                    if (lastDashB2 != -1) {
-                        ver2 = b2_ver_rel.left(lastDashB2);
-                        rel2 = b2_ver_rel.mid(lastDashB2 + 1);
-                    } else {
-                        ver2 = b2_ver_rel; rel2 = "N/A";
-                    }
-                    epoch = "Н/Д"; // Эпоха не передаётся в этом формате
-                }
-                
-                resultsTable->setRowCount(currentRow + 1);
-                resultsTable->setItem(currentRow, 0, new QTableWidgetItem(archName));
-                resultsTable->setItem(currentRow, 1, new QTableWidgetItem(name));
-                resultsTable->setItem(currentRow, 2, new QTableWidgetItem(epoch));
-                resultsTable->setItem(currentRow, 3, new QTableWidgetItem(ver1));
-                resultsTable->setItem(currentRow, 4, new QTableWidgetItem(rel1));
-                resultsTable->setItem(currentRow, 5, new QTableWidgetItem(ver2));
-                resultsTable->setItem(currentRow, 6, new QTableWidgetItem(rel2));
-                resultsTable->setItem(currentRow, 7, new QTableWidgetItem(categoryText));
-                
-                currentRow++;
-            }
-        }
+        currentRow++;
     }
+    resultsTable->setSortingEnabled(true);
     resultsTable->resizeColumnsToContents();
 }
 
+void MainWindow::clearComparisonResult() {
+    rdbcompare_result_free(comparisonResult);
+    comparisonResult = nullptr;
+}
+
 void MainWindow::applyTableFilters() {
     QString filterText = filterInput->text().toLower();
     QString selectedArch = archFilterComboBox->currentText();
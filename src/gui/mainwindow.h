@@ -8,6 +8,7 @@
 #include <QLabel>
 #include <QTableWidget>
 #include <QComboBox>
+#include <QAction>
 #include <QThread> 
 #include "rdbcompare.hpp"
 #include "comparisonworker.h" 
@@ -23,11 +24,12 @@ private slots:
     void onCompareButtonClicked();
     void onCancelButtonClicked();
     void onSaveJsonButtonClicked();
+    void onSaveTraceTriggered();
     void onFilterTextChanged(const QString &text);
     void onArchitectureSelected(const QString &arch);
 
 
-    void onComparisonFinished(const QString& resultJson);
+    void onComparisonFinished(rdbcompare_result_t* result);
     void onComparisonError(const QString& errorMessage);
     void onComparisonCancelled();
     void onWorkStarted();
@@ -50,18 +52,20 @@ private:
     QLabel *errorLabel;
     QPushButton *cancelButton;
     QPushButton *saveJsonButton;
+    QAction *saveTraceAction; // Отладка: временная шкала последнего сравнения
 
     QThread *workerThread;
     ComparisonWorker *comparisonWorker;
 
     void setupUi();
     void connectSignalsSlots();
-    void updateCountsDisplay(const std::string& json_summary);
-    void populateTable(const std::string& json_architectures);
+    void updateCountsDisplay();
+    void populateTable();
+    void clearComparisonResult();
     void applyTableFilters();
     void displayError(const std::string& errorMessage, bool isError = true);
 
-    std::string fullComparisonResultJson; 
+    rdbcompare_result_t* comparisonResult; // Результат последнего сравнения (владеет окно)
 };
 
 #endif // MAINWINDOW_H
\ No newline at end of file
@@ -9,365 +9,4992 @@
 #include <mutex> 
 #include <map>
 #include <set> 
+#include <unordered_set>
+#include <unordered_map>
+#include <chrono>
+#include <fstream>
+#include <filesystem>
+#include <cstdlib>
+#include <cstdio>
+#include <cctype>
+#include <algorithm>
+#include <iterator>
+#include <atomic>
+#include <cstdint>
+#include <memory_resource>
+#include <string_view>
+#include <random>
+#include <array>
+#include <thread>
+#include <tuple>
+#include <optional>
+#include <list>
+#include <functional>
+#include <type_traits>
+#include <condition_variable>
+#include <fnmatch.h>
+#include <strings.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 #include <rpm/rpmvercmp.h>
 
+// Статические точки USDT (провайдер rdbcompare) для perf, bpftrace и SystemTap. У каждой
+// точки есть семафор, который инструмент увеличивает при подключении: пока он ноль, точка -
+// одна проверка, и её аргументы (в том числе подсчёт пакетов и запрос адреса у curl) не
+// вычисляются. Без <sys/sdt.h> (systemtap-sdt-devel) точек нет вовсе
+#if __has_include(<sys/sdt.h>)
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+#define RDBCOMPARE_PROBE_SEMAPHORE(name) \
+    __extension__ unsigned short rdbcompare_##name##_semaphore \
+        __attribute__((unused, section(".probes"), visibility("hidden")))
+RDBCOMPARE_PROBE_SEMAPHORE(request_start);
+RDBCOMPARE_PROBE_SEMAPHORE(request_done);
+RDBCOMPARE_PROBE_SEMAPHORE(chunk);
+RDBCOMPARE_PROBE_SEMAPHORE(parse_start);
+RDBCOMPARE_PROBE_SEMAPHORE(parse_done);
+RDBCOMPARE_PROBE_SEMAPHORE(compare_arch_start);
+RDBCOMPARE_PROBE_SEMAPHORE(compare_arch_done);
+RDBCOMPARE_PROBE_SEMAPHORE(result);
+RDBCOMPARE_PROBE_SEMAPHORE(result_json);
+#define RDBCOMPARE_PROBE(name, ...) \
+    do { \
+        if (__builtin_expect(rdbcompare_##name##_semaphore != 0, 0)) { \
+            STAP_PROBEV(rdbcompare, name, __VA_ARGS__); \
+        } \
+    } while (0)
+#else
+#define RDBCOMPARE_PROBE(name, ...) do {} while (0)
+#endif
+
+// Флаг отмены блокирующих загрузок (rdbcompare_cancel_new); выставляется из любого потока
+struct rdbcompare_cancel {
+    std::atomic<bool> cancelled{false};
+    std::function<bool()> poll;  // Флаг объединённой загрузки (FetchFlights): отменили все её участники
+};
+
+struct rdbcompare_ctx;
+
 namespace rdbcompare{
 
-    struct Package { //Вспомогательная структура
-        std::string name;
-        std::string epoch;
-        std::string version;
-        std::string release;
-        std::string arch;
-        Package() : name(""), epoch("0"), version(""), release(""), arch("") {}
-        Package(std::string n, std::string e, std::string v, std::string r, std::string a)
-            : name(std::move(n)), epoch(std::move(e)), version(std::move(v)), release(std::move(r)), arch(std::move(a)) {}
+    // Счётчики библиотеки, выдаются rdbcompare_stats_json
+    struct Stats {
+        std::atomic<uint64_t> arena_allocations{0};   // Выделений, обслуженных аренами вместо кучи
+        std::atomic<uint64_t> arena_bytes{0};
+        std::atomic<uint64_t> arena_blocks{0};        // Блоков, запрошенных аренами у кучи
+        std::atomic<uint64_t> arena_block_bytes{0};
+        std::atomic<uint64_t> arenas{0};              // Созданных арен (снимки, результаты, пулы строк)
+        std::atomic<uint64_t> interned_strings{0};    // Различных строк в пулах
+        std::atomic<uint64_t> interned_evrs{0};       // Различных EVR в пулах
+        std::atomic<uint64_t> intern_hits{0};         // Строк, найденных в пуле вместо копирования
+        std::atomic<uint64_t> evr_rank_hits{0};       // EVR, ранг которых уже был в словаре
+        std::atomic<uint64_t> evr_rank_added{0};      // EVR, добавленных в словарь
+        std::atomic<uint64_t> evr_rank_rebuilds{0};   // Расширений словаря рангов
+        std::atomic<uint64_t> evr_rank_resets{0};     // Сбросов словаря рангов по evr_rank_bytes
+        std::atomic<uint64_t> endpoint_probes{0};     // Замеров задержки зеркал
+        std::atomic<uint64_t> endpoint_failovers{0};  // Переходов на следующее зеркало после ошибки
+        std::atomic<uint64_t> request_retries{0};     // Повторов запроса после паузы
+        std::atomic<uint64_t> request_timeouts{0};    // Передач, прерванных по таймауту
+        std::atomic<uint64_t> requests_cancelled{0};  // Запросов, прерванных rdbcompare_cancel_request
+        std::atomic<uint64_t> hedged_requests{0};     // Отправленных дублирующих запросов
+        std::atomic<uint64_t> hedge_wins{0};          // Дублирующих запросов, ответивших первыми
+        std::atomic<uint64_t> bytes_received{0};      // Байт тел ответов по сети (сжатых)
+        std::atomic<uint64_t> bytes_decoded{0};       // Байт тел ответов после распаковки
+        std::atomic<uint64_t> sharded_fetches{0};     // Веток, загруженных частями по архитектурам
+        std::atomic<uint64_t> shards{0};              // Загруженных частей
+        std::atomic<uint64_t> connections_opened{0};  // Новых соединений
+        std::atomic<uint64_t> connections_reused{0};  // Передач по уже открытому соединению
+        std::atomic<uint64_t> http2_transfers{0};     // Передач по HTTP/2
+        std::atomic<uint64_t> duplicate_builds{0};    // Повторных сборок одного имени в архитектуре
+        std::atomic<uint64_t> identical_inputs{0};    // Сравнений одинаковых данных (разобраны один раз)
+        std::atomic<uint64_t> hashed_bytes{0};        // Байт входных данных, хэшированных для кэша результатов
+        std::atomic<uint64_t> memo_hits{0};           // Результатов, взятых из кэша в памяти
+        std::atomic<uint64_t> memo_disk_hits{0};      // Результатов, прочитанных из кэша на диске
+        std::atomic<uint64_t> memo_misses{0};         // Сравнений, не найденных в кэше
+        std::atomic<uint64_t> fragment_hits{0};       // Архитектур, JSON которых взят из прежнего сравнения
+        std::atomic<uint64_t> fragment_misses{0};     // Архитектур, сравненных заново
+        std::atomic<uint64_t> fetch_flights{0};       // Загрузок списков пакетов, начатых через объединение
+        std::atomic<uint64_t> fetch_coalesced{0};     // Вызовов, дождавшихся чужой загрузки того же списка
+        std::atomic<uint64_t> snapshot_hits{0};       // Веток, взятых из кэша снимков без разбора
+        std::atomic<uint64_t> snapshot_misses{0};     // Веток, загруженных и разобранных заново
+        std::atomic<uint64_t> snapshot_evictions{0};  // Снимков, вытесненных из кэша
+        std::atomic<uint64_t> snapshot_revalidations{0}; // Снимков, подтверждённых сервером (304 или тот же тег)
+    };
 
+    // Контекст, с которым работает текущий вызов API в этом потоке (nullptr - контекст по
+    // умолчанию). Его объекты - настройки, соединения, кэши и счётчики - доступны через
+    // функции stats(), config_locked(), connections() и т.д., определённые после rdbcompare_ctx
+    thread_local rdbcompare_ctx* active_ctx = nullptr;
 
-        std::string toString() const {
-            return name + "-" + version + "-" + release + "." + arch;//Для отладки
+    // Делает контекст текущим для потока до конца области видимости
+    class ContextScope {
+    public:
+        explicit ContextScope(rdbcompare_ctx* ctx) : previous_(active_ctx) {
+            active_ctx = ctx;
+        }
+
+        ~ContextScope() {
+            active_ctx = previous_;
         }
+
+        ContextScope(const ContextScope&) = delete;
+        ContextScope& operator=(const ContextScope&) = delete;
+
+    private:
+        rdbcompare_ctx* previous_;
     };
 
-    using ArchPackages = std::map<std::string, std::map<std::string, Package>>;// Пакеты сгруппированные по архитектуре
+    Stats& stats();
 
-    
-    std::once_flag branches_init_flag;//Флаг инициализации
+    // Журнал библиотеки, общий для процесса. У сообщения есть уровень (RDBCOMPARE_LOG_*) и
+    // вид (kind): частота ограничивается по виду - сверх burst сообщений за interval они не
+    // выводятся, а подсчитываются и сводятся в одно "N similar messages suppressed" при первом
+    // сообщении того же вида после интервала (или в rdbcompare_log_flush). Приёмник по
+    // умолчанию - stderr, одна запись на строку; текст последней ошибки запоминается для
+    // потока (rdbcompare_last_error)
+    thread_local std::string last_error;
 
-    // Кэш для действительных имен веток
-    std::vector<std::string> cached_branches;
-    size_t write_callback(void* contents, size_t size, size_t nmemb, std::string* output) { 
-        // Записывает данные HTTP-ответа в строку
-        size_t total_size = size * nmemb;
-        output->append(static_cast<char*>(contents), total_size);
-        return total_size;
-    }
+    class Logger {
+    public:
+        Logger() {
+            // RDBCOMPARE_LOG_LEVEL: число 0-3 или error, warning, info, debug
+            const char* value = std::getenv("RDBCOMPARE_LOG_LEVEL");
+            int level = value ? parse_level(value) : -1;
+            if (level >= 0) {
+                level_.store(level, std::memory_order_relaxed);
+            }
+        }
 
-    bool perform_http_request(const std::string& url, std::string& response, long& http_code) {
-        //Выполняем запрос и возвращаем true при response 200
-        CURL* curl = curl_easy_init();
-        if (!curl) {
-            std::cerr << "Error: Failed to initialize curl" << std::endl;
-            return false;
+        static int parse_level(const char* value) {
+            static const char* const names[] = {"error", "warning", "info", "debug"};
+            for (int level = 0; level < 4; ++level) {
+                if (strcasecmp(value, names[level]) == 0 || (value[0] == '0' + level && !value[1])) {
+                    return level;
+                }
+            }
+            return -1;
         }
 
-        auto cleanup = [](CURL* c) { curl_easy_cleanup(c); };
-        std::unique_ptr<CURL, decltype(cleanup)> curl_guard(curl, cleanup);
+        bool enabled(int level) const { return level <= level_.load(std::memory_order_relaxed); }
+        void set_level(int level) { level_.store(level, std::memory_order_relaxed); }
 
-        curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
-        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_callback);
-        curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
-        curl_easy_setopt(curl, CURLOPT_USERAGENT, "rdbcompare/1.0");
+        void set_sink(rdbcompare_log_cb callback, void* userdata) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            callback_ = callback;
+            userdata_ = userdata;
+        }
 
-        CURLcode res = curl_easy_perform(curl);
-        if (res != CURLE_OK) {
-            std::cerr << "Error: HTTP request failed: " << curl_easy_strerror(res) << std::endl;
-            return false;
+        void set_rate(unsigned burst, long interval_ms) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            burst_ = burst;
+            interval_ = std::chrono::milliseconds(std::max(0L, interval_ms));
         }
 
-        curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_code);
-        return http_code == 200;
+        void write(int level, const char* kind, const std::string& message) {
+            if (level == RDBCOMPARE_LOG_ERROR) {
+                last_error = message;
+            }
+            if (!enabled(level)) {
+                return;
+            }
+            size_t suppressed = 0;
+            int suppressed_level = level;
+            bool pass = true;
+            rdbcompare_log_cb callback;
+            void* userdata;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                callback = callback_;
+                userdata = userdata_;
+                if (burst_ > 0) {
+                    Kind& state = kinds_[kind];
+                    auto now = std::chrono::steady_clock::now();
+                    if (now - state.window_start >= interval_) {
+                        suppressed = state.suppressed;
+                        suppressed_level = state.level;
+                        state = Kind{};
+                        state.window_start = now;
+                    }
+                    if (state.count < burst_) {
+                        state.count++;
+                    } else {
+                        state.suppressed++;
+                        state.level = std::min(state.level, level);
+                        pass = false;
+                    }
+                }
+            }
+            if (suppressed > 0) {
+                emit(callback, userdata, suppressed_level, kind, summary(suppressed));
+            }
+            if (pass) {
+                emit(callback, userdata, level, kind, message);
+            }
+        }
+
+        void flush() {
+            // Сводки по видам, у которых остались подавленные сообщения
+            std::vector<std::tuple<int, std::string, size_t>> pending;
+            rdbcompare_log_cb callback;
+            void* userdata;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                callback = callback_;
+                userdata = userdata_;
+                for (auto& kind : kinds_) {
+                    if (kind.second.suppressed > 0) {
+                        pending.emplace_back(kind.second.level, kind.first, kind.second.suppressed);
+                    }
+                }
+                kinds_.clear();
+            }
+            for (const auto& item : pending) {
+                emit(callback, userdata, std::get<0>(item), std::get<1>(item).c_str(), summary(std::get<2>(item)));
+            }
+        }
+
+    private:
+        struct Kind {
+            std::chrono::steady_clock::time_point window_start;
+            unsigned count = 0;       // Выведено в текущем интервале
+            size_t suppressed = 0;    // Подавлено в текущем интервале
+            int level = RDBCOMPARE_LOG_DEBUG;  // Самый важный уровень среди подавленных
+        };
+
+        static std::string summary(size_t suppressed) {
+            return std::to_string(suppressed) + (suppressed == 1 ? " similar message" : " similar messages") + " suppressed";
+        }
+
+        static void emit(rdbcompare_log_cb callback, void* userdata, int level, const char* kind, const std::string& message) {
+            if (callback) {
+                callback(level, kind, message.c_str(), userdata);
+                return;
+            }
+            static const char* const prefixes[] = {"Error: ", "Warning: ", "Info: ", "Debug: "};
+            std::string line = prefixes[std::clamp(level, 0, 3)] + message + '\n';
+            std::cerr.write(line.data(), static_cast<std::streamsize>(line.size()));
+        }
+
+        std::atomic<int> level_{RDBCOMPARE_LOG_WARNING};
+        std::mutex mutex_;
+        rdbcompare_log_cb callback_ = nullptr;
+        void* userdata_ = nullptr;
+        unsigned burst_ = 10;
+        std::chrono::steady_clock::duration interval_ = std::chrono::seconds(1);
+        std::map<std::string, Kind, std::less<>> kinds_;
+    };
+
+    Logger& logger() {
+        // Не разрушается при выходе из процесса: сообщения возможны и из деструкторов
+        static Logger* instance = new Logger;
+        return *instance;
     }
 
-    bool is_valid_branch(const char* branch_name) {
-        // Проверяет, является ли имя ветки действительным, получая и кэшируя список веток
+    // Строка журнала, собираемая через <<; выводится в деструкторе. Если уровень выключен,
+    // текст предупреждений не собирается вовсе:
+    //   log_error("http.failed") << "HTTP request failed: " << reason;
+    class LogLine {
+    public:
+        // Текст ошибки собирается всегда: он нужен rdbcompare_last_error и при выключенном выводе
+        LogLine(int level, const char* kind)
+            : level_(level), kind_(kind), active_(level == RDBCOMPARE_LOG_ERROR || logger().enabled(level)) {}
 
-        if (!branch_name || !*branch_name) { // Проверяет корректность входного имени ветки
-            std::cerr << "Error: Invalid branch name" << std::endl;
-            return false;
+        ~LogLine() {
+            if (active_) {
+                logger().write(level_, kind_, message_);
+            }
         }
 
-        // Используем std::call_once для потокобезопасной инициализации cached_branches
-        std::call_once(branches_init_flag, []() {
-            // Запрашиваем JSON со списком веток
-            std::string response;
-            long http_code = 0;
-            if (!perform_http_request("https://rdb.altlinux.org/api/export/branch_tree", response, http_code)) {
-                std::cerr << "Error: Failed to fetch branch list, HTTP code: " << http_code << std::endl;
-                return; // Возвращаемся из лямбды
+        LogLine(const LogLine&) = delete;
+        LogLine& operator=(const LogLine&) = delete;
+
+        LogLine& operator<<(std::string_view text) {
+            if (active_) {
+                message_ += text;
+            }
+            return *this;
+        }
+
+        LogLine& operator<<(char c) {
+            if (active_) {
+                message_ += c;
             }
+            return *this;
+        }
 
-            json_object* parsed_json = json_tokener_parse(response.c_str()); // Парсим JSON-объект
-            if (!parsed_json) {
-                std::cerr << "Error: Failed to parse branch list JSON" << std::endl;
-                return;
+        template <typename Number, typename = std::enable_if_t<std::is_arithmetic_v<Number>>>
+        LogLine& operator<<(Number value) {
+            if (active_) {
+                message_ += std::to_string(value);
             }
+            return *this;
+        }
+
+    private:
+        int level_;
+        const char* kind_;
+        bool active_;
+        std::string message_;
+    };
+
+    LogLine log_error(const char* kind) { return LogLine(RDBCOMPARE_LOG_ERROR, kind); }
+    LogLine log_warning(const char* kind) { return LogLine(RDBCOMPARE_LOG_WARNING, kind); }
+
+    template <typename Out>
+    void append_json_string(Out& out, std::string_view value);
+
+    // Запись событий в формате Chrome trace-event (chrome://tracing, Perfetto): фазы загрузки
+    // (DNS, соединение, TLS, ожидание и приём ответа), разбора, сравнения архитектур и вывода
+    // с номерами потоков. Запись общая для процесса (всех контекстов); выключенная стоит
+    // одной проверки флага tracing на событие
+    std::atomic<bool> tracing{false};
+
+    class Tracer {
+    public:
+        static constexpr size_t max_events = 1 << 20;  // Дальше события отбрасываются
+
+        void start() {
+            std::lock_guard<std::mutex> lock(mutex_);
+            events_.clear();
+            dropped_ = 0;
+            tracing.store(true, std::memory_order_relaxed);
+        }
+
+        void stop() {
+            tracing.store(false, std::memory_order_relaxed);
+        }
 
-            // Используем std::unique_ptr для автоматической очистки json_object
-            auto cleanup_json = [](json_object* obj) { json_object_put(obj); };
-            std::unique_ptr<json_object, decltype(cleanup_json)> json_guard(parsed_json, cleanup_json);
+        uint64_t now_us() const {
+            return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - origin_).count());
+        }
 
-            json_object* branches; // Получаем список веток
-            if (!json_object_object_get_ex(parsed_json, "branches", &branches) || !json_object_is_type(branches, json_type_array)) {
-                std::cerr << "Error: Invalid branch list format" << std::endl;
+        // phase: 'X' - интервал [ts, ts + dur], 'i' - мгновенное событие; args - поля
+        // объекта args без фигурных скобок
+        void add(char phase, const char* name, const char* category, uint64_t ts, uint64_t dur, std::string args = {}) {
+            thread_local const uint32_t tid = static_cast<uint32_t>(syscall(SYS_gettid));
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (events_.size() >= max_events) {
+                dropped_++;
                 return;
             }
+            events_.push_back(Event{phase, name, category, ts, dur, tid, std::move(args)});
+        }
 
-            // Заполняем кэш именами веток
-            for (size_t i = 0; i < json_object_array_length(branches); i++) {
-                const char* name = json_object_get_string(json_object_array_get_idx(branches, i));
-                if (name) {
-                    cached_branches.emplace_back(name);
+        std::string to_json() {
+            std::lock_guard<std::mutex> lock(mutex_);
+            const std::string pid = std::to_string(getpid());
+            std::string json = "{\"traceEvents\":[{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":" + pid +
+                               ",\"args\":{\"name\":\"rdbcompare\"}}";
+            json.reserve(events_.size() * 128);
+            char numbers[96];
+            for (const Event& event : events_) {
+                json += ",{\"name\":\"";
+                json += event.name;
+                json += "\",\"cat\":\"";
+                json += event.category;
+                json += "\",\"ph\":\"";
+                json += event.phase;
+                if (event.phase == 'X') {
+                    std::snprintf(numbers, sizeof(numbers), "\",\"ts\":%llu,\"dur\":%llu",
+                                  static_cast<unsigned long long>(event.ts), static_cast<unsigned long long>(event.dur));
+                } else {
+                    std::snprintf(numbers, sizeof(numbers), "\",\"s\":\"t\",\"ts\":%llu",
+                                  static_cast<unsigned long long>(event.ts));
+                }
+                json += numbers;
+                json += ",\"pid\":" + pid + ",\"tid\":" + std::to_string(event.tid);
+                if (!event.args.empty()) {
+                    json += ",\"args\":{" + event.args + '}';
                 }
+                json += '}';
             }
-        });
+            json += "],\"displayTimeUnit\":\"ms\",\"otherData\":{\"dropped_events\":" + std::to_string(dropped_) + "}}";
+            return json;
+        }
 
+    private:
+        struct Event {
+            char phase;
+            const char* name;      // Строковые константы
+            const char* category;
+            uint64_t ts, dur;      // Микросекунды от создания Tracer
+            uint32_t tid;
+            std::string args;
+        };
 
-        if (cached_branches.empty()) {
-            std::cerr << "Error: Кэш списка веток пуст. Не удалось получить ветки." << std::endl;
-            return false;
+        const std::chrono::steady_clock::time_point origin_ = std::chrono::steady_clock::now();
+        std::mutex mutex_;
+        std::vector<Event> events_;
+        size_t dropped_ = 0;
+    };
+
+    Tracer& tracer() {
+        // Не разрушается при выходе из процесса: запись по RDBCOMPARE_TRACE сохраняется в atexit
+        static Tracer* instance = new Tracer;
+        return *instance;
+    }
+
+    void append_trace_arg(std::string& args, const char* key, std::string_view value) {
+        args += args.empty() ? "\"" : ",\"";
+        args += key;
+        args += "\":";
+        append_json_string(args, value);
+    }
+
+    void append_trace_arg(std::string& args, const char* key, uint64_t value) {
+        args += args.empty() ? "\"" : ",\"";
+        args += key;
+        args += "\":" + std::to_string(value);
+    }
+
+    // Интервал от создания до конца области видимости. Аргументы вычисляются, только если
+    // запись включена: if (span.active()) span.arg(...)
+    class TraceSpan {
+    public:
+        TraceSpan(const char* name, const char* category)
+            : name_(tracing.load(std::memory_order_relaxed) ? name : nullptr), category_(category) {
+            if (name_) {
+                start_ = tracer().now_us();
+            }
         }
 
-        // Ищем ветку в кэшированном списке
-        for (const auto& name : cached_branches) {
-            if (name == branch_name) {
-                return true;
+        ~TraceSpan() { end(); }
+
+        // Завершает интервал раньше конца области видимости
+        void end() {
+            if (name_) {
+                tracer().add('X', name_, category_, start_, tracer().now_us() - start_, std::move(args_));
+                name_ = nullptr;
             }
         }
-        
-        std::cerr << "Error: Ветка '" << branch_name << "' не найдена в списке веток" << std::endl;
-        return false;
-    }
-    std::string make_package_url(const char* branch_name) {
-        // Формирует URL для запроса пакетов ветки
-        return "https://rdb.altlinux.org/api/export/branch_binary_packages/" + std::string(branch_name);
-    }
 
-    char* allocate_result(const std::string& data) {
-        // Выделяет память для результата 
-        char* result = strdup(data.c_str());
-        if (!result) {
-            std::cerr << "Error: Failed to allocate memory for result" << std::endl;
+        TraceSpan(const TraceSpan&) = delete;
+        TraceSpan& operator=(const TraceSpan&) = delete;
+
+        bool active() const { return name_ != nullptr; }
+
+        template <typename Value>
+        void arg(const char* key, const Value& value) {
+            append_trace_arg(args_, key, value);
         }
-        return result;
+
+    private:
+        const char* name_;
+        const char* category_;
+        uint64_t start_ = 0;
+        std::string args_;
+    };
+
+    bool write_trace(const char* path) {
+        std::ofstream out(path, std::ios::binary | std::ios::trunc);
+        out << tracer().to_json();
+        if (!out) {
+            log_error("trace.write") << "Failed to write trace to " << path;
+            return false;
+        }
+        return true;
     }
 
+    // RDBCOMPARE_TRACE=FILE: запись с загрузки библиотеки, файл сохраняется при выходе из процесса
+    const bool trace_from_environment = [] {
+        const char* path = std::getenv("RDBCOMPARE_TRACE");
+        if (!path || !*path) {
+            return false;
+        }
+        tracer().start();
+        std::atexit([] { write_trace(std::getenv("RDBCOMPARE_TRACE")); });
+        return true;
+    }();
+
+    // Источник блоков одной арены: обычная куча с подсчётом обращений и занятого объёма
+    class CountingResource : public std::pmr::memory_resource {
+    public:
+        explicit CountingResource(Stats& stats) : stats_(stats) {}
 
-    ArchPackages parse_packages_json(const char* json_data) {
-        ArchPackages arch_packages; 
+        size_t bytes() const { return bytes_; }  // Блоков у кучи сейчас, байт
 
-        if (!json_data) {
-            std::cerr << "Error: Input JSON data is null." << std::endl;
-            return arch_packages;
+    private:
+        void* do_allocate(size_t bytes, size_t alignment) override {
+            stats_.arena_blocks.fetch_add(1, std::memory_order_relaxed);
+            stats_.arena_block_bytes.fetch_add(bytes, std::memory_order_relaxed);
+            void* block = std::pmr::new_delete_resource()->allocate(bytes, alignment);
+            bytes_ += bytes;
+            return block;
         }
 
-        json_object* parsed_json = json_tokener_parse(json_data);
-        if (!parsed_json) {
-            std::cerr << "Error: Failed to parse package list JSON. Invalid JSON format." << std::endl;
-            return arch_packages;
+        void do_deallocate(void* p, size_t bytes, size_t alignment) override {
+            bytes_ -= bytes;
+            std::pmr::new_delete_resource()->deallocate(p, bytes, alignment);
         }
 
-        
-        auto cleanup_json = [](json_object* obj) { json_object_put(obj); };
-        std::unique_ptr<json_object, decltype(cleanup_json)> json_guard(parsed_json, cleanup_json);
+        bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+            return this == &other;
+        }
 
-        json_object* packages_array;
-        
-        if (!json_object_object_get_ex(parsed_json, "packages", &packages_array) || !json_object_is_type(packages_array, json_type_array)) {
-            std::cerr << "Error: 'packages' array not found or is not an array in JSON response." << std::endl;
-            return arch_packages;
+        Stats& stats_;
+        size_t bytes_ = 0;
+    };
+
+    // Монотонная арена: выделения только растут и освобождаются все разом вместе с ареной.
+    // Строки, узлы словарей и записи результата берутся из неё без обращений к куче
+    class Arena : public std::pmr::memory_resource {
+    public:
+        Arena() : stats_(stats()), blocks_(stats_), buffer_(initial_block, &blocks_) {
+            stats_.arenas.fetch_add(1, std::memory_order_relaxed);
         }
 
-        
-        for (size_t i = 0; i < json_object_array_length(packages_array); ++i) {
-            json_object* pkg_obj = json_object_array_get_idx(packages_array, i);
-            if (!pkg_obj) {
-                std::cerr << "Warning: Null package object found in array at index " << i << ". Skipping." << std::endl;
-                continue;
-            }
+        ~Arena() override {
+            // Счётчики копятся локально, чтобы не трогать общие атомики на каждое выделение,
+            // и попадают в контекст, создавший арену, даже если она освобождается вне его
+            stats_.arena_allocations.fetch_add(allocations_, std::memory_order_relaxed);
+            stats_.arena_bytes.fetch_add(bytes_, std::memory_order_relaxed);
+        }
 
-            // Временные указатели для извлечения значений
-            json_object *name_obj, *epoch_obj, *version_obj, *release_obj, *arch_obj;
+        Arena(const Arena&) = delete;
+        Arena& operator=(const Arena&) = delete;
 
-            if (json_object_object_get_ex(pkg_obj, "name", &name_obj) &&
-                json_object_object_get_ex(pkg_obj, "epoch", &epoch_obj) &&
-                json_object_object_get_ex(pkg_obj, "version", &version_obj) &&
-                json_object_object_get_ex(pkg_obj, "release", &release_obj) &&
-                json_object_object_get_ex(pkg_obj, "arch", &arch_obj))
-            {
-                
-                std::string epoch_str = (epoch_obj && json_object_get_string(epoch_obj)) ? json_object_get_string(epoch_obj) : "0";
-
-                
-                Package pkg(
-                    json_object_get_string(name_obj),
-                    epoch_str,
-                    json_object_get_string(version_obj),
-                    json_object_get_string(release_obj),
-                    json_object_get_string(arch_obj)
-                );
-
-                arch_packages[pkg.arch][pkg.name] = pkg;
-            } else {
-                std::cerr << "Warning: Missing one or more required fields (name, epoch, version, release, arch) for package at index " << i << ". Skipping." << std::endl;
-            }
+        // Копия строки в арене с завершающим нулём (его можно передавать в C-функции)
+        std::string_view store(const char* data, size_t size) {
+            char* copy = static_cast<char*>(allocate(size + 1, 1));
+            std::memcpy(copy, data, size);
+            copy[size] = '\0';
+            return {copy, size};
         }
 
-        return arch_packages;
-    }
-    // Возвращает: >0 если pkg1 новее, <0 если pkg2 новее, 0 если равны.
-    int compare_versions(const Package& pkg1, const Package& pkg2) {
-        long epoch1 = std::atol(pkg1.epoch.c_str());
-        long epoch2 = std::atol(pkg2.epoch.c_str());
+        // Память, занятая ареной в куче: сумма её блоков, а не только выданных байт
+        size_t footprint() const { return blocks_.bytes(); }
 
-        if (epoch1 != epoch2) {
-            return epoch1 - epoch2;
+    private:
+        static constexpr size_t initial_block = 64 * 1024;
+
+        void* do_allocate(size_t bytes, size_t alignment) override {
+            allocations_++;
+            bytes_ += bytes;
+            return buffer_.allocate(bytes, alignment);
         }
 
-        int ver_cmp_result = rpmvercmp(pkg1.version.c_str(), pkg2.version.c_str());
+        void do_deallocate(void*, size_t, size_t) override {}
 
-        if (ver_cmp_result != 0) {
-            return ver_cmp_result;
+        bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+            return this == &other;
         }
 
-        int rel_cmp_result = rpmvercmp(pkg1.release.c_str(), pkg2.release.c_str());
+        Stats& stats_;   // Счётчики контекста, создавшего арену
+        CountingResource blocks_;  // Объявлен до buffer_: тот возвращает блоки в деструкторе
+        std::pmr::monotonic_buffer_resource buffer_;
+        uint64_t allocations_ = 0;
+        uint64_t bytes_ = 0;
+    };
 
-        return rel_cmp_result;
-    }
-}
-extern "C" {
-    void rdbcompare_init() {
-        curl_global_init(CURL_GLOBAL_ALL);
+    // Константы смешивания hash_bytes и отпечатков архитектур
+    constexpr uint64_t hash_secret[4] = {0xa0761d6478bd642full, 0xe7037ed1a0b428dbull,
+                                         0x8ebc6af09c88c6e3ull, 0x589965cc75374cc3ull};
+
+    uint64_t read64(const unsigned char* p) {
+        uint64_t value;
+        std::memcpy(&value, p, sizeof(value));
+        return value;
     }
 
-    void rdbcompare_cleanup() {
-        curl_global_cleanup();
+    uint64_t read32(const unsigned char* p) {
+        uint32_t value;
+        std::memcpy(&value, p, sizeof(value));
+        return value;
     }
 
-    char* fetch_package_list(const char* branch) {
+    uint64_t mix64(uint64_t a, uint64_t b) {
+        // Произведение 64x64 -> 128 бит, половины которого складываются по xor
+        unsigned __int128 product = static_cast<unsigned __int128>(a) * b;
+        return static_cast<uint64_t>(product) ^ static_cast<uint64_t>(product >> 64);
+    }
 
-        if (!rdbcompare::is_valid_branch(branch)) {
-            return nullptr;
+    uint64_t hash_bytes(const char* data, size_t size) {
+        // Быстрый некриптографический 64-битный хэш по схеме wyhash: 48 байт за шаг
+        // в три независимые цепочки умножений, так что скорость ограничена памятью
+        const uint64_t k0 = hash_secret[0], k1 = hash_secret[1], k2 = hash_secret[2], k3 = hash_secret[3];
+        const unsigned char* p = reinterpret_cast<const unsigned char*>(data);
+        uint64_t seed = mix64(k0 ^ size, k1);
+        uint64_t a = 0, b = 0;
+        if (size <= 16) {
+            if (size >= 4) {
+                const size_t shift = (size >> 3) << 2;
+                a = (read32(p) << 32) | read32(p + shift);
+                b = (read32(p + size - 4) << 32) | read32(p + size - 4 - shift);
+            } else if (size > 0) {
+                a = (static_cast<uint64_t>(p[0]) << 16) | (static_cast<uint64_t>(p[size >> 1]) << 8) | p[size - 1];
+            }
+        } else {
+            size_t left = size;
+            if (left > 48) {
+                uint64_t lane1 = seed, lane2 = seed;
+                do {
+                    seed = mix64(read64(p) ^ k1, read64(p + 8) ^ seed);
+                    lane1 = mix64(read64(p + 16) ^ k2, read64(p + 24) ^ lane1);
+                    lane2 = mix64(read64(p + 32) ^ k3, read64(p + 40) ^ lane2);
+                    p += 48;
+                    left -= 48;
+                } while (left > 48);
+                seed ^= lane1 ^ lane2;
+            }
+            while (left > 16) {
+                seed = mix64(read64(p) ^ k1, read64(p + 8) ^ seed);
+                p += 16;
+                left -= 16;
+            }
+            // Последние 16 байт (могут перекрываться с уже обработанными)
+            a = read64(p + left - 16);
+            b = read64(p + left - 8);
         }
+        return mix64(k1 ^ size, mix64(a ^ k1, b ^ seed));
+    }
 
-        std::string response;
-        long http_code = 0;
-        std::string url = rdbcompare::make_package_url(branch);
+    // Интернированная тройка эпоха-версия-релиз: одна запись на все архитектуры
+    // и на оба снимка сравнения, так что равные EVR - это один и тот же указатель
+    struct Evr {
+        std::string_view epoch;
+        std::string_view version;
+        std::string_view release;
+        uint32_t id;
+    };
 
-        if (!rdbcompare::perform_http_request(url, response, http_code)) {
-            std::cerr << "Error: Failed to fetch packages for '" << branch << "', HTTP code: " << http_code << std::endl;
-            return nullptr;
+    struct Package { //Вспомогательная структура; строки лежат в пуле строк и завершаются нулём
+        std::string_view name;
+        std::string_view arch;
+        const Evr* evr = nullptr;
+        uint32_t name_id = 0;
+
+        std::string toString() const {
+            return std::string(name) + "-" + std::string(evr->version) + "-" + std::string(evr->release) + "." + std::string(arch);//Для отладки
         }
+    };
 
-        return rdbcompare::allocate_result(response);
+    // Пул интернированных строк с 32-битными идентификаторами. Имена, архитектуры
+    // и EVR, повторяющиеся по архитектурам, хранятся один раз. Один пул разделяют
+    // оба снимка сравнения, поэтому равенство проверяется сравнением id
+    class StringPool {
+    public:
+        StringPool() = default;
+        StringPool(const StringPool&) = delete;
+        StringPool& operator=(const StringPool&) = delete;
 
-    }
+        ~StringPool() {
+            stats_.interned_strings.fetch_add(strings_.size(), std::memory_order_relaxed);
+            stats_.interned_evrs.fetch_add(evrs_.size(), std::memory_order_relaxed);
+            stats_.intern_hits.fetch_add(hits_, std::memory_order_relaxed);
+        }
 
-char* compare_packages(const char* branch1_data, const char* branch2_data) {
+        uint32_t intern(std::string_view text) {
+            auto found = ids_.find(text);
+            if (found != ids_.end()) {
+                hits_++;
+                return found->second;
+            }
+            uint32_t id = static_cast<uint32_t>(strings_.size());
+            std::string_view stored = arena_.store(text.data(), text.size());
+            strings_.push_back(stored);
+            ids_.emplace(stored, id);
+            return id;
+        }
 
-    if (!branch1_data || !branch2_data) {
-        std::cerr << "Error: One or both branch data inputs are null." << std::endl;
-        return nullptr;
-    }
+        std::string_view str(uint32_t id) const { return strings_[id]; }
 
-    rdbcompare::ArchPackages branch1_pkgs = rdbcompare::parse_packages_json(branch1_data);
-    rdbcompare::ArchPackages branch2_pkgs = rdbcompare::parse_packages_json(branch2_data);
+        const std::vector<const Evr*>& evrs() const { return evrs_; }  // По id
 
-    if (branch1_pkgs.empty() && strlen(branch1_data) > 0) {
-        std::cerr << "Error: Failed to parse packages for branch 1." << std::endl;
-        return nullptr;
-    }
-    if (branch2_pkgs.empty() && strlen(branch2_data) > 0) {
-        std::cerr << "Error: Failed to parse packages for branch 2." << std::endl;
-        return nullptr;
-    }
+        // Память пула в куче: арена со строками и словарями и массивы по id
+        size_t footprint() const {
+            return sizeof(*this) + arena_.footprint() + strings_.capacity() * sizeof(std::string_view) +
+                   evrs_.capacity() * sizeof(const Evr*);
+        }
+
+        const Evr* intern_evr(std::string_view epoch, std::string_view version, std::string_view release) {
+            EvrKey key{intern(epoch), intern(version), intern(release)};
+            auto found = evr_ids_.find(key);
+            if (found != evr_ids_.end()) {
+                return found->second;
+            }
+            Evr* evr = static_cast<Evr*>(arena_.allocate(sizeof(Evr), alignof(Evr)));
+            *evr = Evr{str(key.epoch), str(key.version), str(key.release), static_cast<uint32_t>(evrs_.size())};
+            evrs_.push_back(evr);
+            evr_ids_.emplace(key, evr);
+            return evr;
+        }
 
-    json_object* result_json = json_object_new_object();
-    auto cleanup_result_json = [](json_object* obj) { json_object_put(obj); };
-    std::unique_ptr<json_object, decltype(cleanup_result_json)> result_guard(result_json, cleanup_result_json);
+    private:
+        struct EvrKey {
+            uint32_t epoch, version, release;
+            bool operator==(const EvrKey& other) const {
+                return epoch == other.epoch && version == other.version && release == other.release;
+            }
+        };
 
-    json_object* architectures_json = json_object_new_object();
-    json_object_object_add(result_json, "architectures", architectures_json);
+        struct EvrKeyHash {
+            size_t operator()(const EvrKey& key) const {
+                uint64_t packed = (static_cast<uint64_t>(key.version) << 32) | key.release;
+                return std::hash<uint64_t>()(packed * 31 + key.epoch);
+            }
+        };
 
-    int total_branch1_only_count = 0;
-    int total_branch2_only_count = 0;
-    int total_branch1_newer_count = 0;
+        Arena arena_;   // Объявлена первой: словари ниже выделяют память из неё
+        std::pmr::unordered_map<std::string_view, uint32_t> ids_{&arena_};
+        std::pmr::unordered_map<EvrKey, const Evr*, EvrKeyHash> evr_ids_{&arena_};
+        std::vector<std::string_view> strings_;
+        std::vector<const Evr*> evrs_;
+        uint64_t hits_ = 0;
+        Stats& stats_ = stats();   // Счётчики контекста, создавшего пул
+    };
 
-    std::set<std::string> all_architectures;
+    using NamePackages = std::pmr::map<std::string_view, Package>;
+    using ArchPackages = std::pmr::map<std::string_view, NamePackages>;// Пакеты сгруппированные по архитектуре
 
-    for (const auto& pair : branch1_pkgs) {
-        all_architectures.insert(pair.first);
-    }
+    // Разобранный список пакетов ветки. Узлы словарей лежат в арене снимка и
+    // освобождаются вместе с ним одним действием, строки - в общем пуле
+    struct Snapshot {
+        explicit Snapshot(std::shared_ptr<StringPool> strings)
+            : pool(strings ? std::move(strings) : std::make_shared<StringPool>()) {}
 
-    for (const auto& pair : branch2_pkgs) {
-        all_architectures.insert(pair.first);
-    }
+        std::shared_ptr<StringPool> pool;
+        Arena arena;
+        ArchPackages packages{&arena};
+        // Все EVR имён, встретившихся в одной архитектуре несколько раз, по убыванию
+        // (ключ - архитектура и id имени); в packages у такого имени старшая из них
+        std::pmr::map<std::pair<std::string_view, uint32_t>, std::pmr::vector<const Evr*>> builds{&arena};
+        size_t duplicates = 0;  // Записей, не ставших представителем своего имени
+        std::pmr::map<std::string_view, uint64_t> fingerprints{&arena};  // Отпечатки архитектур
 
-    for (const std::string& arch : all_architectures) {
-        json_object* arch_comparison_json = json_object_new_object();
-        json_object_object_add(architectures_json, arch.c_str(), arch_comparison_json);
+        // Добавляет сборку в словарь архитектуры; итог не зависит от порядка вызовов
+        void add(NamePackages& arch_packages, const Package& pkg);
 
-        json_object* branch1_only_obj = json_object_new_object();
-        json_object* branch2_only_obj = json_object_new_object();
-        json_object* branch1_newer_obj = json_object_new_object();
+        uint64_t fingerprint(std::string_view arch) const {
+            // 0 - архитектуры нет в снимке
+            auto found = fingerprints.find(arch);
+            return found != fingerprints.end() ? found->second : 0;
+        }
 
-        int arch_branch1_only_count = 0;
-        int arch_branch2_only_count = 0;
-        int arch_branch1_newer_count = 0;
+        // Память снимка в куче вместе с пулом строк (для снимка со своим пулом - вся)
+        size_t footprint() const {
+            return sizeof(*this) + arena.footprint() + pool->footprint();
+        }
 
-        json_object* branch1_only_packages_array = json_object_new_array();
-        json_object* branch2_only_packages_array = json_object_new_array();
-        json_object* branch1_newer_packages_array = json_object_new_array();
+        size_t package_count() const {
+            size_t count = 0;
+            for (const auto& arch : packages) {
+                count += arch.second.size();
+            }
+            return count;
+        }
+    };
 
-        json_object_object_add(branch1_only_obj, "packages", branch1_only_packages_array);
-        json_object_object_add(branch2_only_obj, "packages", branch2_only_packages_array);
-        json_object_object_add(branch1_newer_obj, "packages", branch1_newer_packages_array);
+    // Фильтр, применяемый при разборе: записи других архитектур и имён
+    // отбрасываются до создания Package и не попадают в сравнение
+    struct Filter {
+        std::vector<std::string> arches;    // Пусто - все архитектуры
+        std::vector<std::string> prefixes;  // Шаблоны вида "python3-*" сравниваются как префиксы
+        std::vector<std::string> globs;     // Остальные шаблоны проверяются fnmatch
 
-        const auto& pkgs1_in_arch = branch1_pkgs.count(arch) ? branch1_pkgs.at(arch) : std::map<std::string, rdbcompare::Package>();
-        const auto& pkgs2_in_arch = branch2_pkgs.count(arch) ? branch2_pkgs.at(arch) : std::map<std::string, rdbcompare::Package>();
+        void add_name_pattern(const std::string& pattern) {
+            size_t wildcard = pattern.find_first_of("*?[\\");
+            if (wildcard != std::string::npos && wildcard == pattern.size() - 1 && pattern.back() == '*') {
+                prefixes.push_back(pattern.substr(0, wildcard));
+            } else {
+                globs.push_back(pattern);
+            }
+        }
 
-        for (const auto& pair1 : pkgs1_in_arch) {
-            const std::string& pkg_name = pair1.first;
-            const rdbcompare::Package& pkg1 = pair1.second;
+        bool accepts_arch(const char* arch) const {
+            if (arches.empty()) {
+                return true;
+            }
+            return std::any_of(arches.begin(), arches.end(), [arch](const std::string& a) { return a == arch; });
+        }
 
-            if (pkgs2_in_arch.count(pkg_name)) {
-                const rdbcompare::Package& pkg2 = pkgs2_in_arch.at(pkg_name);
-                int cmp_result = rdbcompare::compare_versions(pkg1, pkg2); 
-                if (cmp_result > 0) {
-                    json_object* diff_entry = json_object_new_object();
-                    json_object_object_add(diff_entry, "name", json_object_new_string(pkg_name.c_str()));
-                    json_object_object_add(diff_entry, "branch1_version_release", json_object_new_string((pkg1.version + "-" + pkg1.release).c_str()));
-                    json_object_object_add(diff_entry, "branch2_version_release", json_object_new_string((pkg2.version + "-" + pkg2.release).c_str()));
-                    json_object_array_add(branch1_newer_packages_array, diff_entry); 
-                    arch_branch1_newer_count++; 
+        bool accepts_name(const char* name) const {
+            if (prefixes.empty() && globs.empty()) {
+                return true;
+            }
+            for (const auto& prefix : prefixes) {
+                if (std::strncmp(name, prefix.c_str(), prefix.size()) == 0) {
+                    return true;
                 }
-            } else {
-                json_object_array_add(branch1_only_packages_array, json_object_new_string(pkg_name.c_str())); 
-                arch_branch1_only_count++; 
             }
+            for (const auto& glob : globs) {
+                if (fnmatch(glob.c_str(), name, 0) == 0) {
+                    return true;
+                }
+            }
+            return false;
+        }
+    };
+
+    // Настройки библиотеки. Значения по умолчанию переопределяются переменными
+    // окружения RDBCOMPARE_<ИМЯ> (например, RDBCOMPARE_BRANCH_CACHE_TTL) или rdbcompare_set_option().
+    const char* const default_api_base = "https://rdb.altlinux.org/api";
+
+    struct Config {
+        long branch_cache_ttl = 3600;   // Время жизни списка веток, секунды (0 - запрашивать каждый раз)
+        bool validate_branches = true;  // Проверять ветку по branch_tree до загрузки пакетов
+        bool persist_cache = true;      // Сохранять список веток на диск между запусками
+        bool arch_query = true;         // Передавать серверу ?arch=, если в фильтре ровно одна архитектура
+        std::string cache_dir;          // Каталог кэша ("" - $XDG_CACHE_HOME/rdbcompare или ~/.cache/rdbcompare)
+        bool evr_ranks = true;          // Сравнивать версии по рангам из общего словаря EVR
+        long evr_rank_bytes = 16L << 20; // Предельный объём словаря рангов, байт (0 - без словаря)
+        std::string api_base = default_api_base;  // Адрес REST API без завершающего "/"
+        std::string endpoints;          // Зеркала API через запятую или пробел, в порядке предпочтения
+        std::string endpoints_file;     // Файл со списком зеркал ("" - $XDG_CONFIG_HOME/rdbcompare/endpoints)
+        long probe_interval = 300;      // Повторный замер задержки зеркал, секунды (0 - только один раз)
+        long probe_timeout_ms = 2000;   // Предельное время замера одного зеркала
+        long connect_timeout_ms = 10000; // Время на установку соединения
+        long timeout = 300;             // Предельное время одной передачи, секунды (0 - без ограничения)
+        long low_speed_limit = 1024;    // Передача прерывается, если скорость ниже (байт/с)...
+        long low_speed_time = 30;       // ...дольше этого времени, секунды
+        long retries = 2;               // Повторов после ошибки на всех зеркалах
+        long retry_backoff_ms = 500;    // Пауза перед первым повтором, далее удваивается
+        bool hedge = false;             // Дублировать медленную загрузку списка пакетов
+        long hedge_delay_ms = 0;        // Когда дублировать (0 - по 95-му перцентилю прежних загрузок)
+        bool compression = true;        // Запрашивать сжатые ответы (Accept-Encoding)
+        bool sharded = false;           // Загружать ветку частями по архитектурам параллельно
+        std::string shard_arches;       // Архитектуры частей ("" - запросить у сервера all_pkgset_archs)
+        long shard_connections = 6;     // Одновременных загрузок частей
+        bool http2 = true;              // HTTP/2 с мультиплексированием (для https), иначе HTTP/1.1
+        bool reuse_connections = true;  // Держать соединения открытыми между запросами потока
+        long memo_size = 8;             // Результатов compare_packages в кэше по содержимому (0 - без кэша)
+        long memo_bytes = 64L << 20;    // Предельный объём кэша результатов в памяти, байт
+        bool persist_memo = false;      // Сохранять кэш результатов в каталоге кэша (не более memo_size файлов)
+        long fragment_cache_bytes = 32L << 20; // JSON архитектур прежних сравнений, байт (0 - не хранить)
+        bool coalesce_fetches = true;   // Одновременные загрузки одного списка пакетов - одной передачей
+        long snapshot_cache_bytes = 256L << 20; // Разобранные ветки в памяти, байт (0 - только закреплённые)
+        long snapshot_ttl = 60;         // Снимок моложе этого не перепроверяется у сервера, секунды
+    };
+
+    const char* const option_names[] = {"branch_cache_ttl", "validate_branches", "persist_cache", "arch_query", "cache_dir", "evr_ranks", "evr_rank_bytes", "api_base",
+                                         "endpoints", "endpoints_file", "probe_interval", "probe_timeout_ms",
+                                         "connect_timeout_ms", "timeout", "low_speed_limit", "low_speed_time",
+                                         "retries", "retry_backoff_ms", "hedge", "hedge_delay_ms", "compression",
+                                         "sharded", "shard_arches", "shard_connections", "http2", "reuse_connections",
+                                         "memo_size", "memo_bytes", "persist_memo", "fragment_cache_bytes",
+                                         "coalesce_fetches", "snapshot_cache_bytes", "snapshot_ttl"};
+
+    bool parse_bool_option(const char* value, bool& out) {
+        std::string v = value ? value : "";
+        if (v == "1" || v == "yes" || v == "true" || v == "on") { out = true; return true; }
+        if (v == "0" || v == "no" || v == "false" || v == "off") { out = false; return true; }
+        return false;
+    }
+
+    bool parse_long_option(const char* value, long& out) {
+        if (!value || !*value) {
+            return false;
+        }
+        char* end = nullptr;
+        long parsed = std::strtol(value, &end, 10);
+        if (*end != '\0' || parsed < 0) {
+            return false;
+        }
+        out = parsed;
+        return true;
+    }
+
+    bool apply_option(Config& cfg, const std::string& name, const char* value) {
+        // Применяет одну настройку, возвращает false для неизвестного имени или некорректного значения
+        if (name == "branch_cache_ttl") return parse_long_option(value, cfg.branch_cache_ttl);
+        if (name == "validate_branches") return parse_bool_option(value, cfg.validate_branches);
+        if (name == "persist_cache") return parse_bool_option(value, cfg.persist_cache);
+        if (name == "arch_query") return parse_bool_option(value, cfg.arch_query);
+        if (name == "cache_dir") { cfg.cache_dir = value ? value : ""; return true; }
+        if (name == "evr_ranks") return parse_bool_option(value, cfg.evr_ranks);
+        if (name == "evr_rank_bytes") return parse_long_option(value, cfg.evr_rank_bytes);
+        if (name == "api_base") {
+            // Например, http://127.0.0.1:8080/api для локального тестового сервера
+            std::string base = value ? value : "";
+            while (!base.empty() && base.back() == '/') {
+                base.pop_back();
+            }
+            if (base.empty()) {
+                return false;
+            }
+            cfg.api_base = base;
+            return true;
         }
+        if (name == "endpoints") { cfg.endpoints = value ? value : ""; return true; }
+        if (name == "endpoints_file") { cfg.endpoints_file = value ? value : ""; return true; }
+        if (name == "probe_interval") return parse_long_option(value, cfg.probe_interval);
+        if (name == "probe_timeout_ms") return parse_long_option(value, cfg.probe_timeout_ms);
+        if (name == "connect_timeout_ms") return parse_long_option(value, cfg.connect_timeout_ms);
+        if (name == "timeout") return parse_long_option(value, cfg.timeout);
+        if (name == "low_speed_limit") return parse_long_option(value, cfg.low_speed_limit);
+        if (name == "low_speed_time") return parse_long_option(value, cfg.low_speed_time);
+        if (name == "retries") return parse_long_option(value, cfg.retries);
+        if (name == "retry_backoff_ms") return parse_long_option(value, cfg.retry_backoff_ms);
+        if (name == "hedge") return parse_bool_option(value, cfg.hedge);
+        if (name == "hedge_delay_ms") return parse_long_option(value, cfg.hedge_delay_ms);
+        if (name == "compression") return parse_bool_option(value, cfg.compression);
+        if (name == "sharded") return parse_bool_option(value, cfg.sharded);
+        if (name == "shard_arches") { cfg.shard_arches = value ? value : ""; return true; }
+        if (name == "shard_connections") return parse_long_option(value, cfg.shard_connections) && cfg.shard_connections > 0;
+        if (name == "http2") return parse_bool_option(value, cfg.http2);
+        if (name == "reuse_connections") return parse_bool_option(value, cfg.reuse_connections);
+        if (name == "memo_size") return parse_long_option(value, cfg.memo_size);
+        if (name == "memo_bytes") return parse_long_option(value, cfg.memo_bytes);
+        if (name == "persist_memo") return parse_bool_option(value, cfg.persist_memo);
+        if (name == "fragment_cache_bytes") return parse_long_option(value, cfg.fragment_cache_bytes);
+        if (name == "coalesce_fetches") return parse_bool_option(value, cfg.coalesce_fetches);
+        if (name == "snapshot_cache_bytes") return parse_long_option(value, cfg.snapshot_cache_bytes);
+        if (name == "snapshot_ttl") return parse_long_option(value, cfg.snapshot_ttl);
+        return false;
+    }
 
-        for (const auto& pair2 : pkgs2_in_arch) {
-            const std::string& pkg_name = pair2.first;
-            if (!pkgs1_in_arch.count(pkg_name)) {
-                json_object_array_add(branch2_only_packages_array, json_object_new_string(pkg_name.c_str())); 
-                arch_branch2_only_count++; 
+    Config config_from_environment() {
+        // Начальные настройки контекста: значения по умолчанию с поправками из окружения
+        Config cfg;
+        for (const char* name : option_names) {
+            std::string env_name = "RDBCOMPARE_";
+            for (const char* p = name; *p; ++p) {
+                env_name += static_cast<char>(std::toupper(static_cast<unsigned char>(*p)));
+            }
+            if (const char* value = std::getenv(env_name.c_str())) {
+                if (!apply_option(cfg, name, value)) {
+                    log_warning("option.env") << "Ignoring invalid value of " << env_name;
+                }
             }
         }
+        return cfg;
+    }
+
+    std::mutex& config_mutex();
+    Config& config_locked();  // Настройки текущего контекста; вызывать под config_mutex()
 
-        json_object_object_add(branch1_only_obj, "count", json_object_new_int(arch_branch1_only_count));
-        json_object_object_add(branch2_only_obj, "count", json_object_new_int(arch_branch2_only_count));
-        json_object_object_add(branch1_newer_obj, "count", json_object_new_int(arch_branch1_newer_count));
+    Config current_config() {
+        std::lock_guard<std::mutex> lock(config_mutex());
+        return config_locked();
+    }
 
-        json_object_object_add(arch_comparison_json, "branch1_only", branch1_only_obj);
-        json_object_object_add(arch_comparison_json, "branch2_only", branch2_only_obj);
-        json_object_object_add(arch_comparison_json, "branch1_newer", branch1_newer_obj);
+    
+    size_t write_callback(void* contents, size_t size, size_t nmemb, std::string* output) { 
+        // Записывает данные HTTP-ответа в строку
+        size_t total_size = size * nmemb;
+        output->append(static_cast<char*>(contents), total_size);
+        RDBCOMPARE_PROBE(chunk, total_size, output->size());
+        if (tracing.load(std::memory_order_relaxed)) {
+            tracer().add('i', "chunk", "http", tracer().now_us(), 0, "\"bytes\":" + std::to_string(total_size));
+        }
+        return total_size;
+    }
 
-        total_branch1_only_count += arch_branch1_only_count;
-        total_branch2_only_count += arch_branch2_only_count;
-        total_branch1_newer_count += arch_branch1_newer_count;
+    size_t header_callback(char* buffer, size_t size, size_t nitems, std::string* etag) {
+        // Запоминает ETag ответа; строка статуса начинает заголовки нового ответа
+        size_t total_size = size * nitems;
+        std::string_view line(buffer, total_size);
+        if (line.compare(0, 5, "HTTP/") == 0) {
+            etag->clear();
+        } else if (total_size > 5 && strncasecmp(buffer, "etag:", 5) == 0) {
+            line.remove_prefix(5);
+            while (!line.empty() && std::isspace(static_cast<unsigned char>(line.front()))) {
+                line.remove_prefix(1);
+            }
+            while (!line.empty() && std::isspace(static_cast<unsigned char>(line.back()))) {
+                line.remove_suffix(1);
+            }
+            etag->assign(line);
+        }
+        return total_size;
     }
 
-    json_object* summary_json = json_object_new_object();
-    json_object_object_add(summary_json, "total_branch1_only_count", json_object_new_int(total_branch1_only_count));
-    json_object_object_add(summary_json, "total_branch2_only_count", json_object_new_int(total_branch2_only_count));
-    json_object_object_add(summary_json, "total_branch1_newer_count", json_object_new_int(total_branch1_newer_count));
-    json_object_object_add(result_json, "summary", summary_json);
+    // Соединения контекста. Кэш соединений libcurl живёт в мульти-дескрипторе, а делить
+    // соединения между потоками libcurl не умеет, поэтому запрос берёт свободный дескриптор
+    // и возвращает его после передачи: последовательные запросы (branch_tree и оба списка
+    // пакетов сравнения, серия сравнений) идут по одному соединению, одновременные из
+    // разных потоков - по своим, а дублирующий запрос - потоком HTTP/2 в том же дескрипторе.
+    // TLS-сессии и DNS общие для всех дескрипторов контекста: новое соединение к тому же
+    // серверу (другой поток, часть ветки) возобновляет сессию без полного рукопожатия
+    class ConnectionPool {
+    public:
+        ConnectionPool() : share_(curl_share_init()) {
+            if (share_) {
+                curl_share_setopt(share_, CURLSHOPT_LOCKFUNC, +[](CURL*, curl_lock_data data, curl_lock_access, void* userp) {
+                    static_cast<ConnectionPool*>(userp)->locks_[data].lock();
+                });
+                curl_share_setopt(share_, CURLSHOPT_UNLOCKFUNC, +[](CURL*, curl_lock_data data, void* userp) {
+                    static_cast<ConnectionPool*>(userp)->locks_[data].unlock();
+                });
+                curl_share_setopt(share_, CURLSHOPT_USERDATA, this);
+                curl_share_setopt(share_, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+                curl_share_setopt(share_, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+            }
+        }
 
-    const char* json_string = json_object_to_json_string_ext(result_json, JSON_C_TO_STRING_PRETTY);
-    char* final_result = strdup(json_string);
+        ~ConnectionPool() {
+            reset();
+            if (share_) {
+                curl_share_cleanup(share_);
+            }
+        }
 
-    return final_result;
-}
+        ConnectionPool(const ConnectionPool&) = delete;
+        ConnectionPool& operator=(const ConnectionPool&) = delete;
+
+        CURLSH* share() const { return share_; }
+
+        CURLM* acquire() {
+            // Последний возвращённый дескриптор: его соединения вероятнее всего ещё открыты
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                if (!idle_.empty()) {
+                    CURLM* multi = idle_.back();
+                    idle_.pop_back();
+                    return multi;
+                }
+            }
+            CURLM* multi = curl_multi_init();
+            if (multi) {
+                curl_multi_setopt(multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+            }
+            return multi;
+        }
+
+        void release(CURLM* multi) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            idle_.push_back(multi);
+        }
+
+        void reset() {
+            // Закрывает соединения свободных дескрипторов
+            std::vector<CURLM*> idle;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                idle.swap(idle_);
+            }
+            for (CURLM* multi : idle) {
+                curl_multi_cleanup(multi);
+            }
+        }
+
+    private:
+        std::mutex mutex_;
+        std::vector<CURLM*> idle_;  // Свободные дескрипторы, недавно возвращённые в конце
+        std::array<std::mutex, CURL_LOCK_DATA_LAST> locks_;
+        CURLSH* share_;
+    };
+
+    ConnectionPool& connections();
+
+    void setup_transfer(CURL* curl, const std::string& url, std::string* response) {
+        // Общие параметры запроса для блокирующих вызовов и цикла событий
+        Config cfg = current_config();
+        RDBCOMPARE_PROBE(request_start, curl, url.c_str());
+        curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_callback);
+        curl_easy_setopt(curl, CURLOPT_WRITEDATA, response);
+        curl_easy_setopt(curl, CURLOPT_USERAGENT, "rdbcompare/1.0");
+        // Зависшее соединение не должно блокировать вызов бесконечно
+        curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT_MS, cfg.connect_timeout_ms);
+        curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, cfg.timeout * 1000L);
+        curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, cfg.low_speed_limit);
+        curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME, cfg.low_speed_time);
+        // Списки пакетов сжимаются примерно в 10 раз. "" - все кодировки, с которыми собран
+        // libcurl (gzip, deflate, br, zstd); тело распаковывается потоково по мере приёма,
+        // и write_callback получает уже распакованные блоки
+        curl_easy_setopt(curl, CURLOPT_ACCEPT_ENCODING, cfg.compression ? "" : nullptr);
+        // HTTP/2 согласуется через ALPN только для https, иначе остаётся HTTP/1.1. PIPEWAIT:
+        // новый запрос ждёт мультиплексирования в устанавливаемое соединение, а не открывает второе
+        curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, cfg.http2 ? CURL_HTTP_VERSION_2TLS : CURL_HTTP_VERSION_1_1);
+        curl_easy_setopt(curl, CURLOPT_PIPEWAIT, cfg.http2 ? 1L : 0L);
+        curl_easy_setopt(curl, CURLOPT_SHARE, connections().share());
+    }
+
+    const char* effective_url(CURL* curl) {
+        const char* url = nullptr;
+        curl_easy_getinfo(curl, CURLINFO_EFFECTIVE_URL, &url);
+        return url ? url : "";
+    }
+
+    void trace_transfer(CURL* curl, long http_code, curl_off_t wire, size_t decoded) {
+        // Фазы завершённой передачи по замерам libcurl (микросекунды от её начала): весь
+        // запрос, DNS, TCP, TLS, ожидание первого байта и приём тела
+        curl_off_t namelookup = 0, connect = 0, appconnect = 0, pretransfer = 0, starttransfer = 0, total = 0;
+        curl_easy_getinfo(curl, CURLINFO_NAMELOOKUP_TIME_T, &namelookup);
+        curl_easy_getinfo(curl, CURLINFO_CONNECT_TIME_T, &connect);
+        curl_easy_getinfo(curl, CURLINFO_APPCONNECT_TIME_T, &appconnect);
+        curl_easy_getinfo(curl, CURLINFO_PRETRANSFER_TIME_T, &pretransfer);
+        curl_easy_getinfo(curl, CURLINFO_STARTTRANSFER_TIME_T, &starttransfer);
+        curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME_T, &total);
+        const uint64_t now = tracer().now_us();
+        const uint64_t start = now > static_cast<uint64_t>(total) ? now - static_cast<uint64_t>(total) : 0;
+        auto phase = [&](const char* name, curl_off_t from, curl_off_t to) {
+            if (to > from) {
+                tracer().add('X', name, "http", start + static_cast<uint64_t>(from), static_cast<uint64_t>(to - from));
+            }
+        };
+        std::string args;
+        append_trace_arg(args, "url", effective_url(curl));
+        append_trace_arg(args, "http_code", static_cast<uint64_t>(http_code));
+        append_trace_arg(args, "bytes", static_cast<uint64_t>(wire));
+        append_trace_arg(args, "decoded", decoded);
+        tracer().add('X', "transfer", "http", start, static_cast<uint64_t>(total), std::move(args));
+        phase("dns", 0, namelookup);
+        phase("connect", namelookup, connect);
+        phase("tls", connect, appconnect);
+        phase("wait", pretransfer, starttransfer);
+        phase("receive", starttransfer, total);
+    }
+
+    void count_transfer(CURL* curl, size_t decoded) {
+        // Байты по сети (CURLINFO_SIZE_DOWNLOAD - до распаковки) и после распаковки,
+        // новые и повторно использованные соединения
+        curl_off_t wire = 0;
+        long connects = 0;
+        long http_code = 0;
+        long version = 0;
+        curl_easy_getinfo(curl, CURLINFO_SIZE_DOWNLOAD_T, &wire);
+        curl_easy_getinfo(curl, CURLINFO_NUM_CONNECTS, &connects);
+        curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_code);
+        curl_easy_getinfo(curl, CURLINFO_HTTP_VERSION, &version);
+        stats().bytes_received.fetch_add(static_cast<uint64_t>(wire), std::memory_order_relaxed);
+        stats().bytes_decoded.fetch_add(decoded, std::memory_order_relaxed);
+        stats().connections_opened.fetch_add(static_cast<uint64_t>(connects), std::memory_order_relaxed);
+        if (connects == 0 && http_code > 0) {
+            stats().connections_reused.fetch_add(1, std::memory_order_relaxed);
+        }
+        if (version == CURL_HTTP_VERSION_2_0) {
+            stats().http2_transfers.fetch_add(1, std::memory_order_relaxed);
+        }
+        RDBCOMPARE_PROBE(request_done, curl, effective_url(curl), http_code, wire, decoded);
+        if (tracing.load(std::memory_order_relaxed)) {
+            trace_transfer(curl, http_code, wire, decoded);
+        }
+    }
+
+    std::vector<std::string> split_list(const std::string& text) {
+        // Значения через запятую, пробелы или строки без повторов; "#" до конца строки -
+        // комментарий, завершающие "/" (у адресов) отбрасываются
+        std::vector<std::string> bases;
+        std::string current;
+        bool comment = false;
+        for (char c : text + "\n") {
+            if (c == '\n') {
+                comment = false;
+            }
+            if (comment || c == '#') {
+                comment = true;
+                continue;
+            }
+            if (c == ',' || std::isspace(static_cast<unsigned char>(c))) {
+                while (!current.empty() && current.back() == '/') {
+                    current.pop_back();
+                }
+                if (!current.empty() && std::find(bases.begin(), bases.end(), current) == bases.end()) {
+                    bases.push_back(current);
+                }
+                current.clear();
+            } else {
+                current += c;
+            }
+        }
+        return bases;
+    }
+
+    std::filesystem::path endpoints_file_path(const Config& cfg) {
+        if (!cfg.endpoints_file.empty()) {
+            return cfg.endpoints_file;
+        }
+        if (const char* xdg = std::getenv("XDG_CONFIG_HOME"); xdg && *xdg) {
+            return std::filesystem::path(xdg) / "rdbcompare" / "endpoints";
+        }
+        if (const char* home = std::getenv("HOME"); home && *home) {
+            return std::filesystem::path(home) / ".config" / "rdbcompare" / "endpoints";
+        }
+        return {};
+    }
+
+    std::vector<std::string> configured_endpoints(const Config& cfg) {
+        // Порядок источников: опция endpoints (RDBCOMPARE_ENDPOINTS), явно заданный
+        // api_base, файл зеркал, адрес по умолчанию
+        if (std::vector<std::string> bases = split_list(cfg.endpoints); !bases.empty()) {
+            return bases;
+        }
+        if (cfg.api_base != default_api_base) {
+            return {cfg.api_base};
+        }
+        std::filesystem::path file = endpoints_file_path(cfg);
+        if (!file.empty()) {
+            std::ifstream in(file);
+            std::string text((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+            if (std::vector<std::string> bases = split_list(text); !bases.empty()) {
+                return bases;
+            }
+        }
+        return {cfg.api_base};
+    }
+
+    // Зеркала API: задержка каждого замеряется запросом HEAD к branch_tree (параллельно,
+    // при первом обращении и затем раз в probe_interval), запросы идут на самое быстрое
+    // исправное, а при ошибке соединения или ответе 5xx - на следующее по списку
+    class EndpointSet {
+    public:
+        // Адреса в порядке попыток: исправные по возрастанию задержки, затем остальные.
+        // probe = false - не замерять задержку сейчас (для цикла событий: замер блокирует)
+        std::vector<std::string> candidates(bool probe = true) {
+            Config cfg = current_config();
+            std::vector<std::string> bases;
+            bool need_probe = false;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                sync(cfg);
+                Clock::time_point now = Clock::now();
+                need_probe = probe && endpoints_.size() > 1 &&
+                    (!probed_ || (cfg.probe_interval > 0 && now - probed_at_ >= std::chrono::seconds(cfg.probe_interval)));
+                if (!need_probe) {
+                    return ordered(now);
+                }
+                for (const Endpoint& endpoint : endpoints_) {
+                    bases.push_back(endpoint.base);
+                }
+                probed_ = true;          // Параллельные вызовы не запускают второй замер
+                probed_at_ = now;
+            }
+            run_probe(bases, cfg.probe_timeout_ms);
+            std::lock_guard<std::mutex> lock(mutex_);
+            return ordered(Clock::now());
+        }
+
+        void probe() {
+            // Принудительный замер (rdbcompare_init и rdbcompare_probe_endpoints)
+            std::vector<std::string> bases;
+            Config cfg = current_config();
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                sync(cfg);
+                for (const Endpoint& endpoint : endpoints_) {
+                    bases.push_back(endpoint.base);
+                }
+                probed_ = true;
+                probed_at_ = Clock::now();
+            }
+            run_probe(bases, cfg.probe_timeout_ms);
+        }
+
+        // Итог запроса к зеркалу: ok = false для ошибок соединения и 5xx
+        void report(const std::string& base, bool ok, double first_byte_ms, size_t bytes) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            Endpoint* endpoint = find(base);
+            if (!endpoint) {
+                return;
+            }
+            endpoint->requests++;
+            endpoint->bytes += bytes;
+            if (ok) {
+                endpoint->healthy = true;
+                update_latency(*endpoint, first_byte_ms);
+            } else {
+                endpoint->failures++;
+                mark_failed(*endpoint);
+            }
+        }
+
+        std::string to_json() {
+            std::lock_guard<std::mutex> lock(mutex_);
+            sync(current_config());
+            std::string json = "[";
+            for (const Endpoint& endpoint : endpoints_) {
+                if (json.size() > 1) {
+                    json += ',';
+                }
+                json += "{\"url\":";
+                append_json_string(json, endpoint.base);
+                json += ",\"healthy\":";
+                json += endpoint.healthy ? "true" : "false";
+                json += ",\"latency_ms\":";
+                json += endpoint.latency_ms < 0 ? std::string("null") : std::to_string(endpoint.latency_ms);
+                json += ",\"requests\":" + std::to_string(endpoint.requests);
+                json += ",\"failures\":" + std::to_string(endpoint.failures);
+                json += ",\"probes\":" + std::to_string(endpoint.probes);
+                json += ",\"bytes\":" + std::to_string(endpoint.bytes);
+                json += '}';
+            }
+            json += ']';
+            return json;
+        }
+
+    private:
+        using Clock = std::chrono::steady_clock;
+        static constexpr std::chrono::seconds failure_backoff{30};
+
+        struct Endpoint {
+            std::string base;
+            bool healthy = true;
+            double latency_ms = -1;         // Сглаженная задержка до первого байта; -1 - не измерялась
+            Clock::time_point retry_after{}; // После ошибки зеркало пробуется только после этого момента
+            uint64_t requests = 0;
+            uint64_t failures = 0;
+            uint64_t probes = 0;
+            uint64_t bytes = 0;
+        };
+
+        void sync(const Config& cfg) {
+            // Список перечитывается при изменении настроек; состояние известных зеркал сохраняется
+            std::string key = cfg.endpoints + '\n' + cfg.api_base + '\n' + cfg.endpoints_file;
+            if (loaded_ && key == source_key_) {
+                return;
+            }
+            std::vector<Endpoint> updated;
+            for (const std::string& base : configured_endpoints(cfg)) {
+                Endpoint* known = find(base);
+                updated.push_back(known ? *known : Endpoint{base});
+            }
+            endpoints_.swap(updated);
+            source_key_ = key;
+            loaded_ = true;
+            probed_ = false;
+        }
+
+        Endpoint* find(const std::string& base) {
+            for (Endpoint& endpoint : endpoints_) {
+                if (endpoint.base == base) {
+                    return &endpoint;
+                }
+            }
+            return nullptr;
+        }
+
+        std::vector<std::string> ordered(Clock::time_point now) const {
+            std::vector<const Endpoint*> order;
+            for (const Endpoint& endpoint : endpoints_) {
+                order.push_back(&endpoint);
+            }
+            auto usable = [now](const Endpoint* e) { return e->healthy || now >= e->retry_after; };
+            // stable_sort: при равной (или неизмеренной) задержке сохраняется порядок из настроек
+            std::stable_sort(order.begin(), order.end(), [&](const Endpoint* a, const Endpoint* b) {
+                if (usable(a) != usable(b)) {
+                    return usable(a);
+                }
+                double la = a->latency_ms < 0 ? 1e300 : a->latency_ms;
+                double lb = b->latency_ms < 0 ? 1e300 : b->latency_ms;
+                return la < lb;
+            });
+            std::vector<std::string> bases;
+            for (const Endpoint* endpoint : order) {
+                bases.push_back(endpoint->base);
+            }
+            return bases;
+        }
+
+        static void update_latency(Endpoint& endpoint, double ms) {
+            endpoint.latency_ms = endpoint.latency_ms < 0 ? ms : endpoint.latency_ms * 0.7 + ms * 0.3;
+        }
+
+        static void mark_failed(Endpoint& endpoint) {
+            endpoint.healthy = false;
+            endpoint.retry_after = Clock::now() + failure_backoff;
+        }
+
+        void run_probe(const std::vector<std::string>& bases, long timeout_ms) {
+            // HEAD-запросы ко всем зеркалам одновременно; ждём не дольше timeout_ms
+            CURLM* multi = curl_multi_init();
+            if (!multi) {
+                return;
+            }
+            std::vector<CURL*> handles;
+            for (const std::string& base : bases) {
+                CURL* easy = curl_easy_init();
+                if (!easy) {
+                    continue;
+                }
+                curl_easy_setopt(easy, CURLOPT_URL, (base + "/export/branch_tree").c_str());
+                curl_easy_setopt(easy, CURLOPT_NOBODY, 1L);
+                curl_easy_setopt(easy, CURLOPT_USERAGENT, "rdbcompare/1.0");
+                curl_easy_setopt(easy, CURLOPT_TIMEOUT_MS, timeout_ms > 0 ? timeout_ms : 2000L);
+                curl_easy_setopt(easy, CURLOPT_PRIVATE, const_cast<char*>(base.c_str()));
+                curl_multi_add_handle(multi, easy);
+                handles.push_back(easy);
+            }
+
+            int running = 0;
+            do {
+                curl_multi_perform(multi, &running);
+                if (running) {
+                    curl_multi_poll(multi, nullptr, 0, 100, nullptr);
+                }
+            } while (running);
+
+            std::lock_guard<std::mutex> lock(mutex_);
+            int queued = 0;
+            while (CURLMsg* msg = curl_multi_info_read(multi, &queued)) {
+                if (msg->msg != CURLMSG_DONE) {
+                    continue;
+                }
+                char* base = nullptr;
+                long http_code = 0;
+                curl_off_t total_us = 0;
+                curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &base);
+                curl_easy_getinfo(msg->easy_handle, CURLINFO_RESPONSE_CODE, &http_code);
+                curl_easy_getinfo(msg->easy_handle, CURLINFO_TOTAL_TIME_T, &total_us);
+                Endpoint* endpoint = base ? find(base) : nullptr;
+                if (!endpoint) {
+                    continue;
+                }
+                endpoint->probes++;
+                stats().endpoint_probes.fetch_add(1, std::memory_order_relaxed);
+                if (msg->data.result == CURLE_OK && http_code > 0 && http_code < 500) {
+                    endpoint->healthy = true;
+                    endpoint->latency_ms = total_us / 1000.0;  // Замер заменяет сглаженное значение
+                } else {
+                    mark_failed(*endpoint);
+                }
+            }
+            for (CURL* easy : handles) {
+                curl_multi_remove_handle(multi, easy);
+                curl_easy_cleanup(easy);
+            }
+            curl_multi_cleanup(multi);
+        }
+
+        std::mutex mutex_;
+        std::vector<Endpoint> endpoints_;
+        std::string source_key_;
+        bool loaded_ = false;
+        bool probed_ = false;
+        Clock::time_point probed_at_{};
+    };
+
+    EndpointSet& endpoints();
+
+    // Длительность последних успешных загрузок списков пакетов; по её 95-му перцентилю
+    // выбирается момент отправки дублирующего запроса
+    class LatencyWindow {
+    public:
+        void add(double ms) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            samples_[next_++ % samples_.size()] = ms;
+            count_ = std::min(count_ + 1, samples_.size());
+        }
+
+        double p95() const {
+            // -1, пока замеров слишком мало для оценки
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (count_ < min_samples) {
+                return -1;
+            }
+            std::vector<double> sorted(samples_.begin(), samples_.begin() + count_);
+            auto nth = sorted.begin() + (count_ * 95) / 100;
+            std::nth_element(sorted.begin(), nth, sorted.end());
+            return *nth;
+        }
+
+    private:
+        static constexpr size_t min_samples = 8;
+        mutable std::mutex mutex_;
+        std::array<double, 64> samples_{};
+        size_t next_ = 0;
+        size_t count_ = 0;
+    };
+
+    LatencyWindow& package_latency();
+
+    bool is_cancelled(const rdbcompare_cancel* cancel) {
+        return cancel && (cancel->cancelled.load(std::memory_order_relaxed) || (cancel->poll && cancel->poll()));
+    }
+
+    struct TransferOutcome {
+        CURLcode res = CURLE_FAILED_INIT;
+        long http_code = 0;
+
+        // Ошибки, после которых имеет смысл другое зеркало или повтор
+        bool transient() const { return res != CURLE_OK || http_code >= 500; }
+    };
+
+    // Условный запрос: тег версии ответа, который уже есть у вызывающего, и тег нового
+    struct HttpTags {
+        std::string if_none_match;  // Отправляется в If-None-Match ("" - обычный запрос)
+        std::string etag;           // ETag принятого ответа ("" - сервер не прислал)
+    };
+
+    TransferOutcome run_transfer(const std::vector<std::string>& bases, size_t first, const std::string& path,
+                                 std::string& response, const rdbcompare_cancel* cancel, bool package_list,
+                                 HttpTags* tags = nullptr) {
+        // Одна попытка запроса к зеркалу bases[first]. С настройкой hedge загрузка списка
+        // пакетов, не завершившаяся за p95 прежних, дублируется на следующем зеркале;
+        // принимается первый ответ без ошибки, другая передача прерывается.
+        // С tags запрос условный: ответ 304 - не ошибка, тело у него пустое
+        struct Leg {
+            CURL* easy = nullptr;
+            curl_slist* headers = nullptr;
+            size_t base = 0;
+            std::string body;
+            std::string etag;
+            TransferOutcome outcome;
+        };
+        Leg legs[2];
+        size_t started = 0;
+        size_t active = 0;
+        Leg* winner = nullptr;
+        TransferOutcome result;
+
+        Config cfg = current_config();
+        CURLM* multi = cfg.reuse_connections ? connections().acquire() : curl_multi_init();
+        auto start_leg = [&](size_t base) {
+            Leg& leg = legs[started];
+            leg.easy = curl_easy_init();
+            if (!leg.easy) {
+                return false;
+            }
+            leg.base = base;
+            setup_transfer(leg.easy, bases[base] + path, &leg.body);
+            if (tags) {
+                curl_easy_setopt(leg.easy, CURLOPT_HEADERFUNCTION, header_callback);
+                curl_easy_setopt(leg.easy, CURLOPT_HEADERDATA, &leg.etag);
+                if (!tags->if_none_match.empty()) {
+                    leg.headers = curl_slist_append(nullptr, ("If-None-Match: " + tags->if_none_match).c_str());
+                    curl_easy_setopt(leg.easy, CURLOPT_HTTPHEADER, leg.headers);
+                }
+            }
+            curl_multi_add_handle(multi, leg.easy);
+            started++;
+            active++;
+            return true;
+        };
+        auto cleanup = [&] {
+            for (Leg& leg : legs) {
+                if (leg.easy) {
+                    // Тело принятого ответа к этому моменту уже перенесено в response
+                    count_transfer(leg.easy, &leg == winner ? response.size() : leg.body.size());
+                    curl_multi_remove_handle(multi, leg.easy);
+                    curl_easy_cleanup(leg.easy);
+                }
+                curl_slist_free_all(leg.headers);
+            }
+            if (cfg.reuse_connections && multi) {
+                connections().release(multi);
+            } else {
+                curl_multi_cleanup(multi);
+            }
+        };
+        if (!multi || !start_leg(first)) {
+            log_error("http.init") << "Failed to initialize curl";
+            cleanup();
+            return result;
+        }
+
+        double hedge_after = -1;
+        if (package_list && cfg.hedge) {
+            hedge_after = cfg.hedge_delay_ms > 0 ? cfg.hedge_delay_ms : package_latency().p95();
+        }
+        auto start_time = std::chrono::steady_clock::now();
+        auto elapsed_ms = [&] {
+            return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start_time).count();
+        };
+
+        while (!winner && active > 0) {
+            if (is_cancelled(cancel)) {
+                result.res = CURLE_ABORTED_BY_CALLBACK;
+                result.http_code = 0;
+                break;
+            }
+            int running = 0;
+            curl_multi_perform(multi, &running);
+
+            int queued = 0;
+            while (CURLMsg* msg = curl_multi_info_read(multi, &queued)) {
+                if (msg->msg != CURLMSG_DONE) {
+                    continue;
+                }
+                Leg& leg = msg->easy_handle == legs[0].easy ? legs[0] : legs[1];
+                curl_off_t first_byte_us = 0;
+                leg.outcome.res = msg->data.result;
+                curl_easy_getinfo(leg.easy, CURLINFO_RESPONSE_CODE, &leg.outcome.http_code);
+                curl_easy_getinfo(leg.easy, CURLINFO_STARTTRANSFER_TIME_T, &first_byte_us);
+                curl_multi_remove_handle(multi, leg.easy);
+                active--;
+                if (leg.outcome.res == CURLE_OPERATION_TIMEDOUT) {
+                    stats().request_timeouts.fetch_add(1, std::memory_order_relaxed);
+                }
+                endpoints().report(bases[leg.base], !leg.outcome.transient(), first_byte_us / 1000.0, leg.body.size());
+                if (!leg.outcome.transient() && !winner) {
+                    winner = &leg;
+                } else {
+                    result = leg.outcome;
+                }
+            }
+            if (winner || active == 0) {
+                break;
+            }
+
+            long wait_ms = 100;  // Не дольше, чтобы вовремя заметить отмену
+            if (hedge_after >= 0 && started == 1) {
+                double remaining = hedge_after - elapsed_ms();
+                if (remaining <= 0) {
+                    if (start_leg((first + 1) % bases.size())) {
+                        stats().hedged_requests.fetch_add(1, std::memory_order_relaxed);
+                    }
+                    continue;
+                }
+                wait_ms = std::min(wait_ms, static_cast<long>(remaining) + 1);
+            }
+            curl_multi_poll(multi, nullptr, 0, static_cast<int>(wait_ms), nullptr);
+        }
+
+        if (winner) {
+            result = winner->outcome;
+            response.swap(winner->body);
+            if (tags) {
+                tags->etag = winner->etag;
+            }
+            if (winner == &legs[1]) {
+                stats().hedge_wins.fetch_add(1, std::memory_order_relaxed);
+            }
+            if (package_list && result.http_code == 200) {
+                package_latency().add(elapsed_ms());
+            }
+        }
+        cleanup();
+        return result;
+    }
+
+    bool wait_backoff(long delay_ms, const rdbcompare_cancel* cancel) {
+        // Пауза перед повтором, прерываемая отменой; false, если запрос отменён
+        TraceSpan span("backoff", "fetch");
+        auto until = std::chrono::steady_clock::now() + std::chrono::milliseconds(delay_ms);
+        while (std::chrono::steady_clock::now() < until) {
+            if (is_cancelled(cancel)) {
+                return false;
+            }
+            std::this_thread::sleep_for(std::min<std::chrono::steady_clock::duration>(
+                std::chrono::milliseconds(50), until - std::chrono::steady_clock::now()));
+        }
+        return !is_cancelled(cancel);
+    }
+
+    long backoff_delay(long base_ms, long round) {
+        // base_ms * 2^round, не больше 30 с, со случайным отклонением до ±25%
+        thread_local std::minstd_rand random(static_cast<unsigned>(
+            std::chrono::steady_clock::now().time_since_epoch().count()));
+        double delay = std::min(static_cast<double>(base_ms) * (1L << std::min(round, 16L)), 30000.0);
+        return static_cast<long>(delay * std::uniform_real_distribution<double>(0.75, 1.25)(random));
+    }
+
+    bool perform_api_request(const std::string& path, std::string& response, long& http_code,
+                             const rdbcompare_cancel* cancel = nullptr, bool package_list = false,
+                             HttpTags* tags = nullptr) {
+        // Запрос к API через зеркала: при ошибке соединения или ответе 5xx пробуется
+        // следующее, а после неудачи на всех - повтор с паузой (retries раз).
+        // Возвращает true при ответе 200; http_code - код последней попытки
+        // (304 - у вызывающего актуальная версия, если запрос условный)
+        Config cfg = current_config();
+        std::vector<std::string> bases = endpoints().candidates();
+        for (long round = 0;; ++round) {
+            for (size_t attempt = 0; attempt < bases.size(); ++attempt) {
+                response.clear();
+                TransferOutcome outcome = run_transfer(bases, attempt, path, response, cancel, package_list, tags);
+                http_code = outcome.http_code;
+                if (is_cancelled(cancel)) {
+                    log_error("http.cancelled") << "Request cancelled";
+                    stats().requests_cancelled.fetch_add(1, std::memory_order_relaxed);
+                    return false;
+                }
+                if (!outcome.transient()) {
+                    return http_code == 200;
+                }
+
+                std::string reason = outcome.res != CURLE_OK ? curl_easy_strerror(outcome.res)
+                                                             : "HTTP " + std::to_string(http_code);
+                if (attempt + 1 < bases.size()) {
+                    log_warning("http.failover") << bases[attempt] << " failed (" << reason << "), trying " << bases[attempt + 1];
+                    stats().endpoint_failovers.fetch_add(1, std::memory_order_relaxed);
+                } else if (round < cfg.retries) {
+                    long delay = backoff_delay(cfg.retry_backoff_ms, round);
+                    log_warning("http.retry") << "Request failed (" << reason << "), retrying in " << delay << " ms";
+                    stats().request_retries.fetch_add(1, std::memory_order_relaxed);
+                    if (!wait_backoff(delay, cancel)) {
+                        log_error("http.cancelled") << "Request cancelled";
+                        stats().requests_cancelled.fetch_add(1, std::memory_order_relaxed);
+                        return false;
+                    }
+                } else {
+                    if (outcome.res != CURLE_OK) {
+                        log_error("http.failed") << "HTTP request failed: " << reason;
+                    }
+                    return false;
+                }
+            }
+        }
+    }
+
+    bool fetch_branch_tree(std::unordered_set<std::string>& names) {
+        // Запрашивает JSON со списком веток и заполняет множество имён
+        std::string response;
+        long http_code = 0;
+        if (!perform_api_request("/export/branch_tree", response, http_code)) {
+            log_error("branches.fetch") << "Failed to fetch branch list, HTTP code: " << http_code;
+            return false;
+        }
+
+        json_object* parsed_json = json_tokener_parse(response.c_str()); // Парсим JSON-объект
+        if (!parsed_json) {
+            log_error("branches.parse") << "Failed to parse branch list JSON";
+            return false;
+        }
+
+        // Используем std::unique_ptr для автоматической очистки json_object
+        auto cleanup_json = [](json_object* obj) { json_object_put(obj); };
+        std::unique_ptr<json_object, decltype(cleanup_json)> json_guard(parsed_json, cleanup_json);
+
+        json_object* branches; // Получаем список веток
+        if (!json_object_object_get_ex(parsed_json, "branches", &branches) || !json_object_is_type(branches, json_type_array)) {
+            log_error("branches.parse") << "Invalid branch list format";
+            return false;
+        }
+
+        for (size_t i = 0; i < json_object_array_length(branches); i++) {
+            const char* name = json_object_get_string(json_object_array_get_idx(branches, i));
+            if (name) {
+                names.emplace(name);
+            }
+        }
+        return !names.empty();
+    }
+
+    std::filesystem::path cache_directory(const Config& cfg) {
+        // Каталог для файлов кэша или пустой путь, если сохранять некуда
+        if (!cfg.cache_dir.empty()) {
+            return cfg.cache_dir;
+        }
+        if (const char* xdg = std::getenv("XDG_CACHE_HOME"); xdg && *xdg) {
+            return std::filesystem::path(xdg) / "rdbcompare";
+        }
+        if (const char* home = std::getenv("HOME"); home && *home) {
+            return std::filesystem::path(home) / ".cache" / "rdbcompare";
+        }
+        return {};
+    }
+
+    std::string temp_suffix() {
+        // Имя временного файла, уникальное для процесса и вызова: в кэш одного каталога
+        // могут одновременно писать другие процессы и контексты этого процесса
+        static std::atomic<uint64_t> counter{0};
+        return ".tmp." + std::to_string(getpid()) + "." + std::to_string(counter.fetch_add(1));
+    }
+
+    // Кэш имён веток из branch_tree: хэш-множество с временем жизни, которое
+    // сохраняется на диск и после неудачного запроса повторно запрашивается из сети.
+    class BranchCache {
+    public:
+        enum class Lookup { Known, Unknown, Unavailable };
+
+        Lookup lookup(const std::string& name) {
+            Config cfg = current_config();
+            std::unique_lock<std::mutex> lock(mutex_);
+            Clock::time_point now = Clock::now();
+            follow_api_base(cfg);
+
+            if (!fresh(now, cfg)) {
+                if (!loaded_ && cfg.persist_cache) {
+                    load_from_disk(cfg);
+                }
+                if (!fresh(now, cfg)) {
+                    refresh_from_network(lock, now, cfg);
+                }
+            }
+
+            if (names_.count(name)) {
+                return Lookup::Known;
+            }
+            // Ветка могла появиться после того, как список был получен: перепроверяем его по сети
+            if (!names_.empty() && now - network_at_ >= min_refresh_interval && refresh_from_network(lock, now, cfg)) {
+                if (names_.count(name)) {
+                    return Lookup::Known;
+                }
+            }
+            return names_.empty() ? Lookup::Unavailable : Lookup::Unknown;
+        }
+
+        Lookup lookup_cached(const std::string& name) {
+            // Проверка без сетевых запросов (для цикла событий): устаревший или
+            // отсутствующий список даёт Unavailable, и ветку проверит сам сервер.
+            // Запрос branch_tree идёт без блокировки, поэтому здесь его не ждём
+            Config cfg = current_config();
+            std::lock_guard<std::mutex> lock(mutex_);
+            follow_api_base(cfg);
+            if (!loaded_ && cfg.persist_cache) {
+                load_from_disk(cfg);
+            }
+            if (!fresh(Clock::now(), cfg)) {
+                return Lookup::Unavailable;
+            }
+            return names_.count(name) ? Lookup::Known : Lookup::Unknown;
+        }
+
+        void remember(const std::string& name) {
+            // Добавляет ветку, для которой сервер успешно вернул пакеты
+            Config cfg = current_config();
+            std::lock_guard<std::mutex> lock(mutex_);
+            follow_api_base(cfg);
+            names_.insert(name);
+        }
+
+    private:
+        using Clock = std::chrono::system_clock;
+        static constexpr std::chrono::seconds retry_delay{30};
+        static constexpr std::chrono::seconds min_refresh_interval{60};
+        static constexpr const char* file_header = "rdbcompare-branches 1";
+
+        void follow_api_base(const Config& cfg) {
+            // Список веток относится к одному серверу: при смене api_base он начинается заново
+            if (cfg.api_base == api_base_) {
+                return;
+            }
+            api_base_ = cfg.api_base;
+            names_.clear();
+            loaded_ = false;
+            loaded_at_ = network_at_ = retry_after_ = Clock::time_point{};
+        }
+
+        static std::string file_name(const Config& cfg) {
+            // Для сервера по умолчанию - "branches", для остальных к имени добавляется FNV-1a адреса
+            if (cfg.api_base == default_api_base) {
+                return "branches";
+            }
+            uint64_t hash = 14695981039346656037ull;
+            for (unsigned char c : cfg.api_base) {
+                hash = (hash ^ c) * 1099511628211ull;
+            }
+            char suffix[17];
+            std::snprintf(suffix, sizeof(suffix), "%016llx", static_cast<unsigned long long>(hash));
+            return std::string("branches-") + suffix;
+        }
+
+        bool fresh(Clock::time_point now, const Config& cfg) const {
+            return loaded_ && now - loaded_at_ < std::chrono::seconds(cfg.branch_cache_ttl);
+        }
+
+        bool refresh_from_network(std::unique_lock<std::mutex>& lock, Clock::time_point now, const Config& cfg) {
+            // Запрос branch_tree идёт без блокировки: она держится только на время замены
+            // списка, так что lookup_cached и другие загрузки не ждут сеть. Одновременно
+            // идёт один запрос, остальные вызовы дожидаются его результата
+            if (now < retry_after_) {
+                return false;
+            }
+            const uint64_t refreshes = refreshes_;
+            if (refreshing_) {
+                refreshed_.wait(lock, [this] { return !refreshing_; });
+                return refreshes_ != refreshes;
+            }
+            refreshing_ = true;
+            const std::string api_base = api_base_;
+            std::unordered_set<std::string> fetched;
+            lock.unlock();
+            const bool ok = fetch_branch_tree(fetched);
+            lock.lock();
+            refreshing_ = false;
+            refreshed_.notify_all();
+            if (api_base != api_base_) {
+                return false;  // Сервер сменился во время запроса: список относится к прежнему
+            }
+            if (!ok) {
+                // Продолжаем пользоваться прежним списком (если он был) и повторим запрос позже
+                retry_after_ = now + retry_delay;
+                return false;
+            }
+            names_.swap(fetched);
+            loaded_ = true;
+            loaded_at_ = network_at_ = now;
+            refreshes_++;
+            if (cfg.persist_cache) {
+                save_to_disk(cfg);
+            }
+            return true;
+        }
+
+        void load_from_disk(const Config& cfg) {
+            std::filesystem::path dir = cache_directory(cfg);
+            if (dir.empty()) {
+                return;
+            }
+            std::ifstream in(dir / file_name(cfg));
+            std::string header;
+            long long timestamp = 0;
+            if (!std::getline(in, header) || header != file_header || !(in >> timestamp)) {
+                return;
+            }
+            std::unordered_set<std::string> loaded;
+            std::string name;
+            while (in >> name) {
+                loaded.insert(name);
+            }
+            if (loaded.empty()) {
+                return;
+            }
+            names_.swap(loaded);
+            loaded_ = true;
+            loaded_at_ = Clock::time_point(std::chrono::seconds(timestamp));
+        }
+
+        void save_to_disk(const Config& cfg) const {
+            // Пишем во временный файл и переименовываем, чтобы параллельные процессы не видели половину списка
+            std::filesystem::path dir = cache_directory(cfg);
+            if (dir.empty()) {
+                return;
+            }
+            std::error_code ec;
+            std::filesystem::create_directories(dir, ec);
+            std::filesystem::path tmp = dir / (file_name(cfg) + temp_suffix());
+            {
+                std::ofstream out(tmp, std::ios::trunc);
+                out << file_header << '\n'
+                    << std::chrono::duration_cast<std::chrono::seconds>(loaded_at_.time_since_epoch()).count() << '\n';
+                for (const auto& name : names_) {
+                    out << name << '\n';
+                }
+                if (!out) {
+                    log_warning("branches.cache") << "Failed to write branch list cache to " << tmp.string();
+                    std::filesystem::remove(tmp, ec);
+                    return;
+                }
+            }
+            std::filesystem::rename(tmp, dir / file_name(cfg), ec);
+            if (ec) {
+                std::filesystem::remove(tmp, ec);
+            }
+        }
+
+        std::mutex mutex_;
+        std::condition_variable refreshed_;  // Завершён запрос branch_tree
+        bool refreshing_ = false;         // Запрос branch_tree идёт в одном из потоков
+        uint64_t refreshes_ = 0;          // Успешных запросов branch_tree
+        std::string api_base_;            // Сервер, к которому относится список
+        std::unordered_set<std::string> names_;
+        bool loaded_ = false;
+        Clock::time_point loaded_at_{};   // Когда был получен текущий список (из сети или файла)
+        Clock::time_point network_at_{};  // Последний успешный запрос branch_tree в этом процессе
+        Clock::time_point retry_after_{}; // До этого момента после ошибки сеть не опрашиваем
+    };
+
+    BranchCache& branch_cache();
+
+    bool is_valid_branch(const char* branch_name) {
+        // Проверяет, является ли имя ветки действительным, по кэшированному списку веток
+
+        if (!branch_name || !*branch_name) { // Проверяет корректность входного имени ветки
+            log_error("branch.invalid") << "Invalid branch name";
+            return false;
+        }
+
+        switch (branch_cache().lookup(branch_name)) {
+            case BranchCache::Lookup::Known:
+                return true;
+            case BranchCache::Lookup::Unavailable:
+                log_error("branches.empty") << "Кэш списка веток пуст. Не удалось получить ветки.";
+                return false;
+            case BranchCache::Lookup::Unknown:
+                break;
+        }
+
+        log_error("branch.not_found") << "Ветка '" << branch_name << "' не найдена в списке веток";
+        return false;
+    }
+    std::string query_escape(std::string_view value) {
+        // Значение параметра запроса: всё, кроме незарезервированных символов RFC 3986,
+        // кодируется как %XX, чтобы "&", "#", "?" или пробел в -a не меняли запрос
+        static const char hex[] = "0123456789ABCDEF";
+        std::string out;
+        out.reserve(value.size());
+        for (unsigned char c : value) {
+            if (std::isalnum(c) || c == '-' || c == '_' || c == '.' || c == '~') {
+                out += static_cast<char>(c);
+            } else {
+                out += '%';
+                out += hex[c >> 4];
+                out += hex[c & 0xf];
+            }
+        }
+        return out;
+    }
+
+    std::string make_package_path(const char* branch_name, const Filter* filter = nullptr) {
+        // Путь запроса пакетов ветки относительно адреса API. Сервер умеет отбирать одну
+        // архитектуру, поэтому фильтр из одной архитектуры передаётся ему и загружается меньше данных
+        std::string url = "/export/branch_binary_packages/" + std::string(branch_name);
+        if (filter && filter->arches.size() == 1 && current_config().arch_query) {
+            url += "?arch=" + query_escape(filter->arches.front());
+        }
+        return url;
+    }
+
+    // Разбор структуры JSON без построения дерева: только чтобы найти массив "packages"
+    // ответа и посчитать его элементы. Пакеты разбираются позже, при сравнении
+    class JsonScanner {
+    public:
+        explicit JsonScanner(std::string_view text) : text_(text) {}
+
+        // items - текст элементов массива без скобок
+        bool find_packages(std::string_view& items, size_t& count) {
+            skip_ws();
+            if (!consume('{')) {
+                return false;
+            }
+            while (true) {
+                skip_ws();
+                std::string_view key;
+                if (!skip_string(&key)) {
+                    return false;
+                }
+                skip_ws();
+                if (!consume(':')) {
+                    return false;
+                }
+                skip_ws();
+                if (key == "packages") {
+                    return scan_array(items, count);
+                }
+                if (!skip_value()) {
+                    return false;
+                }
+                skip_ws();
+                if (!consume(',')) {
+                    return false;  // '}' - объект кончился, а массива не было
+                }
+            }
+        }
+
+    private:
+        bool consume(char c) {
+            if (pos_ < text_.size() && text_[pos_] == c) {
+                ++pos_;
+                return true;
+            }
+            return false;
+        }
+
+        void skip_ws() {
+            while (pos_ < text_.size() && std::isspace(static_cast<unsigned char>(text_[pos_]))) {
+                ++pos_;
+            }
+        }
+
+        bool skip_string(std::string_view* contents = nullptr) {
+            if (!consume('"')) {
+                return false;
+            }
+            size_t start = pos_;
+            for (; pos_ < text_.size(); ++pos_) {
+                if (text_[pos_] == '\\') {
+                    ++pos_;
+                } else if (text_[pos_] == '"') {
+                    if (contents) {
+                        *contents = text_.substr(start, pos_ - start);
+                    }
+                    ++pos_;
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        bool skip_value() {
+            if (pos_ >= text_.size()) {
+                return false;
+            }
+            char c = text_[pos_];
+            if (c == '"') {
+                return skip_string();
+            }
+            if (c == '{' || c == '[') {
+                size_t depth = 0;
+                while (pos_ < text_.size()) {
+                    c = text_[pos_];
+                    if (c == '"') {
+                        if (!skip_string()) {
+                            return false;
+                        }
+                        continue;
+                    }
+                    ++pos_;
+                    if (c == '{' || c == '[') {
+                        ++depth;
+                    } else if ((c == '}' || c == ']') && --depth == 0) {
+                        return true;
+                    }
+                }
+                return false;
+            }
+            size_t start = pos_;  // Число, true, false, null
+            while (pos_ < text_.size() && !std::strchr(",]} \t\r\n", text_[pos_])) {
+                ++pos_;
+            }
+            return pos_ > start;
+        }
+
+        bool scan_array(std::string_view& items, size_t& count) {
+            if (!consume('[')) {
+                return false;
+            }
+            count = 0;
+            skip_ws();
+            size_t start = pos_;
+            if (consume(']')) {
+                items = {};
+                return true;
+            }
+            while (true) {
+                if (!skip_value()) {
+                    return false;
+                }
+                ++count;
+                size_t end = pos_;
+                skip_ws();
+                if (consume(']')) {
+                    items = text_.substr(start, end - start);
+                    return true;
+                }
+                if (!consume(',')) {
+                    return false;
+                }
+                skip_ws();
+            }
+        }
+
+        std::string_view text_;
+        size_t pos_ = 0;
+    };
+
+    std::vector<std::string> branch_shard_arches(const char* branch, const Filter* filter, const rdbcompare_cancel* cancel) {
+        // Архитектуры частей: из фильтра, из настройки shard_arches или от сервера.
+        // Пустой список - загрузить ветку одним запросом
+        if (filter && !filter->arches.empty()) {
+            return filter->arches;
+        }
+        if (std::vector<std::string> arches = split_list(current_config().shard_arches); !arches.empty()) {
+            return arches;
+        }
+        std::string response;
+        long http_code = 0;
+        if (!perform_api_request("/site/all_pkgset_archs?branch=" + std::string(branch), response, http_code, cancel)) {
+            return {};
+        }
+        std::vector<std::string> arches;
+        json_object* parsed = json_tokener_parse(response.c_str());
+        json_object* list = nullptr;
+        if (parsed && json_object_object_get_ex(parsed, "archs", &list) && json_object_is_type(list, json_type_array)) {
+            for (size_t i = 0; i < json_object_array_length(list); ++i) {
+                json_object* arch = nullptr;
+                if (json_object_object_get_ex(json_object_array_get_idx(list, i), "arch", &arch)) {
+                    std::string name = json_object_get_string(arch);
+                    if (!name.empty() && name != "srpm") {  // Исходные пакеты branch_binary_packages не отдаёт
+                        arches.push_back(name);
+                    }
+                }
+            }
+        }
+        json_object_put(parsed);
+        return arches;
+    }
+
+    enum class ShardedFetch { Done, Failed, Unavailable };
+
+    ShardedFetch fetch_branch_sharded(const char* branch, const Filter* filter, const rdbcompare_cancel* cancel,
+                                      std::string& response, long& http_code) {
+        // Ветка загружается запросами ?arch= по одному на архитектуру в shard_connections
+        // потоков (у каждого своё соединение). Часть проверяется сразу после загрузки, пока
+        // остальные ещё идут, а затем массивы склеиваются в один ответ того же вида.
+        // 404 для одной архитектуры - пустая часть; 404 для всех - ветки нет
+        std::vector<std::string> arches = branch_shard_arches(branch, filter, cancel);
+        if (arches.empty()) {
+            return is_cancelled(cancel) ? ShardedFetch::Failed : ShardedFetch::Unavailable;
+        }
+
+        struct Shard {
+            std::string body;
+            std::string_view items;
+            size_t count = 0;
+            long http_code = 0;
+            bool ok = false;
+        };
+        std::vector<Shard> shards(arches.size());
+        std::atomic<size_t> next{0};
+        std::atomic<bool> failed{false};
+
+        auto worker = [&] {
+            for (size_t i; !failed.load() && (i = next.fetch_add(1)) < shards.size();) {
+                Shard& shard = shards[i];
+                std::string path = "/export/branch_binary_packages/" + std::string(branch) + "?arch=" + query_escape(arches[i]);
+                if (perform_api_request(path, shard.body, shard.http_code, cancel, true)) {
+                    shard.ok = JsonScanner(shard.body).find_packages(shard.items, shard.count);
+                    if (!shard.ok) {
+                        log_error("fetch.shard") << "'packages' array not found in response for arch " << arches[i];
+                        failed = true;
+                    }
+                } else if (shard.http_code != 404) {
+                    failed = true;
+                }
+                stats().shards.fetch_add(1, std::memory_order_relaxed);
+            }
+        };
+        size_t threads = std::min<size_t>(shards.size(), std::max(1L, current_config().shard_connections));
+        std::vector<std::thread> pool;
+        for (size_t i = 1; i < threads; ++i) {
+            // Части загружаются в контексте вызова: его настройки, соединения и счётчики
+            pool.emplace_back([&worker, ctx = active_ctx] {
+                ContextScope scope(ctx);
+                worker();
+            });
+        }
+        worker();
+        for (std::thread& thread : pool) {
+            thread.join();
+        }
+
+        http_code = 404;
+        size_t total = 0;
+        size_t size = 0;
+        for (const Shard& shard : shards) {
+            if (shard.ok) {
+                http_code = 200;
+                total += shard.count;
+                size += shard.items.size() + 2;
+            } else if (shard.http_code != 404) {
+                http_code = shard.http_code;
+                return ShardedFetch::Failed;
+            }
+        }
+        if (http_code != 200) {
+            return ShardedFetch::Failed;
+        }
+
+        response.clear();
+        response.reserve(size + 64);
+        response += "{\"length\": " + std::to_string(total) + ", \"packages\": [";
+        bool first = true;
+        for (const Shard& shard : shards) {
+            if (shard.ok && !shard.items.empty()) {
+                if (!first) {
+                    response += ", ";
+                }
+                response += shard.items;
+                first = false;
+            }
+        }
+        response += "]}";
+        stats().sharded_fetches.fetch_add(1, std::memory_order_relaxed);
+        return ShardedFetch::Done;
+    }
+
+    // Итог загрузки списка пакетов ветки
+    struct FetchOutcome {
+        bool ok = false;
+        long http_code = 0;                       // 304 - версия if_none_match всё ещё актуальна
+        std::shared_ptr<const std::string> body;  // Тело ответа, общее для всех участников загрузки
+        std::string etag;                         // ETag ответа ("" - нет или загрузка частями)
+    };
+
+    FetchOutcome download_packages(const std::string& branch, const std::string& path, const Filter* filter,
+                                   const rdbcompare_cancel* cancel, const std::string& if_none_match = std::string()) {
+        // Список пакетов частями по архитектурам (sharded) или одним запросом. Склеенный из
+        // частей ответ тега не имеет, поэтому условным бывает только запрос целиком
+        FetchOutcome outcome;
+        auto response = std::make_shared<std::string>();
+        ShardedFetch sharded = ShardedFetch::Unavailable;
+        if (current_config().sharded && path.find('?') == std::string::npos) {
+            // Без списка архитектур - обычная загрузка одним запросом
+            sharded = fetch_branch_sharded(branch.c_str(), filter, cancel, *response, outcome.http_code);
+        }
+        if (sharded == ShardedFetch::Unavailable) {
+            HttpTags tags{if_none_match, std::string()};
+            outcome.ok = perform_api_request(path, *response, outcome.http_code, cancel, true, &tags);
+            outcome.etag = std::move(tags.etag);
+        } else {
+            outcome.ok = sharded == ShardedFetch::Done;
+        }
+        outcome.body = std::move(response);
+        return outcome;
+    }
+
+    // Объединение одновременных загрузок (single-flight): вызов, запросивший список пакетов,
+    // который уже загружается, не начинает свою передачу, а ждёт идущую и получает то же
+    // тело ответа (или ту же ошибку). Передача прерывается, только когда отменили все её
+    // участники; участник, отменивший свой запрос, перестаёт ждать сразу. Если у первого
+    // вызова есть флаг отмены, передача идёт в отдельном потоке, чтобы он мог выйти раньше
+    // остальных; без флага - в его собственном потоке
+    class FetchFlights {
+    public:
+        using Download = std::function<FetchOutcome(const rdbcompare_cancel*)>;
+
+        ~FetchFlights() {
+            // Контекст освобождается без активных вызовов, так что фоновые передачи
+            // видят, что их участников нет, и прерываются
+            std::unique_lock<std::mutex> lock(mutex_);
+            workers_done_.wait(lock, [this] { return workers_ == 0; });
+        }
+
+        FetchOutcome fetch(const std::string& key, const rdbcompare_cancel* cancel, Download download) {
+            std::shared_ptr<Flight> flight;
+            bool leader = false;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                std::shared_ptr<Flight>& slot = flights_[key];
+                if (!slot) {
+                    slot = std::make_shared<Flight>();
+                    leader = true;
+                }
+                flight = slot;
+                std::lock_guard<std::mutex> flight_lock(flight->mutex);
+                flight->participants.push_back(cancel);
+                if (leader && cancel) {
+                    workers_++;
+                }
+            }
+            if (!leader) {
+                stats().fetch_coalesced.fetch_add(1, std::memory_order_relaxed);
+                return wait(*flight, cancel);
+            }
+            stats().fetch_flights.fetch_add(1, std::memory_order_relaxed);
+            if (!cancel) {
+                run(key, flight, download);
+                return flight->outcome;
+            }
+            std::thread([this, key, flight, download = std::move(download), ctx = active_ctx] {
+                ContextScope scope(ctx);
+                run(key, flight, download);
+                std::lock_guard<std::mutex> lock(mutex_);
+                workers_--;
+                workers_done_.notify_all();
+            }).detach();
+            return wait(*flight, cancel);
+        }
+
+    private:
+        struct Flight {
+            std::mutex mutex;
+            std::condition_variable done_cv;
+            std::vector<const rdbcompare_cancel*> participants;  // Флаги отмены ждущих вызовов
+            bool done = false;
+            FetchOutcome outcome;
+
+            bool all_cancelled() {
+                std::lock_guard<std::mutex> lock(mutex);
+                return std::all_of(participants.begin(), participants.end(),
+                                   [](const rdbcompare_cancel* cancel) { return is_cancelled(cancel); });
+            }
+        };
+
+        void run(const std::string& key, const std::shared_ptr<Flight>& flight, const Download& download) {
+            rdbcompare_cancel group;
+            group.poll = [&flight] { return flight->all_cancelled(); };
+            FetchOutcome outcome = download(&group);
+            {
+                // Вызовы после этой точки начинают новую загрузку
+                std::lock_guard<std::mutex> lock(mutex_);
+                flights_.erase(key);
+            }
+            {
+                std::lock_guard<std::mutex> lock(flight->mutex);
+                flight->outcome = std::move(outcome);
+                flight->done = true;
+            }
+            flight->done_cv.notify_all();
+        }
+
+        static FetchOutcome wait(Flight& flight, const rdbcompare_cancel* cancel) {
+            TraceSpan span("fetch_wait", "fetch");  // Ожидание чужой загрузки
+            std::unique_lock<std::mutex> lock(flight.mutex);
+            while (!flight.done) {
+                if (is_cancelled(cancel)) {
+                    flight.participants.erase(std::find(flight.participants.begin(), flight.participants.end(), cancel));
+                    log_error("http.cancelled") << "Request cancelled";
+                    stats().requests_cancelled.fetch_add(1, std::memory_order_relaxed);
+                    return {};
+                }
+                flight.done_cv.wait_for(lock, std::chrono::milliseconds(50));
+            }
+            return flight.outcome;
+        }
+
+        std::mutex mutex_;
+        std::unordered_map<std::string, std::shared_ptr<Flight>> flights_;  // Идущие загрузки по ключу
+        std::condition_variable workers_done_;
+        size_t workers_ = 0;  // Загрузок в фоновых потоках
+    };
+
+    FetchFlights& fetch_flights();
+
+    FetchOutcome fetch_branch(const char* branch, const Filter* filter, const rdbcompare_cancel* cancel,
+                              const std::string& if_none_match = std::string()) {
+        // Проверка имени ветки, загрузка её списка пакетов (с объединением одновременных
+        // загрузок) и сообщение об ошибке. С if_none_match ответ 304 ошибкой не считается
+        TraceSpan span("fetch_branch", "fetch");
+        if (span.active() && branch) {
+            span.arg("branch", branch);
+        }
+        bool validate = current_config().validate_branches;
+        if (validate) {
+            if (!is_valid_branch(branch)) {
+                return {};
+            }
+        } else if (!branch || !*branch) {
+            log_error("branch.invalid") << "Invalid branch name";
+            return {};
+        }
+
+        std::string path = make_package_path(branch, filter);
+        const Config cfg = current_config();
+        FetchOutcome outcome;
+        if (cfg.coalesce_fetches) {
+            // Ключ - всё, от чего зависит ответ: сервер, путь, тег условного запроса и,
+            // при загрузке частями, архитектуры фильтра
+            std::string key = cfg.api_base + '\n' + cfg.endpoints + '\n' + path;
+            if (cfg.sharded) {
+                key += "\nsharded " + cfg.shard_arches;
+                for (const std::string& arch : filter ? filter->arches : std::vector<std::string>()) {
+                    key += ' ' + arch;
+                }
+            }
+            if (!if_none_match.empty()) {
+                key += "\nif-none-match " + if_none_match;
+            }
+            Filter copy = filter ? *filter : Filter();
+            outcome = fetch_flights().fetch(key, cancel,
+                [branch = std::string(branch), path, copy, if_none_match](const rdbcompare_cancel* group) {
+                    return download_packages(branch, path, &copy, group, if_none_match);
+                });
+        } else {
+            outcome = download_packages(branch, path, filter, cancel, if_none_match);
+        }
+        const long http_code = outcome.http_code;
+        if (!outcome.ok && !(http_code == 304 && !if_none_match.empty())) {
+            if (is_cancelled(cancel)) {
+                return outcome;
+            }
+            if (!validate && http_code == 404) {
+                // Без предварительной проверки о неизвестной ветке сообщает сам сервер
+                log_error("branch.not_found") << "Ветка '" << branch << "' не найдена (HTTP 404)";
+            } else {
+                log_error("fetch.failed") << "Failed to fetch packages for '" << branch << "', HTTP code: " << http_code;
+            }
+            return outcome;
+        }
+
+        branch_cache().remember(branch);
+        return outcome;
+    }
+
+    char* allocate_result(const std::string& data) {
+        // Выделяет память для результата 
+        char* result = strdup(data.c_str());
+        if (!result) {
+            log_error("memory") << "Failed to allocate memory for result";
+        }
+        return result;
+    }
+
+
+    // Возвращает: >0 если первая EVR новее, <0 если вторая, 0 если равны.
+    // Строки версии и релиза должны завершаться нулём
+    int compare_evr(const char* epoch1_text, const char* version1, const char* release1,
+                    const char* epoch2_text, const char* version2, const char* release2) {
+        long epoch1 = std::atol(epoch1_text);
+        long epoch2 = std::atol(epoch2_text);
+
+        if (epoch1 != epoch2) {
+            return epoch1 - epoch2;
+        }
+
+        int ver_cmp_result = rpmvercmp(version1, version2);
+
+        if (ver_cmp_result != 0) {
+            return ver_cmp_result;
+        }
+
+        int rel_cmp_result = rpmvercmp(release1, release2);
+
+        return rel_cmp_result;
+    }
+
+    // Возвращает: >0 если pkg1 новее, <0 если pkg2 новее, 0 если равны.
+    int compare_versions(const Package& pkg1, const Package& pkg2) {
+        return compare_evr(pkg1.evr->epoch.data(), pkg1.evr->version.data(), pkg1.evr->release.data(),
+                           pkg2.evr->epoch.data(), pkg2.evr->version.data(), pkg2.evr->release.data());
+    }
+
+    // Порядок выбора представителя среди сборок одного имени: старшая EVR, при равенстве
+    // по rpmvercmp ("1.0" и "1.00") - большая по тексту. Порядок полный, поэтому
+    // представитель не зависит от порядка записей во входных данных
+    bool evr_preferred(const Evr* a, const Evr* b) {
+        int cmp = compare_evr(a->epoch.data(), a->version.data(), a->release.data(),
+                              b->epoch.data(), b->version.data(), b->release.data());
+        if (cmp != 0) {
+            return cmp > 0;
+        }
+        return std::tie(a->epoch, a->version, a->release) > std::tie(b->epoch, b->version, b->release);
+    }
+
+    void Snapshot::add(NamePackages& arch_packages, const Package& pkg) {
+        auto inserted = arch_packages.try_emplace(pkg.name, pkg);
+        if (inserted.second) {
+            return;
+        }
+        // Имя уже встречалось в архитектуре: запоминаем все его EVR по убыванию
+        Package& current = inserted.first->second;
+        duplicates++;
+        auto& evrs = builds[{pkg.arch, pkg.name_id}];
+        if (evrs.empty()) {
+            evrs.push_back(current.evr);
+        }
+        if (std::find(evrs.begin(), evrs.end(), pkg.evr) == evrs.end()) {
+            evrs.insert(std::upper_bound(evrs.begin(), evrs.end(), pkg.evr, evr_preferred), pkg.evr);
+        }
+        current.evr = evrs.front();
+    }
+
+    void compute_fingerprints(Snapshot& snapshot) {
+        // Отпечаток архитектуры - сумма хэшей пар (имя, EVR) её пакетов: от порядка
+        // записей не зависит, а хэш каждой EVR считается один раз на снимок
+        std::vector<uint64_t> evr_hashes(snapshot.pool->evrs().size());
+        for (const auto& arch : snapshot.packages) {
+            uint64_t sum = 0;
+            for (const auto& pair : arch.second) {
+                const Evr& evr = *pair.second.evr;
+                uint64_t& evr_hash = evr_hashes[evr.id];
+                if (evr_hash == 0) {
+                    evr_hash = mix64(hash_bytes(evr.epoch.data(), evr.epoch.size()) ^ hash_secret[1],
+                                     mix64(hash_bytes(evr.version.data(), evr.version.size()) ^ hash_secret[2],
+                                           hash_bytes(evr.release.data(), evr.release.size()) ^ hash_secret[3])) | 1;
+                }
+                sum += mix64(hash_bytes(pair.first.data(), pair.first.size()) ^ hash_secret[0], evr_hash);
+            }
+            snapshot.fingerprints.emplace(arch.first, sum);
+        }
+    }
+
+
+    std::unique_ptr<Snapshot> parse_packages_json(const char* json_data, const Filter* filter = nullptr,
+                                                  std::shared_ptr<StringPool> pool = nullptr) {
+        // nullptr - ошибка разбора; снимок, ставший пустым после фильтра, ошибкой не считается.
+        // pool - пул строк, общий с другим снимком (по умолчанию - собственный)
+        if (!json_data) {
+            log_error("parse.null") << "Input JSON data is null.";
+            return nullptr;
+        }
+        RDBCOMPARE_PROBE(parse_start, json_data);
+        TraceSpan span("parse", "parse");
+        if (span.active()) {
+            span.arg("bytes", std::strlen(json_data));
+        }
+
+        json_object* parsed_json = nullptr;
+        {
+            TraceSpan tokenize("tokenize", "parse");
+            parsed_json = json_tokener_parse(json_data);
+        }
+        if (!parsed_json) {
+            log_error("parse.json") << "Failed to parse package list JSON. Invalid JSON format.";
+            return nullptr;
+        }
+
+        
+        auto cleanup_json = [](json_object* obj) { json_object_put(obj); };
+        std::unique_ptr<json_object, decltype(cleanup_json)> json_guard(parsed_json, cleanup_json);
+
+        json_object* packages_array;
+        
+        if (!json_object_object_get_ex(parsed_json, "packages", &packages_array) || !json_object_is_type(packages_array, json_type_array)) {
+            log_error("parse.json") << "'packages' array not found or is not an array in JSON response.";
+            return nullptr;
+        }
+
+        auto snapshot = std::make_unique<Snapshot>(std::move(pool));
+        StringPool& strings = *snapshot->pool;
+        // Текст поля без копирования (в пул попадают только новые строки); целые (эпоха)
+        // форматируются в buffer: json_object_get_string выделял бы для каждого буфер в куче.
+        // Отсутствующее значение (null) даёт fallback
+        auto text = [](json_object* obj, char (&buffer)[24], std::string_view fallback) -> std::string_view {
+            if (json_object_is_type(obj, json_type_string)) {
+                return {json_object_get_string(obj), static_cast<size_t>(json_object_get_string_len(obj))};
+            }
+            if (json_object_is_type(obj, json_type_int)) {
+                int length = std::snprintf(buffer, sizeof(buffer), "%lld", static_cast<long long>(json_object_get_int64(obj)));
+                return {buffer, static_cast<size_t>(length)};
+            }
+            const char* value = json_object_get_string(obj);
+            return value ? std::string_view(value) : fallback;
+        };
+        char epoch_buffer[24], version_buffer[24], release_buffer[24];
+
+        // Пропущенные записи сводятся в одно сообщение на причину после цикла: битый ответ
+        // не порождает по строке журнала на каждую запись
+        struct Skipped {
+            size_t count = 0;
+            size_t first = 0;  // Индекс первой пропущенной записи
+
+            void add(size_t index) {
+                if (count++ == 0) {
+                    first = index;
+                }
+            }
+
+            void report(const char* kind, const char* reason) const {
+                if (count > 0) {
+                    log_warning(kind) << reason << ": " << count << (count == 1 ? " package" : " packages")
+                                      << " skipped (first at index " << first << ")";
+                }
+            }
+        } null_objects, null_names, missing_fields;
+
+        TraceSpan index("index", "parse");
+        const size_t records = json_object_array_length(packages_array);
+        if (index.active()) {
+            index.arg("records", records);
+        }
+        for (size_t i = 0; i < records; ++i) {
+            json_object* pkg_obj = json_object_array_get_idx(packages_array, i);
+            if (!pkg_obj) {
+                null_objects.add(i);
+                continue;
+            }
+
+            // Временные указатели для извлечения значений
+            json_object *name_obj, *epoch_obj, *version_obj, *release_obj, *arch_obj;
+
+            if (json_object_object_get_ex(pkg_obj, "name", &name_obj) &&
+                json_object_object_get_ex(pkg_obj, "epoch", &epoch_obj) &&
+                json_object_object_get_ex(pkg_obj, "version", &version_obj) &&
+                json_object_object_get_ex(pkg_obj, "release", &release_obj) &&
+                json_object_object_get_ex(pkg_obj, "arch", &arch_obj))
+            {
+                const char* arch = json_object_get_string(arch_obj);
+                const char* name = json_object_get_string(name_obj);
+                if (!arch || !name) {
+                    null_names.add(i);
+                    continue;
+                }
+                if (filter && (!filter->accepts_arch(arch) || !filter->accepts_name(name))) {
+                    continue;
+                }
+
+                auto arch_it = snapshot->packages.find(std::string_view(arch));
+                if (arch_it == snapshot->packages.end()) {
+                    arch_it = snapshot->packages.emplace(strings.str(strings.intern(arch)), NamePackages(&snapshot->arena)).first;
+                }
+
+                Package pkg;
+                pkg.name_id = strings.intern(name);
+                pkg.name = strings.str(pkg.name_id);
+                pkg.arch = arch_it->first;
+                pkg.evr = strings.intern_evr(text(epoch_obj, epoch_buffer, "0"),
+                                             text(version_obj, version_buffer, ""),
+                                             text(release_obj, release_buffer, ""));
+
+                snapshot->add(arch_it->second, pkg);
+            } else {
+                missing_fields.add(i);
+            }
+        }
+
+        index.end();
+        null_objects.report("parse.null_object", "Null package object in array");
+        null_names.report("parse.null_field", "Null name or arch");
+        missing_fields.report("parse.missing_fields", "Missing one or more required fields (name, epoch, version, release, arch)");
+        stats().duplicate_builds.fetch_add(snapshot->duplicates, std::memory_order_relaxed);
+        {
+            TraceSpan fingerprints("fingerprints", "parse");
+            compute_fingerprints(*snapshot);
+        }
+        RDBCOMPARE_PROBE(parse_done, records, snapshot->package_count());
+        if (span.active()) {
+            span.arg("packages", snapshot->package_count());
+        }
+        return snapshot;
+    }
+    // Общий для всех сравнений словарь рангов EVR: различные EVR, упорядоченные по
+    // compare_evr, так что "новее" - это сравнение двух целых. EVR, равные для
+    // rpmvercmp ("1.0" и "1.00"), получают один ранг. Таблица неизменяема: новые
+    // EVR добавляются построением расширенной копии, а сравнения, уже получившие
+    // ранги, продолжают работать со своей версией. Объём словаря ограничен
+    // evr_rank_bytes: если новые EVR в него не помещаются, словарь начинается заново
+    class EvrRankDictionary {
+        struct Table;
+
+    public:
+        // Ранги EVR одного сравнения. Ранг ищется в словаре при первом обращении к EVR,
+        // поэтому затрагиваются только действительно сравниваемые EVR. У EVR, которых в
+        // словаре нет, ранга нет - их сравнивает rpmvercmp, а add_missing добавляет их
+        // в словарь одним расширением для следующих сравнений. Словарь устроен по тексту
+        // EVR, поэтому ветки могут быть разобраны и в разные пулы (снимки из кэша)
+        class Lookup {
+        public:
+            Lookup(EvrRankDictionary& dictionary, const StringPool& pool1, const StringPool& pool2, size_t limit)
+                : dictionary_(dictionary), table_(dictionary.current()), limit_(limit), shared_(&pool1 == &pool2) {
+                ranks_[0].assign(pool1.evrs().size(), unknown);
+                if (!shared_) {
+                    ranks_[1].assign(pool2.evrs().size(), unknown);
+                }
+            }
+
+            // branch - 0 для EVR первой ветки, 1 - второй.
+            // false - ранга нет, EVR сравнивается compare_versions
+            bool rank(const Evr& evr, int branch, uint32_t& out) {
+                uint32_t& cached = ranks_[shared_ ? 0 : branch][evr.id];
+                if (cached == unknown) {
+                    make_key(evr, key_);
+                    auto found = table_->index.find(key_);
+                    if (found != table_->index.end()) {
+                        cached = table_->ranks[found->second];
+                        hits_++;
+                    } else {
+                        cached = missing;
+                        missing_.push_back(key_);
+                    }
+                }
+                out = cached;
+                return cached != missing;
+            }
+
+            void add_missing() {
+                stats().evr_rank_hits.fetch_add(hits_, std::memory_order_relaxed);
+                hits_ = 0;
+                if (!missing_.empty()) {
+                    dictionary_.extend(std::move(missing_), limit_);
+                    missing_.clear();
+                }
+            }
+
+        private:
+            static constexpr uint32_t unknown = UINT32_MAX, missing = UINT32_MAX - 1;
+
+            EvrRankDictionary& dictionary_;
+            std::shared_ptr<const Table> table_;
+            size_t limit_;
+            bool shared_;                     // Ветки в одном пуле: ранги в ranks_[0]
+            std::vector<uint32_t> ranks_[2];  // По id EVR пула каждой ветки
+            std::vector<std::string> missing_;
+            std::string key_;
+            uint64_t hits_ = 0;
+        };
+
+    private:
+        // Ключ EVR - "эпоха\0версия\0релиз": части сразу годятся для rpmvercmp
+        struct Entry {
+            std::shared_ptr<const std::string> key;
+            const char* version;
+            const char* release;
+        };
+
+        struct Table {
+            std::vector<Entry> sorted;                          // По возрастанию EVR
+            std::vector<uint32_t> ranks;                        // Ранг каждой позиции sorted
+            std::unordered_map<std::string_view, size_t> index; // Ключ -> позиция в sorted
+            size_t bytes = 0;                                   // Оценка занятой памяти
+        };
+
+        static void make_key(const Evr& evr, std::string& key) {
+            key.assign(evr.epoch);
+            key.push_back('\0');
+            key.append(evr.version);
+            key.push_back('\0');
+            key.append(evr.release);
+        }
+
+        static Entry make_entry(std::string key) {
+            auto stored = std::make_shared<const std::string>(std::move(key));
+            const char* version = stored->c_str() + std::strlen(stored->c_str()) + 1;
+            const char* release = version + std::strlen(version) + 1;
+            return {stored, version, release};
+        }
+
+        // Память записи: ключ со строкой и блоком shared_ptr, ранг и узел индекса (оценка)
+        static size_t entry_bytes(const Entry& entry) {
+            return entry.key->size() + sizeof(Entry) + sizeof(uint32_t) + sizeof(std::string) + 64;
+        }
+
+        static int compare(const Entry& a, const Entry& b) {
+            return compare_evr(a.key->c_str(), a.version, a.release, b.key->c_str(), b.version, b.release);
+        }
+
+        std::shared_ptr<const Table> current() {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!table_) {
+                table_ = std::make_shared<const Table>();
+            }
+            return table_;
+        }
+
+        void extend(std::vector<std::string> missing, size_t limit) {
+            // Новые EVR сортируются и вставляются в копию таблицы двоичным поиском, так что
+            // rpmvercmp вызывается O(k log n) раз; ранги прежних соседних записей сравниваются
+            // как целые
+            std::lock_guard<std::mutex> lock(mutex_);
+            std::vector<Entry> added;
+            size_t added_bytes = 0;
+            for (std::string& key : missing) {
+                if (!table_->index.count(key)) {
+                    added.push_back(make_entry(std::move(key)));
+                }
+            }
+            auto less = [](const Entry& a, const Entry& b) { return compare(a, b) < 0; };
+            std::sort(added.begin(), added.end(), less);
+            added.erase(std::unique(added.begin(), added.end(),
+                                    [](const Entry& a, const Entry& b) { return *a.key == *b.key; }),
+                        added.end());
+            if (added.empty()) {
+                return;  // Всё уже добавлено другим потоком
+            }
+            for (const Entry& entry : added) {
+                added_bytes += entry_bytes(entry);
+            }
+            if (added_bytes > limit) {
+                return;  // Не помещаются и в пустой словарь: сравниваются rpmvercmp
+            }
+
+            static const Table empty;
+            const bool reset = table_->bytes + added_bytes > limit;
+            const Table& old = reset ? empty : *table_;
+            if (reset) {
+                stats().evr_rank_resets.fetch_add(1, std::memory_order_relaxed);
+            }
+
+            // Записи новой таблицы с прежними рангами (fresh - новая запись)
+            constexpr uint32_t fresh = UINT32_MAX;
+            const size_t total = old.sorted.size() + added.size();
+            auto next = std::make_shared<Table>();
+            std::vector<uint32_t> old_ranks;
+            next->sorted.reserve(total);
+            old_ranks.reserve(total);
+            auto pos = old.sorted.begin();
+            auto copy_old = [&](std::vector<Entry>::const_iterator until) {
+                for (; pos != until; ++pos) {
+                    next->sorted.push_back(*pos);
+                    old_ranks.push_back(old.ranks[pos - old.sorted.begin()]);
+                }
+            };
+            for (Entry& entry : added) {
+                copy_old(std::upper_bound(pos, old.sorted.end(), entry, less));
+                next->sorted.push_back(std::move(entry));
+                old_ranks.push_back(fresh);
+            }
+            copy_old(old.sorted.end());
+
+            next->ranks.resize(total);
+            next->index.reserve(total);
+            next->bytes = old.bytes + added_bytes;
+            uint32_t rank = 0;
+            for (size_t i = 0; i < total; ++i) {
+                if (i > 0) {
+                    const bool both_old = old_ranks[i - 1] != fresh && old_ranks[i] != fresh;
+                    if (both_old ? old_ranks[i - 1] != old_ranks[i] : compare(next->sorted[i - 1], next->sorted[i]) != 0) {
+                        rank++;
+                    }
+                }
+                next->ranks[i] = rank;
+                next->index.emplace(*next->sorted[i].key, i);
+            }
+
+            stats().evr_rank_added.fetch_add(added.size(), std::memory_order_relaxed);
+            stats().evr_rank_rebuilds.fetch_add(1, std::memory_order_relaxed);
+            table_ = std::move(next);
+        }
+
+        std::mutex mutex_;
+        std::shared_ptr<const Table> table_;
+    };
+
+    EvrRankDictionary& evr_ranks();
+
+    const char* const category_names[RDBCOMPARE_CATEGORY_COUNT] = {"branch1_only", "branch2_only", "branch1_newer",
+                                                                   "branch2_newer", "identical", "epoch_only"};
+
+    // Запись результата: пакет первой и/или второй ветки (отсутствующий - nullptr)
+    struct ResultEntry {
+        const Package* pkg1;
+        const Package* pkg2;
+    };
+
+    // Готовый JSON архитектуры из прежнего сравнения (значение после ключа) и его счётчики
+    struct ArchFragment {
+        std::string json;
+        size_t counts[RDBCOMPARE_CATEGORY_COUNT] = {};
+    };
+
+    // Различия одной архитектуры по категориям (индекс - RDBCOMPARE_*)
+    struct ArchResult {
+        explicit ArchResult(std::string_view name, std::pmr::memory_resource* arena)
+            : arch(name), entries(RDBCOMPARE_CATEGORY_COUNT, arena) {}
+
+        std::string arch;
+        std::pmr::vector<std::pmr::vector<ResultEntry>> entries;  // По категориям; пусто в режиме counts_only
+        size_t counts[RDBCOMPARE_CATEGORY_COUNT] = {};
+        uint64_t fingerprint1 = 0, fingerprint2 = 0;    // Отпечатки архитектуры в ветках
+        std::shared_ptr<const ArchFragment> fragment;   // Если задан, записей нет: JSON взят готовым
+    };
+
+    bool category_selected(unsigned categories, int category) {
+        return (categories & RDBCOMPARE_CATEGORY_BIT(category)) != 0;
+    }
+
+    // Версии и релизы равны, эпохи - нет. Вызывается только для различающихся EVR
+    bool differs_only_in_epoch(const Package& pkg1, const Package& pkg2) {
+        return std::atol(pkg1.evr->epoch.data()) != std::atol(pkg2.evr->epoch.data()) &&
+               rpmvercmp(pkg1.evr->version.data(), pkg2.evr->version.data()) == 0 &&
+               rpmvercmp(pkg1.evr->release.data(), pkg2.evr->release.data()) == 0;
+    }
+
+    // Получатель записей сравнения по мере их нахождения
+    class ResultSink {
+    public:
+        virtual ~ResultSink() = default;
+        // Начало архитектуры с отпечатками обеих веток. false - получатель уже взял готовый
+        // результат архитектуры из прежнего сравнения, и сравнивать её не нужно
+        virtual bool begin_arch(std::string_view arch, uint64_t fingerprint1, uint64_t fingerprint2) = 0;
+        virtual void add(int category, const Package* pkg1, const Package* pkg2) = 0;
+        virtual void end_arch() {}
+        virtual bool stopped() const { return false; } // Получатель больше не принимает записи
+    };
+
+    // Ищет в упорядоченном по имени словаре other пакет с именем pkg, сдвигая позицию
+    // встречного прохода вперёд. При общем пуле сначала сравниваются id имён
+    NamePackages::const_iterator match_name(const Package& pkg, NamePackages::const_iterator& pos,
+                                            NamePackages::const_iterator end, bool shared_ids) {
+        if (pos != end && shared_ids && pos->second.name_id == pkg.name_id) {
+            return pos;
+        }
+        while (pos != end && pos->first < pkg.name) {
+            ++pos;
+        }
+        if (pos != end && (shared_ids ? pos->second.name_id == pkg.name_id : pos->first == pkg.name)) {
+            return pos;
+        }
+        return end;
+    }
+
+    void compare_arch_packages(const Snapshot& branch1, const Snapshot& branch2, ResultSink& sink,
+                               unsigned categories = RDBCOMPARE_DEFAULT_CATEGORIES) {
+        // Сравнивает пакеты по архитектурам; записи каждой категории идут в порядке имён.
+        // Словари обеих веток упорядочены по имени, поэтому совпадения находятся
+        // встречным проходом, а равные EVR из общего пула - сравнением указателей.
+        // Пакет из обеих веток получает одну категорию по знаку сравнения EVR.
+        // Получатель видит только категории из categories; проход, не дающий ни одной
+        // из них, пропускается целиком
+        const ArchPackages& branch1_pkgs = branch1.packages;
+        const ArchPackages& branch2_pkgs = branch2.packages;
+        const bool shared_ids = branch1.pool == branch2.pool;
+        // Ранги из общего словаря: "новее" - сравнение целых вместо rpmvercmp. Работают и для
+        // веток из разных пулов (снимки rdbcompare_compare_branches), где нет общих id
+        std::optional<EvrRankDictionary::Lookup> ranks;
+        {
+            const Config cfg = current_config();
+            if (cfg.evr_ranks && cfg.evr_rank_bytes > 0) {
+                ranks.emplace(evr_ranks(), *branch1.pool, *branch2.pool, static_cast<size_t>(cfg.evr_rank_bytes));
+            }
+        }
+        auto order = [&ranks](const Package& pkg1, const Package& pkg2) {
+            if (pkg1.evr == pkg2.evr) {
+                return 0;
+            }
+            uint32_t rank1 = 0, rank2 = 0;
+            const bool ranked1 = ranks && ranks->rank(*pkg1.evr, 0, rank1);
+            const bool ranked2 = ranks && ranks->rank(*pkg2.evr, 1, rank2);
+            if (!ranked1 || !ranked2) {
+                return compare_versions(pkg1, pkg2);
+            }
+            return rank1 == rank2 ? 0 : (rank1 > rank2 ? 1 : -1);
+        };
+        const bool want_branch1_only = category_selected(categories, RDBCOMPARE_BRANCH1_ONLY);
+        const bool want_branch1_newer = category_selected(categories, RDBCOMPARE_BRANCH1_NEWER);
+        const bool want_branch2_only = category_selected(categories, RDBCOMPARE_BRANCH2_ONLY);
+        const bool want_branch2_newer = category_selected(categories, RDBCOMPARE_BRANCH2_NEWER);
+        const bool want_identical = category_selected(categories, RDBCOMPARE_IDENTICAL);
+        const bool want_epoch_only = category_selected(categories, RDBCOMPARE_EPOCH_ONLY);
+        const bool want_shared = want_branch1_newer || want_branch2_newer || want_identical || want_epoch_only;
+        std::set<std::string_view> all_architectures;
+
+        for (const auto& pair : branch1_pkgs) {
+            all_architectures.insert(pair.first);
+        }
+
+        for (const auto& pair : branch2_pkgs) {
+            all_architectures.insert(pair.first);
+        }
+
+        const NamePackages no_packages;
+        for (std::string_view arch : all_architectures) {
+            if (sink.stopped()) {
+                break;
+            }
+            TraceSpan span("compare_arch", "compare");
+            if (span.active()) {
+                span.arg("arch", arch);
+            }
+            if (!sink.begin_arch(arch, branch1.fingerprint(arch), branch2.fingerprint(arch))) {
+                continue;
+            }
+
+            auto it1 = branch1_pkgs.find(arch);
+            auto it2 = branch2_pkgs.find(arch);
+            const auto& pkgs1_in_arch = it1 != branch1_pkgs.end() ? it1->second : no_packages;
+            const auto& pkgs2_in_arch = it2 != branch2_pkgs.end() ? it2->second : no_packages;
+            // Имя архитектуры - не строка C: передаётся адрес и длина
+            RDBCOMPARE_PROBE(compare_arch_start, arch.data(), arch.size(), pkgs1_in_arch.size(), pkgs2_in_arch.size());
+
+            auto pos2 = pkgs2_in_arch.begin();
+            for (const auto& pair1 : pkgs1_in_arch) {
+                if (!want_branch1_only && !want_shared) {
+                    break;
+                }
+                const Package& pkg1 = pair1.second;
+                auto found = match_name(pkg1, pos2, pkgs2_in_arch.end(), shared_ids);
+
+                if (found != pkgs2_in_arch.end()) {
+                    if (!want_shared) {
+                        continue;
+                    }
+                    const Package& pkg2 = found->second;
+                    const int cmp = order(pkg1, pkg2);
+                    if (cmp == 0) {
+                        if (want_identical) {
+                            sink.add(RDBCOMPARE_IDENTICAL, &pkg1, &pkg2);
+                        }
+                    } else if (want_epoch_only && differs_only_in_epoch(pkg1, pkg2)) {
+                        sink.add(RDBCOMPARE_EPOCH_ONLY, &pkg1, &pkg2);
+                    } else if (cmp > 0) {
+                        if (want_branch1_newer) {
+                            sink.add(RDBCOMPARE_BRANCH1_NEWER, &pkg1, &pkg2);
+                        }
+                    } else if (want_branch2_newer) {
+                        sink.add(RDBCOMPARE_BRANCH2_NEWER, &pkg1, &pkg2);
+                    }
+                } else if (want_branch1_only) {
+                    sink.add(RDBCOMPARE_BRANCH1_ONLY, &pkg1, nullptr);
+                }
+            }
+
+            auto pos1 = pkgs1_in_arch.begin();
+            for (const auto& pair2 : pkgs2_in_arch) {
+                if (!want_branch2_only) {
+                    break;
+                }
+                if (match_name(pair2.second, pos1, pkgs1_in_arch.end(), shared_ids) == pkgs1_in_arch.end()) {
+                    sink.add(RDBCOMPARE_BRANCH2_ONLY, nullptr, &pair2.second);
+                }
+            }
+
+            sink.end_arch();
+            RDBCOMPARE_PROBE(compare_arch_done, arch.data(), arch.size());
+        }
+        if (ranks) {
+            ranks->add_missing();
+        }
+    }
+
+    void compare_identical(const Snapshot& branch, ResultSink& sink, unsigned categories) {
+        // Обе ветки заданы одними и теми же данными: различий нет, и каждый пакет попадает
+        // в identical. Архитектуры идут в том же порядке, что и у compare_arch_packages
+        const bool want_identical = category_selected(categories, RDBCOMPARE_IDENTICAL);
+        for (const auto& arch : branch.packages) {
+            if (sink.stopped()) {
+                return;
+            }
+            TraceSpan span("compare_arch", "compare");
+            if (span.active()) {
+                span.arg("arch", arch.first);
+            }
+            const uint64_t fingerprint = branch.fingerprint(arch.first);
+            if (!sink.begin_arch(arch.first, fingerprint, fingerprint)) {
+                continue;
+            }
+            RDBCOMPARE_PROBE(compare_arch_start, arch.first.data(), arch.first.size(), arch.second.size(), arch.second.size());
+            for (const auto& pair : arch.second) {
+                if (!want_identical) {
+                    break;
+                }
+                sink.add(RDBCOMPARE_IDENTICAL, &pair.second, &pair.second);
+            }
+            sink.end_arch();
+            RDBCOMPARE_PROBE(compare_arch_done, arch.first.data(), arch.first.size());
+        }
+    }
+
+    template <typename Out>
+    void append_json_chars(Out& out, std::string_view value) {
+        // Содержимое строки JSON без кавычек; экранирование как у json-c ("/" тоже экранируется).
+        // Участки без спецсимволов копируются одним append
+        static const char hex[] = "0123456789abcdef";
+        size_t plain = 0;
+        for (size_t i = 0; i < value.size(); ++i) {
+            unsigned char c = static_cast<unsigned char>(value[i]);
+            if (c >= 0x20 && c != '"' && c != '\\' && c != '/') {
+                continue;
+            }
+            out.append(value.data() + plain, i - plain);
+            plain = i + 1;
+            switch (c) {
+                case '"': out.append("\\\"", 2); break;
+                case '\\': out.append("\\\\", 2); break;
+                case '/': out.append("\\/", 2); break;
+                case '\b': out.append("\\b", 2); break;
+                case '\f': out.append("\\f", 2); break;
+                case '\n': out.append("\\n", 2); break;
+                case '\r': out.append("\\r", 2); break;
+                case '\t': out.append("\\t", 2); break;
+                default: {
+                    const char escaped[] = {'\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xf]};
+                    out.append(escaped, sizeof(escaped));
+                }
+            }
+        }
+        out.append(value.data() + plain, value.size() - plain);
+    }
+
+    template <typename Out>
+    void append_json_string(Out& out, std::string_view value) {
+        // Строка JSON в кавычках
+        out.push_back('"');
+        append_json_chars(out, value);
+        out.push_back('"');
+    }
+
+    // Выводит каждую запись отдельной строкой NDJSON сразу, как только она найдена
+    class NdjsonWriter : public ResultSink {
+    public:
+        NdjsonWriter(rdbcompare_line_cb cb, void* userdata) : cb_(cb), userdata_(userdata) {}
+
+        bool begin_arch(std::string_view arch, uint64_t, uint64_t) override {
+            arch_ = arch;
+            return true;
+        }
+
+        void add(int category, const Package* pkg1, const Package* pkg2) override {
+            if (stopped_) {
+                return;
+            }
+            const Package& pkg = pkg1 ? *pkg1 : *pkg2;
+            line_.clear();
+            line_ += "{\"arch\":";
+            append_json_string(line_, arch_);
+            line_ += ",\"category\":\"";
+            line_ += category_names[category];
+            line_ += "\",\"name\":";
+            append_json_string(line_, pkg.name);
+            append_field("epoch", pkg.evr->epoch);
+            append_field("version", pkg.evr->version);
+            append_field("release", pkg.evr->release);
+            if (pkg1 && pkg2) {
+                append_field("branch2_epoch", pkg2->evr->epoch);
+                append_field("branch2_version", pkg2->evr->version);
+                append_field("branch2_release", pkg2->evr->release);
+            }
+            line_ += "}\n";
+            stopped_ = cb_(category, line_.c_str(), line_.size(), userdata_) != 0;
+        }
+
+        bool stopped() const override { return stopped_; }
+
+    private:
+        void append_field(const char* key, std::string_view value) {
+            line_ += ",\"";
+            line_ += key;
+            line_ += "\":";
+            append_json_string(line_, value);
+        }
+
+        rdbcompare_line_cb cb_;
+        void* userdata_;
+        std::string_view arch_;
+        std::string line_;  // Буфер строки переиспользуется между записями
+        bool stopped_ = false;
+    };
+
+    void format_evr(const Package& pkg, std::string& out) {
+        // "[эпоха:]версия-релиз"; нулевая эпоха не пишется
+        out.clear();
+        const Evr& evr = *pkg.evr;
+        if (!evr.epoch.empty() && evr.epoch != "0") {
+            out += evr.epoch;
+            out += ':';
+        }
+        out += evr.version;
+        out += '-';
+        out += evr.release;
+    }
+
+    // Растущий буфер на malloc: готовая строка отдаётся вызывающему без копирования
+    class OutBuffer {
+    public:
+        OutBuffer() = default;
+        OutBuffer(const OutBuffer&) = delete;
+        OutBuffer& operator=(const OutBuffer&) = delete;
+        ~OutBuffer() { std::free(data_); }
+
+        void append(const char* data, size_t size) {
+            if (reserve(size)) {
+                std::memcpy(data_ + size_, data, size);
+                size_ += size;
+            }
+        }
+
+        void push_back(char ch) {
+            if (reserve(1)) {
+                data_[size_++] = ch;
+            }
+        }
+
+        size_t size() const { return size_; }
+
+        std::string_view view(size_t from) const {
+            // Записанное начиная с позиции from
+            return failed_ ? std::string_view() : std::string_view(data_ + from, size_ - from);
+        }
+
+        char* release() {
+            // Строка с завершающим нулём (освобождается free()); nullptr, если не хватило памяти
+            if (failed_) {
+                log_error("memory") << "Failed to allocate memory for result";
+                return nullptr;
+            }
+            if (!reserve(0)) {
+                return nullptr;
+            }
+            data_[size_] = '\0';
+            char* result = data_;
+            data_ = nullptr;
+            size_ = capacity_ = 0;
+            return result;
+        }
+
+    private:
+        bool reserve(size_t extra) {
+            if (failed_) {
+                return false;
+            }
+            if (size_ + extra < capacity_) {   // Место под завершающий ноль остаётся всегда
+                return true;
+            }
+            size_t capacity = std::max<size_t>({capacity_ * 2, size_ + extra + 1, 4096});
+            char* grown = static_cast<char*>(std::realloc(data_, capacity));
+            if (!grown) {
+                failed_ = true;
+                return false;
+            }
+            data_ = grown;
+            capacity_ = capacity;
+            return true;
+        }
+
+        char* data_ = nullptr;
+        size_t size_ = 0;
+        size_t capacity_ = 0;
+        bool failed_ = false;
+    };
+
+    // Пишет JSON сразу в буфер в формате json-c JSON_C_TO_STRING_PRETTY
+    // (отступ в два пробела, "ключ":значение) без построения дерева объектов
+    class PrettyJsonWriter {
+    public:
+        explicit PrettyJsonWriter(OutBuffer& out) : out_(out) {}
+
+        void begin_object() { open('{'); }
+        void end_object() { close('}'); }
+        void begin_array() { open('['); }
+        void end_array() { close(']'); }
+
+        void key(std::string_view name) {
+            next_item();
+            append_json_string(out_, name);
+            out_.push_back(':');
+        }
+
+        void item() { next_item(); }  // Перед каждым элементом массива
+
+        void value(std::string_view text) { append_json_string(out_, text); }
+
+        void value(std::string_view first, char separator, std::string_view second) {
+            // Строка из двух частей без промежуточной конкатенации
+            out_.push_back('"');
+            append_json_chars(out_, first);
+            out_.push_back(separator);
+            append_json_chars(out_, second);
+            out_.push_back('"');
+        }
+
+        void value(int number) {
+            char buffer[16];
+            int length = std::snprintf(buffer, sizeof(buffer), "%d", number);
+            out_.append(buffer, static_cast<size_t>(length));
+        }
+
+        void raw(std::string_view text) {
+            // Готовое значение, записанное ранее на той же глубине вложенности
+            out_.append(text.data(), text.size());
+        }
+
+    private:
+        static constexpr size_t max_depth = 16;
+
+        void open(char bracket) {
+            out_.push_back(bracket);
+            out_.push_back('\n');
+            has_items_[++depth_] = false;
+        }
+
+        void close(char bracket) {
+            if (has_items_[depth_--]) {
+                out_.push_back('\n');
+            }
+            indent();
+            out_.push_back(bracket);
+        }
+
+        void next_item() {
+            if (has_items_[depth_]) {
+                out_.append(",\n", 2);
+            }
+            has_items_[depth_] = true;
+            indent();
+        }
+
+        void indent() {
+            for (size_t i = 0; i < depth_; ++i) {
+                out_.append("  ", 2);
+            }
+        }
+
+        OutBuffer& out_;
+        bool has_items_[max_depth] = {};
+        size_t depth_ = 0;
+    };
+}
+
+struct rdbcompare_options {
+    rdbcompare::Filter filter;
+    const rdbcompare_cancel* cancel = nullptr;  // Отмена загрузки в fetch_package_list_ex
+    unsigned categories = RDBCOMPARE_DEFAULT_CATEGORIES;
+    bool counts_only = false;                   // Только счётчики, без записей
+};
+
+// Результат сравнения: снимки обеих веток (возможно, общие с кэшем снимков), записи по
+// архитектурам и курсор
+struct rdbcompare_result {
+    std::shared_ptr<const rdbcompare::Snapshot> branch1;
+    std::shared_ptr<const rdbcompare::Snapshot> branch2;
+    rdbcompare::Arena arena;   // Списки записей; объявлена до arches, чтобы пережить их
+    std::vector<rdbcompare::ArchResult> arches;
+    unsigned categories = RDBCOMPARE_DEFAULT_CATEGORIES;  // Категории, попавшие в результат
+    bool counts_only = false;
+
+    // Курсор: текущая позиция и диапазон, заданный rdbcompare_result_seek
+    size_t arch_pos = 0, arch_end = 0;
+    int category_pos = 0, category_begin = 0, category_end = RDBCOMPARE_CATEGORY_COUNT;
+    size_t entry_pos = 0;
+    std::string evr1, evr2;   // Текст EVR последней выданной записи
+};
+
+namespace rdbcompare {
+
+    // JSON архитектур прежних сравнений compare_packages_ex. Ключ - архитектура, отпечатки
+    // обеих веток и набор категорий: если ни одна ветка в архитектуре не изменилась, её
+    // результат берётся готовым. Вытесняются давно не использованные (fragment_cache_bytes)
+    class FragmentCache {
+    public:
+        static std::string make_key(std::string_view arch, uint64_t fingerprint1, uint64_t fingerprint2,
+                                    unsigned categories, bool counts_only) {
+            char part[64];
+            std::snprintf(part, sizeof(part), " %016llx %016llx c%x%s", static_cast<unsigned long long>(fingerprint1),
+                          static_cast<unsigned long long>(fingerprint2), categories, counts_only ? " counts" : "");
+            return std::string(arch) + part;
+        }
+
+        std::shared_ptr<const ArchFragment> find(const std::string& key) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto found = index_.find(key);
+            if (found == index_.end()) {
+                return nullptr;
+            }
+            entries_.splice(entries_.begin(), entries_, found->second);
+            return found->second->second;
+        }
+
+        void store(const std::string& key, std::shared_ptr<const ArchFragment> fragment, size_t limit) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (fragment->json.size() > limit || index_.count(key)) {
+                return;
+            }
+            bytes_ += fragment->json.size();
+            entries_.emplace_front(key, std::move(fragment));
+            index_.emplace(key, entries_.begin());
+            while (bytes_ > limit) {
+                bytes_ -= entries_.back().second->json.size();
+                index_.erase(entries_.back().first);
+                entries_.pop_back();
+            }
+        }
+
+    private:
+        using Entries = std::list<std::pair<std::string, std::shared_ptr<const ArchFragment>>>;
+        std::mutex mutex_;
+        Entries entries_;  // Недавние впереди
+        std::unordered_map<std::string, Entries::iterator> index_;
+        size_t bytes_ = 0;
+    };
+
+    FragmentCache& fragment_cache();
+
+    class ResultBuilder : public ResultSink {
+    public:
+        // fragments - кэш, из которого берутся неизменившиеся архитектуры (только для вывода в JSON)
+        explicit ResultBuilder(rdbcompare_result& result, FragmentCache* fragments = nullptr)
+            : result_(result), fragments_(fragments) {}
+
+        bool begin_arch(std::string_view arch, uint64_t fingerprint1, uint64_t fingerprint2) override {
+            ArchResult& added = result_.arches.emplace_back(arch, &result_.arena);
+            added.fingerprint1 = fingerprint1;
+            added.fingerprint2 = fingerprint2;
+            if (!fragments_) {
+                return true;
+            }
+            added.fragment = fragments_->find(FragmentCache::make_key(arch, fingerprint1, fingerprint2,
+                                                                      result_.categories, result_.counts_only));
+            if (!added.fragment) {
+                stats().fragment_misses.fetch_add(1, std::memory_order_relaxed);
+                return true;
+            }
+            stats().fragment_hits.fetch_add(1, std::memory_order_relaxed);
+            std::copy(std::begin(added.fragment->counts), std::end(added.fragment->counts), added.counts);
+            return false;
+        }
+
+        void add(int category, const Package* pkg1, const Package* pkg2) override {
+            ArchResult& arch = result_.arches.back();
+            arch.counts[category]++;
+            if (!result_.counts_only) {
+                arch.entries[category].push_back({pkg1, pkg2});
+            }
+        }
+
+    private:
+        rdbcompare_result& result_;
+        FragmentCache* fragments_;
+    };
+
+    bool parse_branches(const char* branch1_data, const char* branch2_data, const rdbcompare_options_t* options,
+                        std::unique_ptr<Snapshot>& branch1, std::unique_ptr<Snapshot>& branch2, bool& same_input) {
+        // Разбирает входные данные обеих веток с фильтром из параметров. Побайтно
+        // одинаковые данные разбираются один раз: same_input, а branch2 остаётся пустым
+        if (!branch1_data || !branch2_data) {
+            log_error("compare.null") << "One or both branch data inputs are null.";
+            return false;
+        }
+
+        // Общий пул строк: одинаковые имена и EVR двух веток получают одинаковые id
+        const Filter* filter = options ? &options->filter : nullptr;
+        auto pool = std::make_shared<StringPool>();
+        same_input = branch1_data == branch2_data || std::strcmp(branch1_data, branch2_data) == 0;
+        branch1 = parse_packages_json(branch1_data, filter, pool);
+        if (same_input) {
+            stats().identical_inputs.fetch_add(1, std::memory_order_relaxed);
+        } else {
+            branch2 = parse_packages_json(branch2_data, filter, pool);
+        }
+
+        // Пустая строка на входе означает пустой список пакетов
+        if (!branch1 && strlen(branch1_data) > 0) {
+            log_error("compare.parse") << "Failed to parse packages for branch 1.";
+            return false;
+        }
+        if (!branch2 && !same_input && strlen(branch2_data) > 0) {
+            log_error("compare.parse") << "Failed to parse packages for branch 2.";
+            return false;
+        }
+        if (!branch1) {
+            branch1 = std::make_unique<Snapshot>(pool);
+        }
+        if (!branch2) {
+            branch2 = std::make_unique<Snapshot>(pool);
+        }
+        return true;
+    }
+
+    std::unique_ptr<rdbcompare_result> build_result(std::shared_ptr<const Snapshot> branch1, std::shared_ptr<const Snapshot> branch2,
+                                                    const rdbcompare_options_t* options, FragmentCache* fragments = nullptr) {
+        // Сравнивает разобранные снимки; один и тот же снимок с обеих сторон - одинаковые данные
+        auto result = std::make_unique<rdbcompare_result>();
+        const bool same_input = branch1 == branch2;
+        result->branch1 = std::move(branch1);
+        result->branch2 = std::move(branch2);
+        if (options) {
+            result->categories = options->categories;
+            result->counts_only = options->counts_only;
+        }
+
+        ResultBuilder builder(*result, fragments);
+        if (same_input) {
+            compare_identical(*result->branch1, builder, result->categories);
+        } else {
+            compare_arch_packages(*result->branch1, *result->branch2, builder, result->categories);
+        }
+        result->arch_end = result->arches.size();
+        RDBCOMPARE_PROBE(result, rdbcompare_result_count(result.get(), nullptr, -1), result->arches.size());
+        if (result->counts_only) {
+            // Записи не ссылаются на пакеты, снимки больше не нужны
+            result->branch1.reset();
+            result->branch2.reset();
+        }
+        return result;
+    }
+
+    std::unique_ptr<rdbcompare_result> build_result(const char* branch1_data, const char* branch2_data, const rdbcompare_options_t* options,
+                                                    FragmentCache* fragments = nullptr) {
+        std::unique_ptr<Snapshot> branch1;
+        std::unique_ptr<Snapshot> branch2;
+        bool same_input = false;
+        if (!parse_branches(branch1_data, branch2_data, options, branch1, branch2, same_input)) {
+            return nullptr;
+        }
+        std::shared_ptr<const Snapshot> first = std::move(branch1);
+        std::shared_ptr<const Snapshot> second = same_input ? first : std::shared_ptr<const Snapshot>(std::move(branch2));
+        return build_result(std::move(first), std::move(second), options, fragments);
+    }
+
+    char* result_to_json(const rdbcompare_result& result, FragmentCache* fragments = nullptr, size_t fragment_limit = 0) {
+        // Вывод побайтно совпадает с прежним, собранным через объекты json-c. Архитектуры,
+        // взятые из кэша, копируются готовыми; заново сравненные попадают в fragments
+        TraceSpan span("serialize", "output");
+        OutBuffer out;
+        PrettyJsonWriter json(out);
+        json.begin_object();
+        json.key("architectures");
+        json.begin_object();
+
+        // Невыбранные категории в вывод не попадают, в режиме counts_only - массивы packages
+        int totals[RDBCOMPARE_CATEGORY_COUNT] = {};
+        std::string evr;
+
+        for (const ArchResult& arch_result : result.arches) {
+            json.key(arch_result.arch);
+            if (arch_result.fragment) {
+                json.raw(arch_result.fragment->json);
+                for (int category = 0; category < RDBCOMPARE_CATEGORY_COUNT; ++category) {
+                    totals[category] += static_cast<int>(arch_result.counts[category]);
+                }
+                continue;
+            }
+            const size_t fragment_start = out.size();
+            json.begin_object();
+
+            for (int category = 0; category < RDBCOMPARE_CATEGORY_COUNT; ++category) {
+                if (!category_selected(result.categories, category)) {
+                    continue;
+                }
+                const auto& entries = arch_result.entries[category];
+                const int count = static_cast<int>(arch_result.counts[category]);
+                json.key(category_names[category]);
+                json.begin_object();
+                if (result.counts_only) {
+                    json.key("count");
+                    json.value(count);
+                    json.end_object();
+                    totals[category] += count;
+                    continue;
+                }
+                json.key("packages");
+                json.begin_array();
+
+                for (const ResultEntry& entry : entries) {
+                    json.item();
+                    if (category == RDBCOMPARE_BRANCH1_NEWER || category == RDBCOMPARE_BRANCH2_NEWER) {
+                        json.begin_object();
+                        json.key("name");
+                        json.value(entry.pkg1->name);
+                        json.key("branch1_version_release");
+                        json.value(entry.pkg1->evr->version, '-', entry.pkg1->evr->release);
+                        json.key("branch2_version_release");
+                        json.value(entry.pkg2->evr->version, '-', entry.pkg2->evr->release);
+                        json.end_object();
+                    } else if (category == RDBCOMPARE_IDENTICAL) {
+                        json.begin_object();
+                        json.key("name");
+                        json.value(entry.pkg1->name);
+                        json.key("evr");
+                        format_evr(*entry.pkg1, evr);
+                        json.value(evr);
+                        json.end_object();
+                    } else if (category == RDBCOMPARE_EPOCH_ONLY) {
+                        json.begin_object();
+                        json.key("name");
+                        json.value(entry.pkg1->name);
+                        json.key("branch1_evr");
+                        format_evr(*entry.pkg1, evr);
+                        json.value(evr);
+                        json.key("branch2_evr");
+                        format_evr(*entry.pkg2, evr);
+                        json.value(evr);
+                        json.end_object();
+                    } else {
+                        const Package* pkg = entry.pkg1 ? entry.pkg1 : entry.pkg2;
+                        json.value(pkg->name);
+                    }
+                }
+
+                json.end_array();
+                json.key("count");
+                json.value(count);
+                json.end_object();
+                totals[category] += count;
+            }
+            json.end_object();
+
+            if (fragments && fragment_limit > 0) {
+                auto fragment = std::make_shared<ArchFragment>();
+                fragment->json = out.view(fragment_start);
+                std::copy(std::begin(arch_result.counts), std::end(arch_result.counts), fragment->counts);
+                fragments->store(FragmentCache::make_key(arch_result.arch, arch_result.fingerprint1, arch_result.fingerprint2,
+                                                         result.categories, result.counts_only),
+                                 std::move(fragment), fragment_limit);
+            }
+        }
+        json.end_object();
+
+        json.key("summary");
+        json.begin_object();
+        for (int category = 0; category < RDBCOMPARE_CATEGORY_COUNT; ++category) {
+            if (category_selected(result.categories, category)) {
+                json.key("total_" + std::string(category_names[category]) + "_count");
+                json.value(totals[category]);
+            }
+        }
+        json.end_object();
+        json.end_object();
+
+        RDBCOMPARE_PROBE(result_json, out.size());
+        return out.release();
+    }
+
+    // Кэш JSON-результатов compare_packages по содержимому входных данных. Ключ - хэши
+    // и длины обеих веток и параметры сравнения, так что повторное сравнение тех же
+    // данных обходится копированием готового ответа. Ограничен числом записей и объёмом
+    // (memo_size, memo_bytes); с persist_memo ответы сохраняются и в каталоге кэша
+    class ResultMemo {
+    public:
+        static std::string make_key(const char* branch1_data, const char* branch2_data, const rdbcompare_options_t* options) {
+            std::string key;
+            char part[48];
+            for (const char* data : {branch1_data, branch2_data}) {
+                const size_t size = std::strlen(data);
+                stats().hashed_bytes.fetch_add(size, std::memory_order_relaxed);
+                std::snprintf(part, sizeof(part), "%016llx:%zx ", static_cast<unsigned long long>(hash_bytes(data, size)), size);
+                key += part;
+            }
+            const unsigned categories = options ? options->categories : RDBCOMPARE_DEFAULT_CATEGORIES;
+            std::snprintf(part, sizeof(part), "c%x%s", categories, options && options->counts_only ? " counts" : "");
+            key += part;
+            if (options) {
+                for (const auto& arch : options->filter.arches) {
+                    key += " a=" + arch;
+                }
+                for (const auto& prefix : options->filter.prefixes) {
+                    key += " p=" + prefix;
+                }
+                for (const auto& glob : options->filter.globs) {
+                    key += " g=" + glob;
+                }
+            }
+            return key;
+        }
+
+        char* lookup(const std::string& key, const Config& cfg) {
+            // Копия результата (освобождается free()) или nullptr
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                auto found = index_.find(key);
+                if (found != index_.end()) {
+                    entries_.splice(entries_.begin(), entries_, found->second);
+                    stats().memo_hits.fetch_add(1, std::memory_order_relaxed);
+                    return allocate_result(found->second->second);
+                }
+            }
+            std::string json;
+            if (cfg.persist_memo && load_from_disk(key, cfg, json)) {
+                stats().memo_disk_hits.fetch_add(1, std::memory_order_relaxed);
+                char* result = allocate_result(json);
+                remember(key, std::move(json), cfg);
+                return result;
+            }
+            stats().memo_misses.fetch_add(1, std::memory_order_relaxed);
+            return nullptr;
+        }
+
+        void store(const std::string& key, const char* json, const Config& cfg) {
+            std::string copy(json);
+            if (cfg.persist_memo) {
+                save_to_disk(key, copy, cfg);
+            }
+            remember(key, std::move(copy), cfg);
+        }
+
+    private:
+        using Entries = std::list<std::pair<std::string, std::string>>;  // Ключ и JSON, недавние впереди
+        static constexpr const char* file_header = "rdbcompare-memo 1";
+
+        void remember(const std::string& key, std::string json, const Config& cfg) {
+            if (json.size() > static_cast<size_t>(cfg.memo_bytes)) {
+                return;
+            }
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (index_.count(key)) {
+                return;
+            }
+            bytes_ += json.size();
+            entries_.emplace_front(key, std::move(json));
+            index_.emplace(key, entries_.begin());
+            while (!entries_.empty() && (entries_.size() > static_cast<size_t>(cfg.memo_size) ||
+                                         bytes_ > static_cast<size_t>(cfg.memo_bytes))) {
+                bytes_ -= entries_.back().second.size();
+                index_.erase(entries_.back().first);
+                entries_.pop_back();
+            }
+        }
+
+        static std::filesystem::path memo_directory(const Config& cfg) {
+            std::filesystem::path dir = cache_directory(cfg);
+            return dir.empty() ? dir : dir / "memo";
+        }
+
+        static std::string file_name(const std::string& key) {
+            char name[17];
+            std::snprintf(name, sizeof(name), "%016llx", static_cast<unsigned long long>(hash_bytes(key.data(), key.size())));
+            return name;
+        }
+
+        static bool load_from_disk(const std::string& key, const Config& cfg, std::string& json) {
+            // Файл: заголовок, полный ключ (имя файла - только его хэш) и JSON до конца файла
+            std::filesystem::path dir = memo_directory(cfg);
+            if (dir.empty()) {
+                return false;
+            }
+            std::filesystem::path path = dir / file_name(key);
+            std::ifstream in(path, std::ios::binary);
+            std::string header, stored_key;
+            if (!std::getline(in, header) || header != file_header || !std::getline(in, stored_key) || stored_key != key) {
+                return false;
+            }
+            const std::streampos start = in.tellg();
+            in.seekg(0, std::ios::end);
+            json.resize(static_cast<size_t>(in.tellg() - start));
+            in.seekg(start);
+            if (!in.read(json.data(), static_cast<std::streamsize>(json.size()))) {
+                return false;
+            }
+            // Время изменения служит отметкой использования при вытеснении старых файлов
+            std::error_code ec;
+            std::filesystem::last_write_time(path, std::filesystem::file_time_type::clock::now(), ec);
+            return true;
+        }
+
+        static void save_to_disk(const std::string& key, const std::string& json, const Config& cfg) {
+            std::filesystem::path dir = memo_directory(cfg);
+            if (dir.empty()) {
+                return;
+            }
+            std::error_code ec;
+            std::filesystem::create_directories(dir, ec);
+            std::filesystem::path tmp = dir / (file_name(key) + temp_suffix());
+            {
+                std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+                out << file_header << '\n' << key << '\n' << json;
+                if (!out) {
+                    log_warning("memo.write") << "Failed to write comparison result cache to " << tmp.string();
+                    std::filesystem::remove(tmp, ec);
+                    return;
+                }
+            }
+            std::filesystem::rename(tmp, dir / file_name(key), ec);
+            if (ec) {
+                std::filesystem::remove(tmp, ec);
+                return;
+            }
+
+            // Оставляем не более memo_size недавно использованных файлов
+            std::vector<std::pair<std::filesystem::file_time_type, std::filesystem::path>> files;
+            for (const auto& item : std::filesystem::directory_iterator(dir, ec)) {
+                if (item.is_regular_file(ec) && item.path().filename().string().find(".tmp.") == std::string::npos) {
+                    files.emplace_back(item.last_write_time(ec), item.path());
+                }
+            }
+            if (files.size() > static_cast<size_t>(cfg.memo_size)) {
+                std::sort(files.begin(), files.end());
+                for (size_t i = 0; i < files.size() - static_cast<size_t>(cfg.memo_size); ++i) {
+                    std::filesystem::remove(files[i].second, ec);
+                }
+            }
+        }
+
+        std::mutex mutex_;
+        Entries entries_;
+        std::unordered_map<std::string, Entries::iterator> index_;
+        size_t bytes_ = 0;
+    };
+
+    ResultMemo& result_memo();
+
+    // Разобранные списки пакетов веток для rdbcompare_compare_branches. Ключ - сервер, ветка
+    // и фильтр; у снимка есть тег версии - ETag ответа или хэш тела, если сервер ETag не
+    // присылает. Снимок моложе snapshot_ttl отдаётся без запроса, более старый перепроверяется
+    // условным запросом: ответ 304 или тело с тем же хэшем продлевают его, иначе он заменяется
+    // заново разобранным. Объём снимка - блоки его арены и пула строк в куче; сверх
+    // snapshot_cache_bytes вытесняются давно не использованные, кроме закреплённых
+    class SnapshotCache {
+    public:
+        using Pointer = std::shared_ptr<const Snapshot>;
+
+        // nullptr - ошибка загрузки или разбора (сообщение уже выведено). pin - закрепить снимок
+        Pointer get(const char* branch, const Filter* filter, const rdbcompare_cancel* cancel, bool pin = false) {
+            TraceSpan span("snapshot", "cache");
+            if (span.active()) {
+                span.arg("branch", branch);
+            }
+            const Config cfg = current_config();
+            const std::string key = make_key(cfg, branch, filter);
+            std::string etag, tag;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                auto found = index_.find(key);
+                if (found != index_.end()) {
+                    Entry& entry = *found->second;
+                    entries_.splice(entries_.begin(), entries_, found->second);
+                    if (std::chrono::steady_clock::now() - entry.checked < std::chrono::seconds(cfg.snapshot_ttl)) {
+                        stats().snapshot_hits.fetch_add(1, std::memory_order_relaxed);
+                        return take(entry, pin);
+                    }
+                    etag = entry.etag;
+                    tag = entry.tag;
+                }
+            }
+
+            FetchOutcome outcome = fetch_branch(branch, filter, cancel, etag);
+            if (outcome.http_code == 304 && !outcome.ok) {
+                if (Pointer kept = revalidate(key, tag, pin)) {
+                    return kept;
+                }
+                // Снимок вытеснили, пока шёл запрос: нужен полный ответ
+                outcome = fetch_branch(branch, filter, cancel);
+            }
+            if (!outcome.ok) {
+                return nullptr;
+            }
+            std::string new_tag = outcome.etag;
+            if (new_tag.empty()) {
+                char hash[24];
+                std::snprintf(hash, sizeof(hash), "h:%016llx",
+                              static_cast<unsigned long long>(hash_bytes(outcome.body->data(), outcome.body->size())));
+                new_tag = hash;
+            }
+            if (new_tag == tag) {
+                if (Pointer kept = revalidate(key, tag, pin)) {
+                    return kept;
+                }
+            }
+
+            // Свой пул строк: снимок живёт независимо от других и освобождается целиком
+            std::shared_ptr<Snapshot> parsed = parse_packages_json(outcome.body->c_str(), filter);
+            if (!parsed) {
+                log_error("compare.parse") << "Failed to parse packages for '" << branch << "'";
+                return nullptr;
+            }
+            stats().snapshot_misses.fetch_add(1, std::memory_order_relaxed);
+            const size_t packages = parsed->package_count();
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto found = index_.find(key);
+            if (found != index_.end()) {
+                bytes_ -= found->second->bytes;
+                entries_.erase(found->second);
+                index_.erase(found);
+            }
+            entries_.push_front(Entry{key, branch, new_tag, outcome.etag, parsed, parsed->footprint(), packages,
+                                      std::chrono::steady_clock::now()});
+            index_.emplace(key, entries_.begin());
+            bytes_ += entries_.front().bytes;
+            Pointer snapshot = take(entries_.front(), pin);
+            evict_over(static_cast<size_t>(cfg.snapshot_cache_bytes));
+            return snapshot;
+        }
+
+        // Снимает одно закрепление; false - снимок не был закреплён
+        bool unpin(const char* branch, const Filter* filter) {
+            const Config cfg = current_config();
+            const std::string key = make_key(cfg, branch, filter);
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto found = pins_.find(key);
+            if (found == pins_.end()) {
+                return false;
+            }
+            if (--found->second == 0) {
+                pins_.erase(found);
+            }
+            evict_over(static_cast<size_t>(cfg.snapshot_cache_bytes));
+            return true;
+        }
+
+        // Удаляет снимок ветки вместе с закреплениями (branch == nullptr - все незакреплённые);
+        // возвращает число удалённых снимков
+        size_t evict(const char* branch, const Filter* filter) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!branch) {
+                return evict_over(0);
+            }
+            const std::string key = make_key(current_config(), branch, filter);
+            pins_.erase(key);
+            auto found = index_.find(key);
+            if (found == index_.end()) {
+                return 0;
+            }
+            remove(found->second);
+            return 1;
+        }
+
+        std::string to_json() {
+            // {"bytes","entries":[{"branch","tag","bytes","packages","pinned","age_s"}]}, недавние впереди
+            std::lock_guard<std::mutex> lock(mutex_);
+            const auto now = std::chrono::steady_clock::now();
+            std::string json = "{\"bytes\":" + std::to_string(bytes_) + ",\"entries\":[";
+            for (const Entry& entry : entries_) {
+                if (json.back() != '[') {
+                    json += ',';
+                }
+                auto pinned = pins_.find(entry.key);
+                json += "{\"branch\":";
+                append_json_string(json, entry.branch);
+                json += ",\"tag\":";
+                append_json_string(json, entry.tag);
+                json += ",\"bytes\":" + std::to_string(entry.bytes) + ",\"packages\":" + std::to_string(entry.packages) +
+                        ",\"pinned\":" + std::to_string(pinned != pins_.end() ? pinned->second : 0) + ",\"age_s\":" +
+                        std::to_string(std::chrono::duration_cast<std::chrono::seconds>(now - entry.checked).count()) + "}";
+            }
+            json += "]}";
+            return json;
+        }
+
+    private:
+        struct Entry {
+            std::string key;
+            std::string branch;
+            std::string tag;     // Тег версии: ETag или "h:" и хэш тела
+            std::string etag;    // ETag для If-None-Match ("" - сервер его не присылает)
+            Pointer snapshot;
+            size_t bytes;        // Snapshot::footprint
+            size_t packages;
+            std::chrono::steady_clock::time_point checked;  // Загружен или подтверждён сервером
+        };
+        using Entries = std::list<Entry>;  // Недавние впереди
+
+        static std::string make_key(const Config& cfg, const char* branch, const Filter* filter) {
+            std::string key = cfg.api_base + '\n' + cfg.endpoints + '\n' + branch;
+            if (filter) {
+                for (const auto& arch : filter->arches) {
+                    key += " a=" + arch;
+                }
+                for (const auto& prefix : filter->prefixes) {
+                    key += " p=" + prefix;
+                }
+                for (const auto& glob : filter->globs) {
+                    key += " g=" + glob;
+                }
+            }
+            return key;
+        }
+
+        Pointer take(const Entry& entry, bool pin) {
+            if (pin) {
+                pins_[entry.key]++;
+            }
+            return entry.snapshot;
+        }
+
+        Pointer revalidate(const std::string& key, const std::string& tag, bool pin) {
+            // Сервер подтвердил версию tag: снимок продлевается, если его ещё не заменили
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto found = index_.find(key);
+            if (found == index_.end() || found->second->tag != tag) {
+                return nullptr;
+            }
+            found->second->checked = std::chrono::steady_clock::now();
+            stats().snapshot_hits.fetch_add(1, std::memory_order_relaxed);
+            stats().snapshot_revalidations.fetch_add(1, std::memory_order_relaxed);
+            return take(*found->second, pin);
+        }
+
+        void remove(Entries::iterator entry) {
+            // Снимок освобождается, когда его отпустят и результаты сравнений, ссылающиеся на него
+            bytes_ -= entry->bytes;
+            index_.erase(entry->key);
+            entries_.erase(entry);
+            stats().snapshot_evictions.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        size_t evict_over(size_t budget) {
+            // Вытесняет давно не использованные незакреплённые снимки, пока объём больше budget
+            size_t evicted = 0;
+            for (auto it = entries_.end(); bytes_ > budget && it != entries_.begin();) {
+                --it;
+                if (pins_.count(it->key)) {
+                    continue;
+                }
+                remove(it++);
+                evicted++;
+            }
+            return evicted;
+        }
+
+        std::mutex mutex_;
+        Entries entries_;
+        std::unordered_map<std::string, Entries::iterator> index_;
+        std::unordered_map<std::string, size_t> pins_;  // Число закреплений по ключу
+        size_t bytes_ = 0;
+    };
+
+    SnapshotCache& snapshot_cache();
+
+    // Счётчики в порядке вывода rdbcompare_stats_json
+    const std::pair<const char*, std::atomic<uint64_t> Stats::*> stats_counters[] = {
+        {"arenas", &Stats::arenas},
+        {"arena_allocations", &Stats::arena_allocations},
+        {"arena_bytes", &Stats::arena_bytes},
+        {"arena_blocks", &Stats::arena_blocks},
+        {"arena_block_bytes", &Stats::arena_block_bytes},
+        {"interned_strings", &Stats::interned_strings},
+        {"interned_evrs", &Stats::interned_evrs},
+        {"intern_hits", &Stats::intern_hits},
+        {"evr_rank_hits", &Stats::evr_rank_hits},
+        {"evr_rank_added", &Stats::evr_rank_added},
+        {"evr_rank_rebuilds", &Stats::evr_rank_rebuilds},
+        {"evr_rank_resets", &Stats::evr_rank_resets},
+        {"endpoint_probes", &Stats::endpoint_probes},
+        {"endpoint_failovers", &Stats::endpoint_failovers},
+        {"request_retries", &Stats::request_retries},
+        {"request_timeouts", &Stats::request_timeouts},
+        {"requests_cancelled", &Stats::requests_cancelled},
+        {"hedged_requests", &Stats::hedged_requests},
+        {"hedge_wins", &Stats::hedge_wins},
+        {"bytes_received", &Stats::bytes_received},
+        {"bytes_decoded", &Stats::bytes_decoded},
+        {"sharded_fetches", &Stats::sharded_fetches},
+        {"shards", &Stats::shards},
+        {"connections_opened", &Stats::connections_opened},
+        {"connections_reused", &Stats::connections_reused},
+        {"http2_transfers", &Stats::http2_transfers},
+        {"duplicate_builds", &Stats::duplicate_builds},
+        {"identical_inputs", &Stats::identical_inputs},
+        {"hashed_bytes", &Stats::hashed_bytes},
+        {"memo_hits", &Stats::memo_hits},
+        {"memo_disk_hits", &Stats::memo_disk_hits},
+        {"memo_misses", &Stats::memo_misses},
+        {"fragment_hits", &Stats::fragment_hits},
+        {"fragment_misses", &Stats::fragment_misses},
+        {"fetch_flights", &Stats::fetch_flights},
+        {"fetch_coalesced", &Stats::fetch_coalesced},
+        {"snapshot_hits", &Stats::snapshot_hits},
+        {"snapshot_misses", &Stats::snapshot_misses},
+        {"snapshot_evictions", &Stats::snapshot_evictions},
+        {"snapshot_revalidations", &Stats::snapshot_revalidations},
+    };
+
+    rdbcompare_str_t make_str(std::string_view value) {
+        return {value.data(), value.size()};
+    }
+
+    int find_arch(const rdbcompare_result& result, const char* arch) {
+        for (size_t i = 0; i < result.arches.size(); ++i) {
+            if (result.arches[i].arch == arch) {
+                return static_cast<int>(i);
+            }
+        }
+        return -1;
+    }
+
+}
+
+// Контекст библиотеки: настройки, соединения, кэши и счётчики. Объекты внутри сами
+// синхронизируют доступ, поэтому один контекст можно вызывать из нескольких потоков
+struct rdbcompare_ctx {
+    rdbcompare::Stats stats;   // Объявлены первыми: деструкторы кэшей ниже ещё пишут в счётчики
+    std::mutex config_mutex;
+    rdbcompare::Config config = rdbcompare::config_from_environment();
+    rdbcompare::ConnectionPool connections;
+    rdbcompare::EndpointSet endpoints;
+    rdbcompare::LatencyWindow package_latency;
+    rdbcompare::BranchCache branch_cache;
+    rdbcompare::EvrRankDictionary evr_ranks;
+    rdbcompare::FragmentCache fragment_cache;
+    rdbcompare::ResultMemo result_memo;
+    rdbcompare::SnapshotCache snapshot_cache;
+    rdbcompare::FetchFlights fetch_flights;  // Последним: ждёт фоновые загрузки, пользующиеся объектами выше
+};
+
+namespace rdbcompare {
+
+    rdbcompare_ctx& default_ctx() {
+        // Контекст функций без параметра ctx. Не разрушается при выходе из процесса:
+        // потоки приложения могут ещё работать с библиотекой
+        static rdbcompare_ctx* ctx = new rdbcompare_ctx;
+        return *ctx;
+    }
+
+    rdbcompare_ctx& current_ctx() {
+        return active_ctx ? *active_ctx : default_ctx();
+    }
+
+    Stats& stats() { return current_ctx().stats; }
+    std::mutex& config_mutex() { return current_ctx().config_mutex; }
+    Config& config_locked() { return current_ctx().config; }
+    ConnectionPool& connections() { return current_ctx().connections; }
+    EndpointSet& endpoints() { return current_ctx().endpoints; }
+    LatencyWindow& package_latency() { return current_ctx().package_latency; }
+    BranchCache& branch_cache() { return current_ctx().branch_cache; }
+    EvrRankDictionary& evr_ranks() { return current_ctx().evr_ranks; }
+    FragmentCache& fragment_cache() { return current_ctx().fragment_cache; }
+    ResultMemo& result_memo() { return current_ctx().result_memo; }
+    SnapshotCache& snapshot_cache() { return current_ctx().snapshot_cache; }
+    FetchFlights& fetch_flights() { return current_ctx().fetch_flights; }
+
+}
+
+extern "C" {
+    void rdbcompare_init() {
+        curl_global_init(CURL_GLOBAL_ALL);
+        // Если задано несколько зеркал, задержка замеряется сразу, а не при первом запросе
+        if (rdbcompare::configured_endpoints(rdbcompare::current_config()).size() > 1) {
+            rdbcompare::endpoints().probe();
+        }
+    }
+
+    void rdbcompare_cleanup() {
+        // Закрываются свободные соединения контекста по умолчанию; выполняющиеся в других
+        // потоках запросы к этому моменту должны завершиться
+        rdbcompare::default_ctx().connections.reset();
+        curl_global_cleanup();
+        rdbcompare::logger().flush();
+    }
+
+    rdbcompare_ctx_t* rdbcompare_ctx_new(void) {
+        // libcurl считает вызовы curl_global_init, так что каждый контекст держит свою ссылку
+        if (curl_global_init(CURL_GLOBAL_ALL) != CURLE_OK) {
+            rdbcompare::log_error("http.init") << "Failed to initialize curl";
+            return nullptr;
+        }
+        return new rdbcompare_ctx;
+    }
+
+    void rdbcompare_ctx_free(rdbcompare_ctx_t* ctx) {
+        if (!ctx) {
+            return;
+        }
+        {
+            rdbcompare::ContextScope scope(ctx);
+            delete ctx;
+        }
+        curl_global_cleanup();
+    }
+
+    int rdbcompare_set_option(const char* name, const char* value) {
+        return rdbcompare_ctx_set_option(nullptr, name, value);
+    }
+
+    int rdbcompare_ctx_set_option(rdbcompare_ctx_t* ctx, const char* name, const char* value) {
+        if (!name) {
+            return -1;
+        }
+        rdbcompare::ContextScope scope(ctx);
+        std::lock_guard<std::mutex> lock(rdbcompare::config_mutex());
+        rdbcompare::Config updated = rdbcompare::config_locked();
+        if (!rdbcompare::apply_option(updated, name, value)) {
+            rdbcompare::log_error("option.invalid") << "Unknown option or invalid value: " << name;
+            return -1;
+        }
+        rdbcompare::config_locked() = updated;
+        return 0;
+    }
+
+    rdbcompare_options_t* rdbcompare_options_new(void) {
+        return new rdbcompare_options;
+    }
+
+    void rdbcompare_options_free(rdbcompare_options_t* options) {
+        delete options;
+    }
+
+    int rdbcompare_options_add_arch(rdbcompare_options_t* options, const char* arch) {
+        if (!options || !arch || !*arch) {
+            return -1;
+        }
+        options->filter.arches.emplace_back(arch);
+        return 0;
+    }
+
+    int rdbcompare_options_add_name_pattern(rdbcompare_options_t* options, const char* pattern) {
+        if (!options || !pattern || !*pattern) {
+            return -1;
+        }
+        options->filter.add_name_pattern(pattern);
+        return 0;
+    }
+
+    int rdbcompare_options_set_categories(rdbcompare_options_t* options, unsigned categories) {
+        if (!options || categories == 0 || (categories & ~RDBCOMPARE_ALL_CATEGORIES)) {
+            return -1;
+        }
+        options->categories = categories;
+        return 0;
+    }
+
+    int rdbcompare_options_set_counts_only(rdbcompare_options_t* options, int counts_only) {
+        if (!options) {
+            return -1;
+        }
+        options->counts_only = counts_only != 0;
+        return 0;
+    }
+
+    int rdbcompare_options_set_cancel(rdbcompare_options_t* options, const rdbcompare_cancel_t* cancel) {
+        if (!options) {
+            return -1;
+        }
+        options->cancel = cancel;
+        return 0;
+    }
+
+    rdbcompare_cancel_t* rdbcompare_cancel_new(void) {
+        return new rdbcompare_cancel;
+    }
+
+    void rdbcompare_cancel_free(rdbcompare_cancel_t* cancel) {
+        delete cancel;
+    }
+
+    void rdbcompare_cancel_request(rdbcompare_cancel_t* cancel) {
+        if (cancel) {
+            cancel->cancelled.store(true, std::memory_order_relaxed);
+        }
+    }
+
+    void rdbcompare_cancel_reset(rdbcompare_cancel_t* cancel) {
+        if (cancel) {
+            cancel->cancelled.store(false, std::memory_order_relaxed);
+        }
+    }
+
+    char* fetch_package_list(const char* branch) {
+        return rdbcompare_ctx_fetch_package_list(nullptr, branch, nullptr);
+    }
+
+    char* fetch_package_list_ex(const char* branch, const rdbcompare_options_t* options) {
+        return rdbcompare_ctx_fetch_package_list(nullptr, branch, options);
+    }
+
+    char* rdbcompare_ctx_fetch_package_list(rdbcompare_ctx_t* ctx, const char* branch, const rdbcompare_options_t* options) {
+        rdbcompare::ContextScope scope(ctx);
+        rdbcompare::FetchOutcome outcome = rdbcompare::fetch_branch(branch, options ? &options->filter : nullptr,
+                                                                    options ? options->cancel : nullptr);
+        return outcome.ok ? rdbcompare::allocate_result(*outcome.body) : nullptr;
+    }
+
+char* compare_packages(const char* branch1_data, const char* branch2_data) {
+    return rdbcompare_ctx_compare_packages(nullptr, branch1_data, branch2_data, nullptr);
+}
+
+char* compare_packages_ex(const char* branch1_data, const char* branch2_data, const rdbcompare_options_t* options) {
+    return rdbcompare_ctx_compare_packages(nullptr, branch1_data, branch2_data, options);
+}
+
+char* rdbcompare_ctx_compare_packages(rdbcompare_ctx_t* ctx, const char* branch1_data, const char* branch2_data,
+                                      const rdbcompare_options_t* options) {
+    rdbcompare::ContextScope scope(ctx);
+    rdbcompare::TraceSpan span("compare_packages", "api");
+    // Повторное сравнение тех же данных с теми же параметрами берётся из кэша результатов
+    const rdbcompare::Config cfg = rdbcompare::current_config();
+    std::string memo_key;
+    if (cfg.memo_size > 0 && branch1_data && branch2_data) {
+        memo_key = rdbcompare::ResultMemo::make_key(branch1_data, branch2_data, options);
+        if (char* cached = rdbcompare::result_memo().lookup(memo_key, cfg)) {
+            return cached;
+        }
+    }
+    // Архитектуры, не изменившиеся ни в одной ветке с прежнего сравнения, не сравниваются
+    rdbcompare::FragmentCache* fragments = cfg.fragment_cache_bytes > 0 ? &rdbcompare::fragment_cache() : nullptr;
+    std::unique_ptr<rdbcompare_result> result = rdbcompare::build_result(branch1_data, branch2_data, options, fragments);
+    if (!result) {
+        return nullptr;
+    }
+    char* json = rdbcompare::result_to_json(*result, fragments, static_cast<size_t>(cfg.fragment_cache_bytes));
+    if (json && !memo_key.empty()) {
+        rdbcompare::result_memo().store(memo_key, json, cfg);
+    }
+    return json;
+}
+
+int compare_packages_ndjson(const char* branch1_data, const char* branch2_data, const rdbcompare_options_t* options,
+                            rdbcompare_line_cb cb, void* userdata) {
+    return rdbcompare_ctx_compare_packages_ndjson(nullptr, branch1_data, branch2_data, options, cb, userdata);
+}
+
+int rdbcompare_ctx_compare_packages_ndjson(rdbcompare_ctx_t* ctx, const char* branch1_data, const char* branch2_data,
+                                           const rdbcompare_options_t* options, rdbcompare_line_cb cb, void* userdata) {
+    if (!cb) {
+        return -1;
+    }
+    rdbcompare::ContextScope scope(ctx);
+    rdbcompare::TraceSpan span("compare_packages_ndjson", "api");
+    std::unique_ptr<rdbcompare::Snapshot> branch1;
+    std::unique_ptr<rdbcompare::Snapshot> branch2;
+    bool same_input = false;
+    if (!rdbcompare::parse_branches(branch1_data, branch2_data, options, branch1, branch2, same_input)) {
+        return -1;
+    }
+    rdbcompare::NdjsonWriter writer(cb, userdata);
+    const unsigned categories = options ? options->categories : RDBCOMPARE_DEFAULT_CATEGORIES;
+    if (same_input) {
+        rdbcompare::compare_identical(*branch1, writer, categories);
+    } else {
+        rdbcompare::compare_arch_packages(*branch1, *branch2, writer, categories);
+    }
+    return 0;
+}
+
+char* rdbcompare_fingerprints_json(const char* branch_data, const rdbcompare_options_t* options) {
+    return rdbcompare_ctx_fingerprints_json(nullptr, branch_data, options);
+}
+
+char* rdbcompare_ctx_fingerprints_json(rdbcompare_ctx_t* ctx, const char* branch_data, const rdbcompare_options_t* options) {
+    if (!branch_data) {
+        rdbcompare::log_error("parse.null") << "Input JSON data is null.";
+        return nullptr;
+    }
+    rdbcompare::ContextScope scope(ctx);
+    std::unique_ptr<rdbcompare::Snapshot> snapshot;
+    if (*branch_data) {
+        snapshot = rdbcompare::parse_packages_json(branch_data, options ? &options->filter : nullptr);
+        if (!snapshot) {
+            return nullptr;
+        }
+    }
+    std::string json = "{";
+    char hex[24];
+    if (snapshot) {
+        for (const auto& pair : snapshot->fingerprints) {
+            if (json.size() > 1) {
+                json += ',';
+            }
+            rdbcompare::append_json_string(json, pair.first);
+            std::snprintf(hex, sizeof(hex), ":\"%016llx\"", static_cast<unsigned long long>(pair.second));
+            json += hex;
+        }
+    }
+    json += '}';
+    return rdbcompare::allocate_result(json);
+}
+
+rdbcompare_result_t* rdbcompare_compare(const char* branch1_data, const char* branch2_data, const rdbcompare_options_t* options) {
+    return rdbcompare_ctx_compare(nullptr, branch1_data, branch2_data, options);
+}
+
+rdbcompare_result_t* rdbcompare_ctx_compare(rdbcompare_ctx_t* ctx, const char* branch1_data, const char* branch2_data,
+                                            const rdbcompare_options_t* options) {
+    rdbcompare::ContextScope scope(ctx);
+    rdbcompare::TraceSpan span("compare", "api");
+    return rdbcompare::build_result(branch1_data, branch2_data, options).release();
+}
+
+rdbcompare_result_t* rdbcompare_compare_branches(const char* branch1, const char* branch2, const rdbcompare_options_t* options) {
+    return rdbcompare_ctx_compare_branches(nullptr, branch1, branch2, options);
+}
+
+rdbcompare_result_t* rdbcompare_ctx_compare_branches(rdbcompare_ctx_t* ctx, const char* branch1, const char* branch2,
+                                                     const rdbcompare_options_t* options) {
+    if (!branch1 || !branch2) {
+        rdbcompare::log_error("branch.invalid") << "Invalid branch name";
+        return nullptr;
+    }
+    rdbcompare::ContextScope scope(ctx);
+    rdbcompare::TraceSpan span("compare_branches", "api");
+    const rdbcompare::Filter* filter = options ? &options->filter : nullptr;
+    const rdbcompare_cancel* cancel = options ? options->cancel : nullptr;
+    rdbcompare::SnapshotCache::Pointer snapshot1 = rdbcompare::snapshot_cache().get(branch1, filter, cancel);
+    if (!snapshot1) {
+        return nullptr;
+    }
+    rdbcompare::SnapshotCache::Pointer snapshot2 = snapshot1;
+    if (std::strcmp(branch1, branch2) != 0) {
+        snapshot2 = rdbcompare::snapshot_cache().get(branch2, filter, cancel);
+        if (!snapshot2) {
+            return nullptr;
+        }
+    }
+    if (snapshot1 == snapshot2) {
+        rdbcompare::stats().identical_inputs.fetch_add(1, std::memory_order_relaxed);
+    }
+    return rdbcompare::build_result(std::move(snapshot1), std::move(snapshot2), options).release();
+}
+
+int rdbcompare_snapshot_pin(const char* branch, const rdbcompare_options_t* options) {
+    return rdbcompare_ctx_snapshot_pin(nullptr, branch, options);
+}
+
+int rdbcompare_ctx_snapshot_pin(rdbcompare_ctx_t* ctx, const char* branch, const rdbcompare_options_t* options) {
+    if (!branch) {
+        return -1;
+    }
+    rdbcompare::ContextScope scope(ctx);
+    return rdbcompare::snapshot_cache().get(branch, options ? &options->filter : nullptr,
+                                            options ? options->cancel : nullptr, true) ? 0 : -1;
+}
+
+int rdbcompare_snapshot_unpin(const char* branch, const rdbcompare_options_t* options) {
+    return rdbcompare_ctx_snapshot_unpin(nullptr, branch, options);
+}
+
+int rdbcompare_ctx_snapshot_unpin(rdbcompare_ctx_t* ctx, const char* branch, const rdbcompare_options_t* options) {
+    if (!branch) {
+        return -1;
+    }
+    rdbcompare::ContextScope scope(ctx);
+    return rdbcompare::snapshot_cache().unpin(branch, options ? &options->filter : nullptr) ? 0 : -1;
+}
+
+int rdbcompare_snapshot_evict(const char* branch, const rdbcompare_options_t* options) {
+    return rdbcompare_ctx_snapshot_evict(nullptr, branch, options);
+}
+
+int rdbcompare_ctx_snapshot_evict(rdbcompare_ctx_t* ctx, const char* branch, const rdbcompare_options_t* options) {
+    rdbcompare::ContextScope scope(ctx);
+    return static_cast<int>(rdbcompare::snapshot_cache().evict(branch, options ? &options->filter : nullptr));
+}
+
+char* rdbcompare_snapshot_cache_json(void) {
+    return rdbcompare_ctx_snapshot_cache_json(nullptr);
+}
+
+char* rdbcompare_ctx_snapshot_cache_json(rdbcompare_ctx_t* ctx) {
+    rdbcompare::ContextScope scope(ctx);
+    return rdbcompare::allocate_result(rdbcompare::snapshot_cache().to_json());
+}
+
+void rdbcompare_result_free(rdbcompare_result_t* result) {
+    delete result;
+}
+
+size_t rdbcompare_result_arch_count(const rdbcompare_result_t* result) {
+    return result ? result->arches.size() : 0;
+}
+
+const char* rdbcompare_result_arch_name(const rdbcompare_result_t* result, size_t index) {
+    if (!result || index >= result->arches.size()) {
+        return nullptr;
+    }
+    return result->arches[index].arch.c_str();
+}
+
+int rdbcompare_result_arch_fingerprints(const rdbcompare_result_t* result, size_t index,
+                                        unsigned long long* fingerprint1, unsigned long long* fingerprint2) {
+    if (!result || index >= result->arches.size()) {
+        return -1;
+    }
+    if (fingerprint1) {
+        *fingerprint1 = result->arches[index].fingerprint1;
+    }
+    if (fingerprint2) {
+        *fingerprint2 = result->arches[index].fingerprint2;
+    }
+    return 0;
+}
+
+size_t rdbcompare_result_count(const rdbcompare_result_t* result, const char* arch, int category) {
+    if (!result || category >= RDBCOMPARE_CATEGORY_COUNT) {
+        return 0;
+    }
+    size_t total = 0;
+    for (const auto& arch_result : result->arches) {
+        if (arch && arch_result.arch != arch) {
+            continue;
+        }
+        for (int c = 0; c < RDBCOMPARE_CATEGORY_COUNT; ++c) {
+            if (category < 0 || category == c) {
+                total += arch_result.counts[c];
+            }
+        }
+    }
+    return total;
+}
+
+int rdbcompare_result_seek(rdbcompare_result_t* result, const char* arch, int category) {
+    if (!result || category >= RDBCOMPARE_CATEGORY_COUNT) {
+        return -1;
+    }
+    int arch_index = arch ? rdbcompare::find_arch(*result, arch) : -1;
+    if (arch && arch_index < 0) {
+        // Пустой диапазон: next() сразу вернёт 0
+        result->arch_pos = result->arch_end = result->arches.size();
+        return -1;
+    }
+    result->arch_pos = arch ? static_cast<size_t>(arch_index) : 0;
+    result->arch_end = arch ? static_cast<size_t>(arch_index) + 1 : result->arches.size();
+    result->category_begin = category < 0 ? 0 : category;
+    result->category_end = category < 0 ? RDBCOMPARE_CATEGORY_COUNT : category + 1;
+    result->category_pos = result->category_begin;
+    result->entry_pos = 0;
+    return 0;
+}
+
+int rdbcompare_result_next(rdbcompare_result_t* result, rdbcompare_entry_t* entry) {
+    if (!result || !entry) {
+        return 0;
+    }
+    while (result->arch_pos < result->arch_end) {
+        const rdbcompare::ArchResult& arch_result = result->arches[result->arch_pos];
+        while (result->category_pos < result->category_end) {
+            const auto& entries = arch_result.entries[result->category_pos];
+            if (result->entry_pos < entries.size()) {
+                const rdbcompare::ResultEntry& found = entries[result->entry_pos++];
+                static const rdbcompare_str_t empty = {"", 0};
+                const rdbcompare::Package* pkg = found.pkg1 ? found.pkg1 : found.pkg2;
+
+                entry->arch = rdbcompare::make_str(arch_result.arch);
+                entry->name = rdbcompare::make_str(pkg->name);
+                entry->category = result->category_pos;
+                entry->category_name = {rdbcompare::category_names[result->category_pos], std::strlen(rdbcompare::category_names[result->category_pos])};
+                entry->epoch1 = entry->version1 = entry->release1 = entry->evr1 = empty;
+                entry->epoch2 = entry->version2 = entry->release2 = entry->evr2 = empty;
+                if (found.pkg1) {
+                    entry->epoch1 = rdbcompare::make_str(found.pkg1->evr->epoch);
+                    entry->version1 = rdbcompare::make_str(found.pkg1->evr->version);
+                    entry->release1 = rdbcompare::make_str(found.pkg1->evr->release);
+                    rdbcompare::format_evr(*found.pkg1, result->evr1);
+                    entry->evr1 = rdbcompare::make_str(result->evr1);
+                }
+                if (found.pkg2) {
+                    entry->epoch2 = rdbcompare::make_str(found.pkg2->evr->epoch);
+                    entry->version2 = rdbcompare::make_str(found.pkg2->evr->version);
+                    entry->release2 = rdbcompare::make_str(found.pkg2->evr->release);
+                    rdbcompare::format_evr(*found.pkg2, result->evr2);
+                    entry->evr2 = rdbcompare::make_str(result->evr2);
+                }
+                return 1;
+            }
+            result->category_pos++;
+            result->entry_pos = 0;
+        }
+        result->arch_pos++;
+        result->category_pos = result->category_begin;
+        result->entry_pos = 0;
+    }
+    return 0;
+}
+
+char* rdbcompare_result_to_json(const rdbcompare_result_t* result) {
+    if (!result) {
+        return nullptr;
+    }
+    return rdbcompare::result_to_json(*result);
+}
+
+char* rdbcompare_stats_json(void) {
+    return rdbcompare_ctx_stats_json(nullptr);
+}
+
+char* rdbcompare_ctx_stats_json(rdbcompare_ctx_t* ctx) {
+    rdbcompare::ContextScope scope(ctx);
+    const rdbcompare::Stats& stats = rdbcompare::stats();
+    std::string json = "{";
+    for (const auto& counter : rdbcompare::stats_counters) {
+        if (json.size() > 1) {
+            json += ',';
+        }
+        json += '"';
+        json += counter.first;
+        json += "\":";
+        json += std::to_string((stats.*counter.second).load(std::memory_order_relaxed));
+    }
+    json += '}';
+    return rdbcompare::allocate_result(json);
+}
+
+void rdbcompare_trace_start(void) {
+    rdbcompare::tracer().start();
+}
+
+void rdbcompare_trace_stop(void) {
+    rdbcompare::tracer().stop();
+}
+
+char* rdbcompare_trace_json(void) {
+    return rdbcompare::allocate_result(rdbcompare::tracer().to_json());
+}
+
+int rdbcompare_trace_write(const char* path) {
+    if (!path || !*path) {
+        return -1;
+    }
+    return rdbcompare::write_trace(path) ? 0 : -1;
+}
+
+void rdbcompare_set_log_callback(rdbcompare_log_cb callback, void* userdata) {
+    rdbcompare::logger().set_sink(callback, userdata);
+}
+
+void rdbcompare_set_log_level(int level) {
+    rdbcompare::logger().set_level(level);
+}
+
+void rdbcompare_set_log_rate(unsigned burst, long interval_ms) {
+    rdbcompare::logger().set_rate(burst, interval_ms);
+}
+
+void rdbcompare_log_flush(void) {
+    rdbcompare::logger().flush();
+}
+
+const char* rdbcompare_last_error(void) {
+    return rdbcompare::last_error.c_str();
+}
+
+void rdbcompare_clear_last_error(void) {
+    rdbcompare::last_error.clear();
+}
+
+char* rdbcompare_endpoints_json(void) {
+    return rdbcompare_ctx_endpoints_json(nullptr);
+}
+
+char* rdbcompare_ctx_endpoints_json(rdbcompare_ctx_t* ctx) {
+    rdbcompare::ContextScope scope(ctx);
+    return rdbcompare::allocate_result(rdbcompare::endpoints().to_json());
+}
+
+void rdbcompare_probe_endpoints(void) {
+    rdbcompare_ctx_probe_endpoints(nullptr);
+}
+
+void rdbcompare_ctx_probe_endpoints(rdbcompare_ctx_t* ctx) {
+    rdbcompare::ContextScope scope(ctx);
+    rdbcompare::endpoints().probe();
+}
+
+void rdbcompare_stats_reset(void) {
+    rdbcompare_ctx_stats_reset(nullptr);
+}
+
+void rdbcompare_ctx_stats_reset(rdbcompare_ctx_t* ctx) {
+    rdbcompare::ContextScope scope(ctx);
+    rdbcompare::Stats& stats = rdbcompare::stats();
+    for (const auto& counter : rdbcompare::stats_counters) {
+        (stats.*counter.second).store(0, std::memory_order_relaxed);
+    }
+}
+
+}
+
+namespace rdbcompare {
+
+    // Запрос цикла событий: загрузка одной ветки или загрузка двух веток со сравнением
+    struct LoopRequest {
+        int id = 0;
+        std::vector<std::string> branches;
+        std::vector<std::string> responses;
+        std::vector<CURL*> handles;          // nullptr после завершения передачи
+        std::vector<size_t> attempts;        // Номер зеркала в bases для каждой передачи
+        std::vector<std::string> bases;      // Зеркала в порядке попыток
+        size_t remaining = 0;
+        std::string error;
+        rdbcompare_fetch_cb fetch_cb = nullptr;
+        rdbcompare_compare_cb compare_cb = nullptr;
+        void* userdata = nullptr;
+    };
+
+    bool check_loop_branch(const char* branch) {
+        // Цикл событий не может блокироваться на запросе branch_tree, поэтому ветка
+        // проверяется только по уже полученному списку, а без него - ответом сервера
+        if (!branch || !*branch) {
+            log_error("branch.invalid") << "Invalid branch name";
+            return false;
+        }
+        if (current_config().validate_branches &&
+            branch_cache().lookup_cached(branch) == BranchCache::Lookup::Unknown) {
+            log_error("branch.not_found") << "Ветка '" << branch << "' не найдена в списке веток";
+            return false;
+        }
+        return true;
+    }
+}
+
+struct rdbcompare_loop {
+    rdbcompare_ctx* ctx = nullptr;  // Контекст запросов цикла (nullptr - по умолчанию)
+    CURLM* multi = nullptr;
+    rdbcompare_socket_cb socket_cb = nullptr;
+    rdbcompare_timer_cb timer_cb = nullptr;
+    void* userdata = nullptr;
+    int next_id = 1;
+    std::map<int, std::unique_ptr<rdbcompare::LoopRequest>> requests;
+    std::map<CURL*, rdbcompare::LoopRequest*> transfers; // Активные передачи и их запросы
+};
+
+namespace rdbcompare {
+
+    int loop_socket_callback(CURL*, curl_socket_t s, int what, void* userp, void*) {
+        // Сообщает внешнему реактору, какие события ждать на сокете
+        auto* loop = static_cast<rdbcompare_loop*>(userp);
+        int events = RDBCOMPARE_POLL_NONE;
+        switch (what) {
+            case CURL_POLL_IN: events = RDBCOMPARE_POLL_IN; break;
+            case CURL_POLL_OUT: events = RDBCOMPARE_POLL_OUT; break;
+            case CURL_POLL_INOUT: events = RDBCOMPARE_POLL_IN | RDBCOMPARE_POLL_OUT; break;
+            case CURL_POLL_REMOVE: events = RDBCOMPARE_POLL_REMOVE; break;
+        }
+        if (loop->socket_cb) {
+            loop->socket_cb(static_cast<int>(s), events, loop->userdata);
+        }
+        return 0;
+    }
+
+    int loop_timer_callback(CURLM*, long timeout_ms, void* userp) {
+        auto* loop = static_cast<rdbcompare_loop*>(userp);
+        if (loop->timer_cb) {
+            loop->timer_cb(timeout_ms, loop->userdata);
+        }
+        return 0;
+    }
+
+    void loop_remove_transfer(rdbcompare_loop* loop, LoopRequest& req, size_t index) {
+        CURL* easy = req.handles[index];
+        if (!easy) {
+            return;
+        }
+        loop->transfers.erase(easy);
+        count_transfer(easy, req.responses[index].size());
+        curl_multi_remove_handle(loop->multi, easy);
+        curl_easy_cleanup(easy);
+        req.handles[index] = nullptr;
+        req.remaining--;
+    }
+
+    void loop_finish_request(rdbcompare_loop* loop, int id) {
+        // Запрос удаляется из цикла до вызова обработчика, чтобы из него можно было ставить новые
+        auto it = loop->requests.find(id);
+        std::unique_ptr<LoopRequest> req = std::move(it->second);
+        loop->requests.erase(it);
+        for (size_t i = 0; i < req->handles.size(); ++i) {
+            loop_remove_transfer(loop, *req, i);
+        }
+
+        const char* error = req->error.empty() ? nullptr : req->error.c_str();
+        if (req->fetch_cb) {
+            const std::string& data = req->responses[0];
+            req->fetch_cb(req->id, req->branches[0].c_str(), error ? nullptr : data.c_str(), error ? 0 : data.size(), error, req->userdata);
+            return;
+        }
+
+        if (error) {
+            req->compare_cb(req->id, nullptr, error, req->userdata);
+            return;
+        }
+        char* result = rdbcompare_ctx_compare_packages(loop->ctx, req->responses[0].c_str(), req->responses[1].c_str(), nullptr);
+        req->compare_cb(req->id, result, result ? nullptr : "Failed to compare package lists", req->userdata);
+        free(result);
+    }
+
+    void loop_process_completed(rdbcompare_loop* loop) {
+        // Сообщения разбираются по одному: завершение запроса снимает его остальные передачи
+        // вместе с их сообщениями, а обработчик может поставить новый запрос с тем же адресом
+        // дескриптора, поэтому заранее собранный список мог бы указывать на чужую передачу
+        int queued = 0;
+        while (CURLMsg* msg = curl_multi_info_read(loop->multi, &queued)) {
+            if (msg->msg != CURLMSG_DONE) {
+                continue;
+            }
+            CURL* easy = msg->easy_handle;
+            CURLcode res = msg->data.result;
+            auto it = loop->transfers.find(easy);
+            if (it == loop->transfers.end()) {
+                continue;
+            }
+            LoopRequest& req = *it->second;
+            size_t index = 0;
+            while (req.handles[index] != easy) {
+                ++index;
+            }
+
+            long http_code = 0;
+            curl_off_t first_byte_us = 0;
+            curl_easy_getinfo(easy, CURLINFO_RESPONSE_CODE, &http_code);
+            curl_easy_getinfo(easy, CURLINFO_STARTTRANSFER_TIME_T, &first_byte_us);
+            const std::string& branch = req.branches[index];
+            bool transient = res != CURLE_OK || http_code >= 500;
+            if (res == CURLE_OPERATION_TIMEDOUT) {
+                stats().request_timeouts.fetch_add(1, std::memory_order_relaxed);
+            }
+            size_t& attempt = req.attempts[index];
+            endpoints().report(req.bases[attempt], !transient, first_byte_us / 1000.0, req.responses[index].size());
+            if (transient && attempt + 1 < req.bases.size()) {
+                // Та же передача повторяется на следующем зеркале
+                log_warning("http.failover") << req.bases[attempt] << " failed, trying " << req.bases[attempt + 1];
+                stats().endpoint_failovers.fetch_add(1, std::memory_order_relaxed);
+                ++attempt;
+                count_transfer(easy, req.responses[index].size());
+                curl_multi_remove_handle(loop->multi, easy);
+                req.responses[index].clear();
+                setup_transfer(easy, req.bases[attempt] + make_package_path(branch.c_str()), &req.responses[index]);
+                curl_multi_add_handle(loop->multi, easy);
+                continue;
+            }
+            if (res != CURLE_OK) {
+                req.error = std::string("HTTP request failed: ") + curl_easy_strerror(res);
+            } else if (http_code == 404) {
+                req.error = "Ветка '" + branch + "' не найдена (HTTP 404)";
+            } else if (http_code != 200) {
+                req.error = "Failed to fetch packages for '" + branch + "', HTTP code: " + std::to_string(http_code);
+            } else {
+                branch_cache().remember(branch);
+            }
+
+            loop_remove_transfer(loop, req, index);
+            if (!req.error.empty() || req.remaining == 0) {
+                loop_finish_request(loop, req.id);
+            }
+        }
+    }
+
+    int loop_add_request(rdbcompare_loop* loop, std::unique_ptr<LoopRequest> req) {
+        req->id = loop->next_id++;
+        req->responses.resize(req->branches.size());
+        req->attempts.assign(req->branches.size(), 0);
+        req->bases = endpoints().candidates(false);  // Замер задержки заблокировал бы цикл
+        for (size_t i = 0; i < req->branches.size(); ++i) {
+            CURL* easy = curl_easy_init();
+            if (!easy) {
+                log_error("http.init") << "Failed to initialize curl";
+                for (size_t j = 0; j < i; ++j) {
+                    loop_remove_transfer(loop, *req, j);
+                }
+                return -1;
+            }
+            setup_transfer(easy, req->bases[0] + make_package_path(req->branches[i].c_str()), &req->responses[i]);
+            req->handles.push_back(easy);
+            req->remaining++;
+            loop->transfers[easy] = req.get();
+            curl_multi_add_handle(loop->multi, easy);
+        }
+        int id = req->id;
+        loop->requests[id] = std::move(req);
+        return id;
+    }
+}
+
+extern "C" {
+
+    rdbcompare_loop_t* rdbcompare_loop_new(rdbcompare_socket_cb socket_cb, rdbcompare_timer_cb timer_cb, void* userdata) {
+        return rdbcompare_ctx_loop_new(nullptr, socket_cb, timer_cb, userdata);
+    }
+
+    rdbcompare_loop_t* rdbcompare_ctx_loop_new(rdbcompare_ctx_t* ctx, rdbcompare_socket_cb socket_cb,
+                                               rdbcompare_timer_cb timer_cb, void* userdata) {
+        if (!socket_cb || !timer_cb) {
+            rdbcompare::log_error("loop.init") << "Socket and timer callbacks are required";
+            return nullptr;
+        }
+        CURLM* multi = curl_multi_init();
+        if (!multi) {
+            rdbcompare::log_error("loop.init") << "Failed to initialize curl multi handle";
+            return nullptr;
+        }
+        auto* loop = new rdbcompare_loop;
+        loop->ctx = ctx;
+        loop->multi = multi;
+        loop->socket_cb = socket_cb;
+        loop->timer_cb = timer_cb;
+        loop->userdata = userdata;
+        curl_multi_setopt(multi, CURLMOPT_SOCKETFUNCTION, rdbcompare::loop_socket_callback);
+        curl_multi_setopt(multi, CURLMOPT_SOCKETDATA, loop);
+        curl_multi_setopt(multi, CURLMOPT_TIMERFUNCTION, rdbcompare::loop_timer_callback);
+        curl_multi_setopt(multi, CURLMOPT_TIMERDATA, loop);
+        // Запросы цикла (и серии сравнений) к одному серверу идут потоками одного соединения HTTP/2
+        curl_multi_setopt(multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+        return loop;
+    }
+
+    void rdbcompare_loop_free(rdbcompare_loop_t* loop) {
+        if (!loop) {
+            return;
+        }
+        rdbcompare::ContextScope scope(loop->ctx);
+        for (auto& pair : loop->requests) {
+            for (size_t i = 0; i < pair.second->handles.size(); ++i) {
+                rdbcompare::loop_remove_transfer(loop, *pair.second, i);
+            }
+        }
+        loop->requests.clear();
+        curl_multi_cleanup(loop->multi);
+        delete loop;
+    }
+
+    int rdbcompare_loop_fetch(rdbcompare_loop_t* loop, const char* branch, rdbcompare_fetch_cb cb, void* userdata) {
+        if (!loop || !cb) {
+            return -1;
+        }
+        rdbcompare::ContextScope scope(loop->ctx);
+        if (!rdbcompare::check_loop_branch(branch)) {
+            return -1;
+        }
+        auto req = std::make_unique<rdbcompare::LoopRequest>();
+        req->branches = {branch};
+        req->fetch_cb = cb;
+        req->userdata = userdata;
+        return rdbcompare::loop_add_request(loop, std::move(req));
+    }
+
+    int rdbcompare_loop_compare(rdbcompare_loop_t* loop, const char* branch1, const char* branch2, rdbcompare_compare_cb cb, void* userdata) {
+        if (!loop || !cb) {
+            return -1;
+        }
+        rdbcompare::ContextScope scope(loop->ctx);
+        if (!rdbcompare::check_loop_branch(branch1) || !rdbcompare::check_loop_branch(branch2)) {
+            return -1;
+        }
+        auto req = std::make_unique<rdbcompare::LoopRequest>();
+        req->branches = {branch1, branch2};
+        req->compare_cb = cb;
+        req->userdata = userdata;
+        return rdbcompare::loop_add_request(loop, std::move(req));
+    }
+
+    void rdbcompare_loop_socket_ready(rdbcompare_loop_t* loop, int fd, int events) {
+        if (!loop) {
+            return;
+        }
+        rdbcompare::ContextScope scope(loop->ctx);
+        int mask = 0;
+        if (events & RDBCOMPARE_POLL_IN) mask |= CURL_CSELECT_IN;
+        if (events & RDBCOMPARE_POLL_OUT) mask |= CURL_CSELECT_OUT;
+        if (events & RDBCOMPARE_POLL_ERROR) mask |= CURL_CSELECT_ERR;
+        int running = 0;
+        curl_multi_socket_action(loop->multi, static_cast<curl_socket_t>(fd), mask, &running);
+        rdbcompare::loop_process_completed(loop);
+    }
+
+    void rdbcompare_loop_timeout(rdbcompare_loop_t* loop) {
+        if (!loop) {
+            return;
+        }
+        rdbcompare::ContextScope scope(loop->ctx);
+        int running = 0;
+        curl_multi_socket_action(loop->multi, CURL_SOCKET_TIMEOUT, 0, &running);
+        rdbcompare::loop_process_completed(loop);
+    }
+
+    void rdbcompare_loop_cancel(rdbcompare_loop_t* loop, int request_id) {
+        if (!loop) {
+            return;
+        }
+        auto it = loop->requests.find(request_id);
+        if (it == loop->requests.end()) {
+            return;
+        }
+        rdbcompare::ContextScope scope(loop->ctx);
+        for (size_t i = 0; i < it->second->handles.size(); ++i) {
+            rdbcompare::loop_remove_transfer(loop, *it->second, i);
+        }
+        loop->requests.erase(it);
+    }
+
+    int rdbcompare_loop_pending(const rdbcompare_loop_t* loop) {
+        return loop ? static_cast<int>(loop->requests.size()) : 0;
+    }
 
 }
@@ -0,0 +1,251 @@
+#!/usr/bin/env python3
+"""Сквозной замер времени сравнения веток против локального mock_rdb_server.py.
+
+Для каждого сетевого профиля запускается сервер-имитатор с нужной задержкой и
+пропускной способностью, после чего замеряются:
+  cli     - запуск rdb_compare (отдельный процесс, как у пользователя);
+  library - fetch_package_list x2 + compare_packages через ctypes в одном процессе;
+  gui     - последовательность ComparisonWorker (загрузка и rdbcompare_compare в
+            рабочем потоке) и обход результата курсором, как в MainWindow.
+Сеть не нужна: всё работает на 127.0.0.1.
+
+Пример:
+    make && tests/bench_e2e.py --profiles lan,wan --repeat 5
+"""
+import argparse
+import ctypes
+import json
+import os
+import statistics
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+ROOT = os.path.dirname(HERE)
+
+# Сетевые профили: параметры mock_rdb_server.py
+PROFILES = {
+    "lan":   ["--latency", "1"],
+    "wan":   ["--latency", "40", "--jitter", "5", "--handshake-latency", "80", "--bandwidth", "4096"],
+    "slow":  ["--latency", "150", "--jitter", "20", "--handshake-latency", "300", "--bandwidth", "512"],
+    "lossy": ["--latency", "40", "--handshake-latency", "80", "--bandwidth", "4096", "--error-rate", "0.05"],
+    # wan со сжатием ответов: сравнение с wan показывает выигрыш Accept-Encoding
+    "wan-gz": ["--latency", "40", "--jitter", "5", "--handshake-latency", "80", "--bandwidth", "4096",
+               "--encodings", "all"],
+}
+
+
+class MockServer:
+    """mock_rdb_server.py в отдельном процессе, чтобы его потоки не мешали замерам."""
+
+    def __init__(self, extra_args: list[str], packages: int):
+        self.tmp = tempfile.TemporaryDirectory(prefix="rdbcompare-bench-")
+        port_file = os.path.join(self.tmp.name, "api")
+        self.process = subprocess.Popen(
+            [sys.executable, os.path.join(HERE, "mock_rdb_server.py"), "--port", "0", "--quiet",
+             "--port-file", port_file, "--packages", str(packages)] + extra_args)
+        deadline = time.monotonic() + 30
+        while not os.path.exists(port_file):
+            if self.process.poll() is not None or time.monotonic() > deadline:
+                raise RuntimeError("mock_rdb_server.py не запустился")
+            time.sleep(0.05)
+        with open(port_file) as f:
+            self.api_base = f.read().strip()
+
+    def stats(self) -> dict:
+        from urllib.request import urlopen
+        with urlopen(self.api_base.rsplit("/", 1)[0] + "/__mock/stats") as response:
+            return json.load(response)
+
+    def close(self):
+        self.process.terminate()
+        self.process.wait()
+        self.tmp.cleanup()
+
+
+class Library:
+    def __init__(self, path: str):
+        self.lib = ctypes.CDLL(path)
+        self.libc = ctypes.CDLL(None)
+        self.libc.free.argtypes = [ctypes.c_void_p]
+        self.lib.fetch_package_list.restype = ctypes.c_void_p
+        self.lib.fetch_package_list.argtypes = [ctypes.c_char_p]
+        self.lib.compare_packages.restype = ctypes.c_void_p
+        self.lib.compare_packages.argtypes = [ctypes.c_void_p, ctypes.c_void_p]
+        self.lib.rdbcompare_compare.restype = ctypes.c_void_p
+        self.lib.rdbcompare_compare.argtypes = [ctypes.c_void_p, ctypes.c_void_p, ctypes.c_void_p]
+        self.lib.rdbcompare_result_free.argtypes = [ctypes.c_void_p]
+        self.lib.rdbcompare_result_count.restype = ctypes.c_size_t
+        self.lib.rdbcompare_result_count.argtypes = [ctypes.c_void_p, ctypes.c_char_p, ctypes.c_int]
+        self.lib.rdbcompare_result_seek.argtypes = [ctypes.c_void_p, ctypes.c_char_p, ctypes.c_int]
+        self.lib.rdbcompare_result_next.argtypes = [ctypes.c_void_p, ctypes.c_void_p]
+        self.lib.rdbcompare_set_option.argtypes = [ctypes.c_char_p, ctypes.c_char_p]
+        self.lib.rdbcompare_init()
+
+    def set_option(self, name: str, value: str):
+        if self.lib.rdbcompare_set_option(name.encode(), value.encode()) != 0:
+            raise RuntimeError(f"rdbcompare_set_option({name}) не поддерживается библиотекой")
+
+    def fetch(self, branch: str) -> int:
+        data = self.lib.fetch_package_list(branch.encode())
+        if not data:
+            raise RuntimeError(f"fetch_package_list({branch}) вернула NULL")
+        return data
+
+
+def run_library(lib: Library, branch1: str, branch2: str):
+    data1 = lib.fetch(branch1)
+    data2 = None
+    try:
+        data2 = lib.fetch(branch2)
+        result = lib.lib.compare_packages(data1, data2)
+        if not result:
+            raise RuntimeError("compare_packages вернула NULL")
+        lib.libc.free(result)
+    finally:
+        lib.libc.free(data1)
+        if data2:
+            lib.libc.free(data2)
+
+
+def run_gui_worker(lib: Library, branch1: str, branch2: str):
+    # ComparisonWorker::doComparisonWork в отдельном потоке, затем работа MainWindow
+    box = {}
+
+    def worker():
+        try:
+            data1 = lib.fetch(branch1)
+            try:
+                data2 = lib.fetch(branch2)
+                try:
+                    box["result"] = lib.lib.rdbcompare_compare(data1, data2, None)
+                finally:
+                    lib.libc.free(data2)
+            finally:
+                lib.libc.free(data1)
+        except Exception as e:  # Передаём ошибку в основной поток, как comparisonError
+            box["error"] = e
+
+    thread = threading.Thread(target=worker)
+    thread.start()
+    thread.join()
+    if "error" in box:
+        raise box["error"]
+    result = box.get("result")
+    if not result:
+        raise RuntimeError("rdbcompare_compare вернула NULL")
+    try:
+        for category in range(3):  # updateCountsDisplay
+            lib.lib.rdbcompare_result_count(result, None, category)
+        entry = ctypes.create_string_buffer(256)  # populateTable: обход всех записей
+        lib.lib.rdbcompare_result_seek(result, None, -1)
+        while lib.lib.rdbcompare_result_next(result, entry):
+            pass
+    finally:
+        lib.lib.rdbcompare_result_free(result)
+
+
+def run_cli(cli: str, lib_path: str, api_base: str, cache_dir: str, options: dict, branch1: str, branch2: str):
+    env = dict(os.environ, RDBCOMPARE_API_BASE=api_base, RDBCOMPARE_CACHE_DIR=cache_dir,
+               RDBCOMPARE_LIBRARY=lib_path)
+    env.update({f"RDBCOMPARE_{name.upper()}": value for name, value in options.items()})
+    completed = subprocess.run([sys.executable, cli, branch1, branch2, "-j"], env=env,
+                               stdout=subprocess.DEVNULL, stderr=subprocess.PIPE)
+    if completed.returncode != 0:
+        raise RuntimeError(f"rdb_compare завершилась с кодом {completed.returncode}: "
+                           f"{completed.stderr.decode(errors='replace').strip()[-300:]}")
+
+
+def measure(fn, repeat: int) -> tuple[list[float], int]:
+    times, failures = [], 0
+    for _ in range(repeat):
+        started = time.perf_counter()
+        try:
+            fn()
+        except RuntimeError as e:
+            failures += 1
+            sys.stderr.write(f"  ошибка: {e}\n")
+            continue
+        times.append(time.perf_counter() - started)
+    return times, failures
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Сквозной замер rdbcompare против локального RDB-имитатора.")
+    parser.add_argument("--lib", default=os.path.join(ROOT, "build", "lib", "librdbcompare.so"))
+    parser.add_argument("--cli", default=os.path.join(ROOT, "src", "cli", "rdb_compare_cli.py"))
+    parser.add_argument("--profiles", default="lan,wan,wan-gz,slow",
+                        help=f"Профили через запятую: {', '.join(PROFILES)}.")
+    parser.add_argument("--modes", default="cli,library,gui")
+    parser.add_argument("--repeat", type=int, default=3)
+    parser.add_argument("--packages", type=int, default=20000, help="Имён пакетов в синтетической ветке.")
+    parser.add_argument("--branches", nargs=2, default=["sisyphus", "p11"], metavar=("BRANCH1", "BRANCH2"))
+    parser.add_argument("--server-args", default="", help="Дополнительные аргументы mock_rdb_server.py.")
+    parser.add_argument("--option", action="append", default=[], metavar="NAME=VALUE",
+                        help="Настройка библиотеки для всех режимов (например, sharded=1); можно повторять.")
+    parser.add_argument("--json", action="store_true", help="Вывести результаты в JSON.")
+    args = parser.parse_args()
+    options = dict(option.split("=", 1) for option in args.option)
+
+    lib_path = os.path.abspath(args.lib)
+    lib = Library(lib_path)
+    cache_dir = tempfile.mkdtemp(prefix="rdbcompare-bench-cache-")
+    lib.set_option("cache_dir", cache_dir)
+    for name, value in options.items():
+        lib.set_option(name, value)
+    modes = [m for m in args.modes.split(",") if m]
+    rows = []
+
+    for profile in [p for p in args.profiles.split(",") if p]:
+        if profile not in PROFILES:
+            sys.exit(f"Неизвестный профиль: {profile}")
+        server = MockServer(PROFILES[profile] + args.server_args.split(), args.packages)
+        try:
+            lib.set_option("api_base", server.api_base)
+            run_library(lib, *args.branches)  # Прогрев: генерация данных сервером и список веток
+            for mode in modes:
+                sys.stderr.write(f"{profile}/{mode}...\n")
+                if mode == "cli":
+                    fn = lambda: run_cli(args.cli, lib_path, server.api_base, cache_dir, options, *args.branches)
+                elif mode == "library":
+                    fn = lambda: run_library(lib, *args.branches)
+                elif mode == "gui":
+                    fn = lambda: run_gui_worker(lib, *args.branches)
+                else:
+                    sys.exit(f"Неизвестный режим: {mode}")
+                before = server.stats()
+                times, failures = measure(fn, args.repeat)
+                after = server.stats()
+                rows.append({
+                    "profile": profile, "mode": mode, "runs": len(times), "failures": failures,
+                    "median_s": statistics.median(times) if times else None,
+                    "min_s": min(times) if times else None,
+                    "max_s": max(times) if times else None,
+                    # Счётчики сервера за все прогоны режима
+                    # (соединение самого запроса счётчиков вычитается)
+                    "connections": after["connections"] - before["connections"] - 1,
+                    "requests": after["requests"] - before["requests"],
+                    "bytes_sent": after["bytes_sent"] - before["bytes_sent"],
+                    "bytes_decoded": after["bytes_decoded"] - before["bytes_decoded"],
+                })
+        finally:
+            server.close()
+
+    if args.json:
+        print(json.dumps(rows, indent=2))
+        return
+    print(f"{'profile':<8} {'mode':<8} {'runs':>4} {'fail':>4} {'median,s':>9} {'min,s':>8} {'max,s':>8} "
+          f"{'conns':>6} {'reqs':>5} {'MiB sent':>9} {'MiB body':>9}")
+    for row in rows:
+        fmt = lambda v: f"{v:.3f}" if v is not None else "-"
+        print(f"{row['profile']:<8} {row['mode']:<8} {row['runs']:>4} {row['failures']:>4} "
+              f"{fmt(row['median_s']):>9} {fmt(row['min_s']):>8} {fmt(row['max_s']):>8} "
+              f"{row['connections']:>6} {row['requests']:>5} {row['bytes_sent'] / 1048576:>9.1f} "
+              f"{row['bytes_decoded'] / 1048576:>9.1f}")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,100 @@
+#!/usr/bin/env python3
+"""Проверка: результат сравнения не зависит от порядка записей во входных данных.
+
+Ветка с несколькими сборками одного имени в архитектуре (разные EVR, равные для
+rpmvercmp "1.0" и "1.00", разные эпохи) подаётся в compare_packages в исходном и
+переставленных порядках. JSON результата и прирост счётчика duplicate_builds
+должны совпадать. Сеть не нужна.
+
+Пример:
+    make && tests/check_build_order.py --permutations 50
+"""
+import argparse
+import ctypes
+import json
+import os
+import random
+import sys
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+ROOT = os.path.dirname(HERE)
+
+# Сборки одного имени: (эпоха, версия, релиз); первые две пары равны для rpmvercmp
+BUILDS = {
+    "dup-equal": [(0, "1.0", "alt1"), (0, "1.00", "alt1"), (0, "1.000", "alt1")],
+    "dup-newer": [(0, "2.1", "alt1"), (0, "2.10", "alt1"), (0, "2.9", "alt3")],
+    "dup-epoch": [(1, "0.5", "alt1"), (0, "9.0", "alt1"), ("1", "0.5", "alt1")],
+    "dup-release": [(0, "3.0", "alt1.1"), (0, "3.0", "alt1"), (0, "3.0", "alt01.1")],
+    "single": [(0, "1.0", "alt1")],
+}
+ARCHES = ["x86_64", "noarch", "aarch64"]
+
+
+def packages(builds: dict) -> list[dict]:
+    return [{"name": name, "epoch": epoch, "version": version, "release": release, "arch": arch}
+            for arch in ARCHES for name, evrs in builds.items() for epoch, version, release in evrs]
+
+
+class Library:
+    def __init__(self, path: str):
+        self.lib = ctypes.CDLL(path)
+        self.libc = ctypes.CDLL(None)
+        self.libc.free.argtypes = [ctypes.c_void_p]
+        self.lib.compare_packages.restype = ctypes.c_void_p
+        self.lib.compare_packages.argtypes = [ctypes.c_char_p, ctypes.c_char_p]
+        self.lib.rdbcompare_stats_json.restype = ctypes.c_void_p
+        self.lib.rdbcompare_set_option.argtypes = [ctypes.c_char_p, ctypes.c_char_p]
+        self.lib.rdbcompare_init()
+        # Без кэшей результатов: каждое сравнение разбирает входные данные заново
+        for name, value in [("memo_size", "0"), ("persist_memo", "0"), ("fragment_cache_bytes", "0")]:
+            if self.lib.rdbcompare_set_option(name.encode(), value.encode()) != 0:
+                raise RuntimeError(f"rdbcompare_set_option({name}) не поддерживается библиотекой")
+
+    def _take(self, pointer) -> str:
+        if not pointer:
+            raise RuntimeError("библиотека вернула NULL")
+        try:
+            return ctypes.string_at(pointer).decode("utf-8")
+        finally:
+            self.libc.free(pointer)
+
+    def duplicate_builds(self) -> int:
+        return json.loads(self._take(self.lib.rdbcompare_stats_json()))["duplicate_builds"]
+
+    def compare(self, branch1: str, branch2: str) -> tuple[str, int]:
+        before = self.duplicate_builds()
+        result = self._take(self.lib.compare_packages(branch1.encode(), branch2.encode()))
+        return result, self.duplicate_builds() - before
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Проверка независимости сравнения от порядка записей.")
+    parser.add_argument("--lib", default=os.path.join(ROOT, "build", "lib", "librdbcompare.so"))
+    parser.add_argument("--permutations", type=int, default=20)
+    parser.add_argument("--seed", type=int, default=1)
+    args = parser.parse_args()
+
+    lib = Library(os.path.abspath(args.lib))
+    rng = random.Random(args.seed)
+    records = packages(BUILDS)
+    other = json.dumps({"packages": packages({name: evrs[:1] for name, evrs in BUILDS.items()})})
+
+    orders = [list(records), list(reversed(records))]
+    for _ in range(args.permutations):
+        orders.append(rng.sample(records, len(records)))
+
+    expected = None
+    for index, order in enumerate(orders):
+        branch = json.dumps({"packages": order})
+        outcome = (lib.compare(branch, other), lib.compare(other, branch))
+        if expected is None:
+            expected = outcome
+            if outcome[0][1] == 0:
+                sys.exit("ошибка: повторные сборки не учтены в duplicate_builds")
+        elif outcome != expected:
+            sys.exit(f"ошибка: порядок записей №{index} меняет результат сравнения")
+    print(f"ok: {len(orders)} порядков, duplicate_builds за сравнение: {expected[0][1]}")
+
+
+if __name__ == "__main__":
+    main()
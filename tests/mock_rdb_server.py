@@ -0,0 +1,419 @@
+#!/usr/bin/env python3
+"""Локальный сервер, имитирующий REST API rdb.altlinux.org.
+
+Отдаёт branch_tree и branch_binary_packages из записанных файлов или
+синтетические данные и умеет имитировать сеть: задержку, ограничение
+пропускной способности, chunked-передачу, сжатие и ошибки. Ответы со
+списками пакетов несут ETag и на совпавший If-None-Match отвечают 304;
+GET /__mock/touch/<ветка> меняет синтетические данные ветки (новая ревизия).
+
+Пример:
+    tests/mock_rdb_server.py --port 8080 --latency 40 --bandwidth 2048
+    RDBCOMPARE_API_BASE=http://127.0.0.1:8080/api rdb_compare sisyphus p11
+"""
+import argparse
+import gzip
+import hashlib
+import json
+import os
+import random
+import socket
+import sys
+import threading
+import time
+import zlib
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+from urllib.parse import parse_qs, urlsplit
+
+DEFAULT_BRANCHES = ["sisyphus", "p11", "p10", "p9"]
+DEFAULT_ARCHES = ["x86_64", "i586", "aarch64", "noarch"]
+
+
+# --- Данные ---
+
+def synthetic_packages(branch: str, branches: list[str], count: int, arches: list[str], seed: int,
+                       revision: int = 0) -> bytes:
+    # Детерминированный список пакетов ветки. Ветки из начала списка "новее":
+    # у них чаще подняты версии; часть имён есть не во всех ветках. Каждая
+    # ревизия ветки (/__mock/touch) - другой набор отставаний и пропусков
+    age = branches.index(branch) if branch in branches else len(branches)
+    rng = random.Random(f"{seed}:{branch}" + (f":r{revision}" if revision else ""))
+    binary_arches = [arch for arch in arches if arch != "noarch"] or arches
+    packages = []
+    for i in range(count):
+        name_rng = random.Random(f"{seed}:pkg:{i}")  # Общая для всех веток основа пакета
+        prefix = name_rng.choice(["lib", "python3-module-", "perl-", "kernel-modules-", "gst-plugins-", ""])
+        name = f"{prefix}pkg{i:05d}"
+        if rng.random() < 0.03:
+            continue  # Пакета нет в этой ветке
+        major, minor = name_rng.randint(0, 9), name_rng.randint(0, 30)
+        # Каждая более старая ветка с вероятностью 1/4 отстаёт на одну версию
+        lag = sum(1 for _ in range(age) if rng.random() < 0.25)
+        version = f"{major}.{max(minor - lag, 0)}.{name_rng.randint(0, 5)}"
+        release = f"alt{name_rng.randint(1, 3)}" + ("" if age == 0 else f".p{age}")
+        epoch = name_rng.choice([0] * 9 + [1])
+        targets = ["noarch"] if "noarch" in arches and name_rng.random() < 0.3 else binary_arches
+        for arch in targets:
+            packages.append({
+                "name": name, "epoch": epoch, "version": version,
+                "release": release, "arch": arch, "disttag": f"{branch}+1", "buildtime": 1700000000 + i,
+                "source": name,
+            })
+    return json.dumps({"request_args": {"branch": branch}, "length": len(packages), "packages": packages}).encode()
+
+
+class Payloads:
+    """Тела ответов: из каталога записей или синтетические; готовые байты кэшируются."""
+
+    def __init__(self, args):
+        self.args = args
+        self.lock = threading.Lock()
+        self.cache: dict[tuple, bytes] = {}
+        self.revisions: dict[str, int] = {}
+
+    def branch_tree(self) -> bytes:
+        recorded = self._recorded("branch_tree")
+        if recorded is not None:
+            return recorded
+        return json.dumps({"branches": self.args.branches}).encode()
+
+    def packages(self, branch: str, arch: str | None) -> bytes | None:
+        key = (branch, arch)
+        with self.lock:
+            if key not in self.cache:
+                body = self._recorded(branch)
+                if body is None:
+                    if branch not in self.args.branches:
+                        return None
+                    body = synthetic_packages(branch, self.args.branches, self.args.packages,
+                                              self.args.arches, self.args.seed, self.revisions.get(branch, 0))
+                if arch:
+                    data = json.loads(body)
+                    data["packages"] = [pkg for pkg in data.get("packages", []) if pkg.get("arch") == arch]
+                    data["length"] = len(data["packages"])
+                    body = json.dumps(data).encode()
+                self.cache[key] = body
+            return self.cache[key]
+
+    def touch(self, branch: str):
+        # Следующая ревизия ветки: её ответы генерируются заново
+        with self.lock:
+            self.revisions[branch] = self.revisions.get(branch, 0) + 1
+            self.cache = {key: body for key, body in self.cache.items() if key[0] != branch}
+
+    def archs(self, branch: str) -> bytes | None:
+        # Как /site/all_pkgset_archs: архитектуры ветки с числом пакетов
+        body = self.packages(branch, None)
+        if body is None:
+            return None
+        counts: dict[str, int] = {}
+        for pkg in json.loads(body).get("packages", []):
+            counts[pkg.get("arch")] = counts.get(pkg.get("arch"), 0) + 1
+        archs = [{"arch": arch, "count": count} for arch, count in sorted(counts.items()) if arch]
+        return json.dumps({"request_args": {"branch": branch}, "length": len(archs), "archs": archs}).encode()
+
+    def _recorded(self, name: str) -> bytes | None:
+        # Записанный ответ: <data-dir>/<name>.json или <name>.json.gz
+        if not self.args.data_dir:
+            return None
+        path = os.path.join(self.args.data_dir, f"{name}.json")
+        if os.path.exists(path):
+            with open(path, "rb") as f:
+                return f.read()
+        if os.path.exists(path + ".gz"):
+            with gzip.open(path + ".gz", "rb") as f:
+                return f.read()
+        return None
+
+
+# --- HTTP ---
+
+class Stats:
+    def __init__(self):
+        self.lock = threading.Lock()
+        self.values = {"connections": 0, "requests": 0, "errors_injected": 0, "resets_injected": 0,
+                       "bytes_sent": 0, "bytes_decoded": 0, "not_modified": 0}
+
+    def add(self, name: str, value: int = 1):
+        with self.lock:
+            self.values[name] += value
+
+    def snapshot(self) -> dict:
+        with self.lock:
+            return dict(self.values)
+
+
+# br и zstd - только при установленных модулях brotli и zstandard
+try:
+    import brotli
+except ImportError:
+    brotli = None
+try:
+    import zstandard
+except ImportError:
+    zstandard = None
+
+ENCODINGS = ["gzip", "deflate"] + (["br"] if brotli else []) + (["zstd"] if zstandard else [])
+
+
+def compress(body: bytes, encoding: str) -> bytes:
+    if encoding == "gzip":
+        return gzip.compress(body, compresslevel=6)
+    if encoding == "deflate":
+        return zlib.compress(body, 6)
+    if encoding == "br":
+        return brotli.compress(body, quality=5)
+    if encoding == "zstd":
+        return zstandard.ZstdCompressor(level=3).compress(body)
+    return body
+
+
+class MockRdbHandler(BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"  # keep-alive, как у настоящего сервера
+    server_version = "mock-rdb/1.0"
+
+    def setup(self):
+        super().setup()
+        self.server.stats.add("connections")
+        # Установка соединения (TCP + TLS) стоит нескольких RTT
+        self._sleep_ms(self.server.args.handshake_latency)
+
+    def log_message(self, fmt, *fmt_args):
+        if not self.server.args.quiet:
+            sys.stderr.write("mock-rdb: %s\n" % (fmt % fmt_args))
+
+    def do_GET(self):
+        args = self.server.args
+        stats = self.server.stats
+        url = urlsplit(self.path)
+        query = parse_qs(url.query)
+        base = args.prefix.rstrip("/")
+
+        if url.path == "/__mock/stats":
+            # Служебный запрос счётчиков в requests не учитывается
+            self._send(200, json.dumps(stats.snapshot()).encode(), shaped=False)
+            return
+        if url.path.startswith("/__mock/touch/"):
+            self.server.payloads.touch(url.path.rsplit("/", 1)[-1])
+            self._send(200, b"{}", shaped=False)
+            return
+        stats.add("requests")
+
+        self._sleep_ms(args.latency + (random.uniform(-args.jitter, args.jitter) if args.jitter else 0))
+
+        headers = {}
+
+        if url.path == f"{base}/export/branch_tree":
+            body = self.server.payloads.branch_tree()
+        elif url.path.startswith(f"{base}/export/branch_binary_packages/"):
+            if self._inject_error():
+                return
+            branch = url.path.rsplit("/", 1)[-1]
+            body = self.server.payloads.packages(branch, query.get("arch", [None])[0])
+            if body is None:
+                self._send(404, json.dumps({"message": f"Branch {branch} not found"}).encode())
+                return
+            if not args.no_etag:
+                headers["ETag"] = '"%s"' % hashlib.blake2b(body, digest_size=8).hexdigest()
+                if headers["ETag"] in [tag.strip() for tag in self.headers.get("If-None-Match", "").split(",")]:
+                    stats.add("not_modified")
+                    self._send(304, b"", shaped=False, headers=headers)
+                    return
+        elif url.path == f"{base}/site/all_pkgset_archs":
+            branch = query.get("branch", [""])[0]
+            body = self.server.payloads.archs(branch)
+            if body is None:
+                self._send(404, json.dumps({"message": f"Branch {branch} not found"}).encode())
+                return
+        else:
+            self._send(404, b'{"message": "not found"}')
+            return
+        self._send(200, body, headers=headers)
+
+    def do_HEAD(self):
+        # Замер задержки зеркал клиентом: тот же ответ без тела
+        self.do_GET()
+
+    def _inject_error(self) -> bool:
+        # Ошибки отдаются только на запросы пакетов, чтобы проверка ветки проходила
+        args = self.server.args
+        with self.server.counter_lock:
+            self.server.package_requests += 1
+            failing_first = self.server.package_requests <= args.fail_first
+        if failing_first or (args.error_rate and random.random() < args.error_rate):
+            self.server.stats.add("errors_injected")
+            self._send(args.error_status, b'{"message": "injected error"}')
+            return True
+        return False
+
+    def _send(self, status: int, body: bytes, shaped: bool = True, headers: dict | None = None):
+        args = self.server.args
+        encoding = self._choose_encoding() if shaped else None
+        payload = self.server.compressed(body, encoding) if encoding else body
+
+        self.send_response(status)
+        self.send_header("Content-Type", "application/json")
+        for name, value in (headers or {}).items():
+            self.send_header(name, value)
+        if encoding:
+            self.send_header("Content-Encoding", encoding)
+            self.send_header("Vary", "Accept-Encoding")
+        chunked = shaped and args.chunked
+        if chunked:
+            self.send_header("Transfer-Encoding", "chunked")
+        else:
+            self.send_header("Content-Length", str(len(payload)))
+        self.end_headers()
+
+        reset_at = None
+        if shaped and status == 200 and args.reset_rate and random.random() < args.reset_rate:
+            reset_at = len(payload) // 2  # Обрыв соединения на середине тела
+            self.server.stats.add("resets_injected")
+
+        if self.command == "HEAD":
+            return
+        self._write_body(payload, chunked, shaped, reset_at)
+        self.server.stats.add("bytes_sent", len(payload))
+        self.server.stats.add("bytes_decoded", len(body))
+
+    def _choose_encoding(self) -> str | None:
+        # Сжатие только если клиент его запросил (Accept-Encoding) и оно включено
+        offered = [part.split(";")[0].strip() for part in self.headers.get("Accept-Encoding", "").split(",")]
+        for encoding in self.server.args.encodings:
+            if encoding in offered:
+                return encoding
+        return None
+
+    def _write_body(self, payload: bytes, chunked: bool, shaped: bool, reset_at: int | None):
+        args = self.server.args
+        piece = args.chunk_size if shaped else len(payload) or 1
+        rate = args.bandwidth * 1024 if shaped else 0
+        started = time.monotonic()
+        sent = 0
+        while sent < len(payload):
+            if reset_at is not None and sent >= reset_at:
+                self.close_connection = True
+                self.connection.shutdown(socket.SHUT_RDWR)
+                return
+            part = payload[sent:sent + piece]
+            if chunked:
+                self.wfile.write(b"%x\r\n%s\r\n" % (len(part), part))
+            else:
+                self.wfile.write(part)
+            sent += len(part)
+            if rate:
+                # Ограничение пропускной способности: не опережаем расписание rate байт/с
+                ahead = sent / rate - (time.monotonic() - started)
+                if ahead > 0:
+                    time.sleep(ahead)
+        if chunked:
+            self.wfile.write(b"0\r\n\r\n")
+
+    @staticmethod
+    def _sleep_ms(ms: float):
+        if ms and ms > 0:
+            time.sleep(ms / 1000.0)
+
+
+class MockRdbServer(ThreadingHTTPServer):
+    daemon_threads = True
+    allow_reuse_address = True
+
+    def __init__(self, args):
+        super().__init__((args.host, args.port), MockRdbHandler)
+        self.args = args
+        self.stats = Stats()
+        self.payloads = Payloads(args)
+        self.counter_lock = threading.Lock()
+        self.package_requests = 0
+        self.compressed_cache: dict[tuple, bytes] = {}
+
+    def compressed(self, body: bytes, encoding: str) -> bytes:
+        # Большие тела живут в кэше Payloads, поэтому сжатая копия считается один раз;
+        # короткие ответы (ошибки) сжимаются каждый раз
+        if len(body) < 4096:
+            return compress(body, encoding)
+        key = (id(body), encoding)
+        with self.counter_lock:
+            cached = self.compressed_cache.get(key)
+        if cached is None:
+            cached = compress(body, encoding)
+            with self.counter_lock:
+                self.compressed_cache[key] = cached
+        return cached
+
+    def handle_error(self, request, client_address):
+        # Клиент вправе оборвать передачу (таймаут, отмена, проигравший дублирующий запрос)
+        if isinstance(sys.exc_info()[1], (BrokenPipeError, ConnectionResetError)):
+            return
+        super().handle_error(request, client_address)
+
+    @property
+    def api_base(self) -> str:
+        host, port = self.server_address[:2]
+        return f"http://{host}:{port}{self.args.prefix.rstrip('/')}"
+
+
+def build_parser() -> argparse.ArgumentParser:
+    parser = argparse.ArgumentParser(
+        description="Локальный сервер-имитатор RDB API для тестов и замеров.",
+        formatter_class=argparse.RawTextHelpFormatter,
+    )
+    parser.add_argument("--host", default="127.0.0.1")
+    parser.add_argument("--port", type=int, default=8080, help="Порт (0 - выбрать свободный).")
+    parser.add_argument("--port-file", help="Записать выбранный адрес API в файл (после запуска).")
+    parser.add_argument("--prefix", default="/api", help="Путь API (по умолчанию /api).")
+    parser.add_argument("--branches", default=",".join(DEFAULT_BRANCHES),
+                        type=lambda v: [b for b in v.split(",") if b],
+                        help="Ветки через запятую; первые считаются более новыми.")
+    parser.add_argument("--arches", default=",".join(DEFAULT_ARCHES),
+                        type=lambda v: [a for a in v.split(",") if a])
+    parser.add_argument("--packages", type=int, default=20000, help="Имён пакетов в синтетической ветке.")
+    parser.add_argument("--seed", type=int, default=1)
+    parser.add_argument("--data-dir", help=(
+        "Каталог с записанными ответами: branch_tree.json и <ветка>.json[.gz].\n"
+        "Отсутствующие файлы заменяются синтетическими данными."))
+    parser.add_argument("--latency", type=float, default=0, help="Задержка перед ответом, мс.")
+    parser.add_argument("--jitter", type=float, default=0, help="Случайный разброс задержки, +-мс.")
+    parser.add_argument("--handshake-latency", type=float, default=0,
+                        help="Задержка при новом соединении (имитация TCP/TLS), мс.")
+    parser.add_argument("--bandwidth", type=float, default=0,
+                        help="Пропускная способность на соединение, КиБ/с (0 - без ограничения).")
+    parser.add_argument("--chunked", action="store_true", help="Отдавать тело с Transfer-Encoding: chunked.")
+    parser.add_argument("--chunk-size", type=int, default=16384, help="Размер порции записи тела, байт.")
+    parser.add_argument("--encodings", default="",
+                        type=lambda v: [e for e in v.split(",") if e],
+                        help="Поддерживаемые Content-Encoding в порядке предпочтения "
+                             f"({','.join(ENCODINGS)}; all - все доступные).")
+    parser.add_argument("--error-rate", type=float, default=0, help="Доля запросов пакетов с ошибкой.")
+    parser.add_argument("--error-status", type=int, default=503)
+    parser.add_argument("--fail-first", type=int, default=0, help="Первые N запросов пакетов завершаются ошибкой.")
+    parser.add_argument("--reset-rate", type=float, default=0, help="Доля ответов, оборванных на середине.")
+    parser.add_argument("--no-etag", action="store_true", help="Не отдавать ETag (и не отвечать 304).")
+    parser.add_argument("--quiet", action="store_true", help="Не писать журнал запросов.")
+    return parser
+
+
+def main():
+    args = build_parser().parse_args()
+    if args.encodings == ["all"]:
+        args.encodings = list(reversed(ENCODINGS))  # zstd и br сжимают лучше gzip
+    for encoding in args.encodings:
+        if encoding not in ENCODINGS:
+            sys.exit(f"Неподдерживаемое сжатие: {encoding}")
+    server = MockRdbServer(args)
+    if args.port_file:
+        with open(args.port_file + ".tmp", "w") as f:
+            f.write(server.api_base + "\n")
+        os.replace(args.port_file + ".tmp", args.port_file)
+    sys.stderr.write(f"mock-rdb: {server.api_base}\n")
+    try:
+        server.serve_forever()
+    except KeyboardInterrupt:
+        pass
+    finally:
+        server.server_close()
+
+
+if __name__ == "__main__":
+    main()
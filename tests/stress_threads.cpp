@@ -0,0 +1,289 @@
+// Нагрузочная проверка потокобезопасности библиотеки и замер масштабирования по потокам.
+//
+// N потоков одновременно загружают две ветки с tests/mock_rdb_server.py и сравнивают их:
+//   separate - у каждого потока свой контекст (rdbcompare_ctx_new);
+//   shared   - все потоки делят один контекст и по ходу меняют его настройки;
+//   default  - функции без контекста (контекст по умолчанию).
+// Каждый ответ сверяется с эталоном, полученным до запуска потоков. С --no-fetch потоки
+// только сравнивают заранее загруженные данные (без кэша результатов) - так замеряется
+// масштабирование самого сравнения, а не имитатора сервера.
+//
+// make stress        - сборка библиотеки и проверки с -fsanitize=thread и прогон
+// make bench_threads - обычная сборка, замер для 1, 2, 4 и 8 потоков
+//
+// Пример:
+//   build/tsan/stress_threads --api-base http://127.0.0.1:8080/api --threads 4,8 --iterations 5
+#include "rdbcompare.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+    struct Options {
+        std::string api_base;
+        std::vector<int> threads = {8};
+        int iterations = 10;
+        std::vector<std::string> modes = {"separate", "shared", "default"};
+        std::string branch1 = "sisyphus";
+        std::string branch2 = "p11";
+        bool fetch = true;
+    };
+
+    struct CFree {
+        void operator()(char* p) const { std::free(p); }
+    };
+    using CString = std::unique_ptr<char, CFree>;
+
+    std::vector<std::string> split(const std::string& text) {
+        std::vector<std::string> items;
+        size_t start = 0;
+        while (start <= text.size()) {
+            size_t comma = text.find(',', start);
+            if (comma == std::string::npos) {
+                comma = text.size();
+            }
+            if (comma > start) {
+                items.push_back(text.substr(start, comma - start));
+            }
+            start = comma + 1;
+        }
+        return items;
+    }
+
+    bool parse_args(int argc, char** argv, Options& opts) {
+        for (int i = 1; i < argc; ++i) {
+            std::string arg = argv[i];
+            auto value = [&]() -> const char* { return i + 1 < argc ? argv[++i] : nullptr; };
+            const char* v = nullptr;
+            if (arg == "--no-fetch") {
+                opts.fetch = false;
+                continue;
+            }
+            if (!(v = value())) {
+                std::cerr << "Error: Missing value for " << arg << std::endl;
+                return false;
+            }
+            if (arg == "--api-base") {
+                opts.api_base = v;
+            } else if (arg == "--threads") {
+                opts.threads.clear();
+                for (const std::string& item : split(v)) {
+                    opts.threads.push_back(std::max(1, std::atoi(item.c_str())));
+                }
+            } else if (arg == "--iterations") {
+                opts.iterations = std::max(1, std::atoi(v));
+            } else if (arg == "--modes") {
+                opts.modes = split(v);
+            } else if (arg == "--branch1") {
+                opts.branch1 = v;
+            } else if (arg == "--branch2") {
+                opts.branch2 = v;
+            } else {
+                std::cerr << "Error: Unknown argument " << arg << std::endl;
+                return false;
+            }
+        }
+        if (opts.api_base.empty() || opts.threads.empty()) {
+            std::cerr << "Usage: stress_threads --api-base URL [--threads 1,2,4,8] [--iterations N]\n"
+                         "                      [--modes separate,shared,default] [--branch1 B] [--branch2 B] [--no-fetch]"
+                      << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    void configure(rdbcompare_ctx_t* ctx, const Options& opts) {
+        // Кэш веток и результатов на диске не нужен: потоки не должны мешать друг другу через файлы
+        rdbcompare_ctx_set_option(ctx, "api_base", opts.api_base.c_str());
+        rdbcompare_ctx_set_option(ctx, "persist_cache", "0");
+        rdbcompare_ctx_set_option(ctx, "persist_memo", "0");
+        rdbcompare_ctx_set_option(ctx, "retries", "0");
+        if (!opts.fetch) {
+            rdbcompare_ctx_set_option(ctx, "memo_size", "0");
+            rdbcompare_ctx_set_option(ctx, "fragment_cache_bytes", "0");
+        }
+    }
+
+    struct Reference {
+        CString data1, data2;
+        std::string json;
+        size_t total = 0;
+    };
+
+    // Одна итерация потока: загрузка (если нужна), сравнение в JSON и курсором, счётчики
+    bool run_iteration(rdbcompare_ctx_t* ctx, const Options& opts, const Reference& reference, int iteration) {
+        CString fetched1, fetched2;
+        const char* data1 = reference.data1.get();
+        const char* data2 = reference.data2.get();
+        if (opts.fetch) {
+            // На чётных итерациях загрузка с флагом отмены (не срабатывающим): одновременные
+            // загрузки той же ветки тогда объединяются в фоновом потоке, а не в потоке вызова
+            rdbcompare_options_t* options = nullptr;
+            rdbcompare_cancel_t* cancel = nullptr;
+            if (iteration % 2 == 0) {
+                options = rdbcompare_options_new();
+                cancel = rdbcompare_cancel_new();
+                rdbcompare_options_set_cancel(options, cancel);
+            }
+            fetched1.reset(rdbcompare_ctx_fetch_package_list(ctx, opts.branch1.c_str(), options));
+            fetched2.reset(rdbcompare_ctx_fetch_package_list(ctx, opts.branch2.c_str(), options));
+            rdbcompare_options_free(options);
+            rdbcompare_cancel_free(cancel);
+            if (!fetched1 || !fetched2) {
+                std::cerr << "Error: fetch failed" << std::endl;
+                return false;
+            }
+            data1 = fetched1.get();
+            data2 = fetched2.get();
+        }
+
+        CString json(rdbcompare_ctx_compare_packages(ctx, data1, data2, nullptr));
+        if (!json || reference.json != json.get()) {
+            std::cerr << "Error: compare_packages result differs from reference" << std::endl;
+            return false;
+        }
+
+        rdbcompare_result_t* result = rdbcompare_ctx_compare(ctx, data1, data2, nullptr);
+        size_t total = rdbcompare_result_count(result, nullptr, -1);
+        size_t walked = 0;
+        rdbcompare_entry_t entry;
+        rdbcompare_result_seek(result, nullptr, -1);
+        while (rdbcompare_result_next(result, &entry)) {
+            walked++;
+        }
+        rdbcompare_result_free(result);
+        if (total != reference.total || walked != total) {
+            std::cerr << "Error: result cursor differs from reference" << std::endl;
+            return false;
+        }
+
+        if (opts.fetch && iteration % 2 == 1) {
+            // Настройки и счётчики контекста меняются и читаются одновременно со сравнениями
+            rdbcompare_ctx_set_option(ctx, "memo_size", iteration % 4 == 1 ? "0" : "8");
+            CString stats(rdbcompare_ctx_stats_json(ctx));
+            CString endpoints(rdbcompare_ctx_endpoints_json(ctx));
+        }
+        return true;
+    }
+
+    // Возвращает время прогона в секундах или -1 при ошибке
+    double run_mode(const std::string& mode, int threads, const Options& opts, const Reference& reference) {
+        rdbcompare_ctx_t* shared = nullptr;
+        if (mode == "shared") {
+            shared = rdbcompare_ctx_new();
+            configure(shared, opts);
+        }
+        std::atomic<bool> failed{false};
+        std::atomic<int> ready{0};
+        std::atomic<bool> go{false};
+        std::vector<std::thread> pool;
+        for (int t = 0; t < threads; ++t) {
+            pool.emplace_back([&] {
+                // В режиме default все потоки работают с контекстом по умолчанию (ctx == NULL)
+                rdbcompare_ctx_t* own = mode == "separate" ? rdbcompare_ctx_new() : nullptr;
+                if (own) {
+                    configure(own, opts);
+                }
+                rdbcompare_ctx_t* ctx = mode == "shared" ? shared : own;
+                ready++;
+                while (!go.load()) {
+                    std::this_thread::yield();
+                }
+                for (int i = 0; i < opts.iterations && !failed.load(); ++i) {
+                    if (!run_iteration(ctx, opts, reference, i)) {
+                        failed = true;
+                    }
+                }
+                rdbcompare_ctx_free(own);
+            });
+        }
+        while (ready.load() < threads) {
+            std::this_thread::yield();
+        }
+        auto started = std::chrono::steady_clock::now();
+        go = true;
+        for (std::thread& thread : pool) {
+            thread.join();
+        }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+        rdbcompare_ctx_free(shared);
+        return failed.load() ? -1 : seconds;
+    }
+
+}
+
+int main(int argc, char** argv) {
+    Options opts;
+    if (!parse_args(argc, argv, opts)) {
+        return 2;
+    }
+    rdbcompare_init();
+    rdbcompare_set_option("api_base", opts.api_base.c_str());
+    rdbcompare_set_option("persist_cache", "0");
+    rdbcompare_set_option("persist_memo", "0");
+    rdbcompare_set_option("retries", "0");
+    if (!opts.fetch) {
+        rdbcompare_set_option("memo_size", "0");
+        rdbcompare_set_option("fragment_cache_bytes", "0");
+    }
+
+    // Эталон в отдельном контексте, чтобы его кэши не влияли на замер
+    Reference reference;
+    {
+        rdbcompare_ctx_t* ctx = rdbcompare_ctx_new();
+        configure(ctx, opts);
+        reference.data1.reset(rdbcompare_ctx_fetch_package_list(ctx, opts.branch1.c_str(), nullptr));
+        reference.data2.reset(rdbcompare_ctx_fetch_package_list(ctx, opts.branch2.c_str(), nullptr));
+        if (!reference.data1 || !reference.data2) {
+            std::cerr << "Error: Failed to fetch reference data from " << opts.api_base << std::endl;
+            rdbcompare_ctx_free(ctx);
+            return 1;
+        }
+        CString json(rdbcompare_ctx_compare_packages(ctx, reference.data1.get(), reference.data2.get(), nullptr));
+        rdbcompare_result_t* result = rdbcompare_ctx_compare(ctx, reference.data1.get(), reference.data2.get(), nullptr);
+        if (!json || !result) {
+            std::cerr << "Error: Failed to compare reference data" << std::endl;
+            rdbcompare_result_free(result);
+            rdbcompare_ctx_free(ctx);
+            return 1;
+        }
+        reference.json = json.get();
+        reference.total = rdbcompare_result_count(result, nullptr, -1);
+        rdbcompare_result_free(result);
+        rdbcompare_ctx_free(ctx);
+    }
+
+    std::printf("%-8s %7s %10s %9s %10s %8s\n", "mode", "threads", "iterations", "time,s", "compares/s", "speedup");
+    int status = 0;
+    for (const std::string& mode : opts.modes) {
+        double base_rate = 0;
+        for (int threads : opts.threads) {
+            double seconds = run_mode(mode, threads, opts, reference);
+            if (seconds < 0) {
+                std::printf("%-8s %7d %10s\n", mode.c_str(), threads, "FAILED");
+                status = 1;
+                continue;
+            }
+            // Сравнений в секунду: по два на итерацию (JSON и курсор); ускорение - к первой строке режима
+            double rate = 2.0 * threads * opts.iterations / seconds;
+            if (base_rate == 0) {
+                base_rate = rate;
+            }
+            std::printf("%-8s %7d %10d %9.3f %10.1f %8.2f\n", mode.c_str(), threads, threads * opts.iterations,
+                        seconds, rate, rate / base_rate);
+            std::fflush(stdout);
+        }
+    }
+    rdbcompare_cleanup();
+    return status;
+}